@@ -37,7 +37,10 @@
 #include "paramset.h"
 #include "stats.h"
 #include "parallel.h"
+#include "simd.h"
 #include <algorithm>
+#include <array>
+#include <mutex>
 
 namespace pbrt {
 
@@ -45,6 +48,13 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_COUNTER("BVH/Nodes with oriented bounds", orientedNodes);
+STAT_PERCENT("BVH/Nodes culled by oriented bounds", nOrientedCulled,
+             nOrientedTests);
+STAT_RATIO("BVH/Strand pieces per run", strandRunPieces, strandRuns);
+STAT_COUNTER("BVH/Wide nodes", wideInteriorNodes);
+STAT_COUNTER("BVH/Spatial splits", spatialSplits);
+STAT_RATIO("BVH/References per primitive", sbvhReferences, sbvhPrimitives);
 
 // BVHAccel Local Declarations
 struct BVHPrimitiveInfo {
@@ -56,8 +66,57 @@ struct BVHPrimitiveInfo {
     size_t primitiveNumber;
     Bounds3f bounds;
     Point3f centroid;
+    // Number of consecutive primitives starting at _primitiveNumber_ that
+    // are kept together in one leaf; see _BVHAccel::strandBuild()_.
+    int nPrimitives = 1;
 };
 
+// A subtree whose construction _BVHAccel::recursiveBuild()_ has left for
+// _BVHAccel::parallelBuild()_; _node_ already has the subtree's bounds and
+// _primOffset_ is where its primitives go in _orderedPrims_.
+struct BVHSubtree {
+    BVHBuildNode *node;
+    int start, end;
+    int primOffset;
+};
+
+// The SAH build computes bounds and buckets for ranges of at least
+// _parallelItems_ build items in parallel (see the _BVHAccel_
+// constructor), in chunks of a quarter of that, and leaves subtrees of at
+// most an eighth of that to be built in parallel once the upper levels of
+// the tree are done.
+static int ParallelChunkItems(int parallelItems) {
+    return std::max(1, parallelItems / 4);
+}
+
+static int ParallelSubtreeItems(int parallelItems) {
+    return std::max(1, parallelItems / 8);
+}
+
+// Reduces the build items in _[start, end)_ to a _T_, where _func(s, e,
+// &t)_ accumulates items _[s, e)_ into _t_ and _merge_ combines two
+// results.  With _parallel_, ranges of at least _parallelItems_ are split
+// into chunks that are processed in parallel and then merged in order, so
+// the result is the same as with a single thread.
+template <typename T, typename Func, typename Merge>
+static T ReduceBuildItems(bool parallel, int parallelItems, int start,
+                          int end, const T &init, Func func, Merge merge) {
+    T result = init;
+    if (!parallel || end - start < parallelItems) {
+        func(start, end, &result);
+        return result;
+    }
+    int chunkItems = ParallelChunkItems(parallelItems);
+    int nChunks = (end - start + chunkItems - 1) / chunkItems;
+    std::vector<T> chunks(nChunks, init);
+    ParallelFor([&](int64_t c) {
+        int chunkStart = start + c * chunkItems;
+        func(chunkStart, std::min(end, chunkStart + chunkItems), &chunks[c]);
+    }, nChunks);
+    for (const T &chunk : chunks) result = merge(result, chunk);
+    return result;
+}
+
 struct BVHBuildNode {
     // BVHBuildNode Public Methods
     void InitLeaf(int first, int n, const Bounds3f &b) {
@@ -96,13 +155,359 @@ struct LinearBVHNode {
     Bounds3f bounds;
     union {
         int primitivesOffset;   // leaf
-        int secondChildOffset;  // interior
+        int secondChildOffset;  // interior, depth-first layout
+        int firstChildOffset;   // interior, other layouts
     };
     uint16_t nPrimitives;  // 0 -> interior node
     uint8_t axis;          // interior node: xyz
     uint8_t pad[1];        // ensure 32 byte total size
 };
 
+// A ray recorded by a BVH with the "rayfile" parameter and the leaves in
+// which primitive intersections reduced its _tMax_ or, for _IntersectP()_
+// rays, in which one was found, in traversal order.
+struct RecordedBVHRay {
+    Float o[3], d[3], tMax;
+    int32_t anyHit;
+    int32_t firstHit, nHits;  // in _BVHRayRecording::hits_
+};
+
+struct RecordedBVHHit {
+    int32_t nodeIndex;  // of the leaf, in the depth-first layout
+    Float tMax;
+};
+
+struct BVHRayRecording {
+    std::vector<LinearBVHNode> nodes;  // depth-first layout
+    std::vector<RecordedBVHRay> rays;
+    std::vector<RecordedBVHHit> hits;
+};
+
+struct BVHRayRecorder {
+    std::string filename;
+    std::mutex mutex;
+    BVHRayRecording recording;
+    int64_t nDropped = 0;
+};
+
+// Recording stops after this many rays; render a smaller image or a crop
+// window to record a representative set
+static PBRT_CONSTEXPR size_t maxRecordedRays = 1 << 22;
+
+// Ray files start with this header, followed by the arrays of a
+// _BVHRayRecording_
+struct BVHRayFileHeader {
+    char magic[8];
+    int32_t floatSize, nodeSize;
+    int64_t nNodes, nRays, nHits;
+};
+static const char bvhRayFileMagic[8] = {'P', 'B', 'R', 'T', 'R', 'A', 'Y', '1'};
+
+static void WriteBVHRayRecording(const std::string &filename,
+                                 const BVHRayRecording &recording) {
+    BVHRayFileHeader header;
+    memcpy(header.magic, bvhRayFileMagic, sizeof(header.magic));
+    header.floatSize = sizeof(Float);
+    header.nodeSize = sizeof(LinearBVHNode);
+    header.nNodes = recording.nodes.size();
+    header.nRays = recording.rays.size();
+    header.nHits = recording.hits.size();
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f || fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(recording.nodes.data(), sizeof(LinearBVHNode), header.nNodes,
+               f) != size_t(header.nNodes) ||
+        fwrite(recording.rays.data(), sizeof(RecordedBVHRay), header.nRays,
+               f) != size_t(header.nRays) ||
+        fwrite(recording.hits.data(), sizeof(RecordedBVHHit), header.nHits,
+               f) != size_t(header.nHits))
+        Error("%s: unable to write BVH rays.", filename.c_str());
+    else
+        LOG(INFO) << StringPrintf("Recorded %d BVH rays in \"%s\"",
+                                  (int)header.nRays, filename.c_str());
+    if (f) fclose(f);
+}
+
+struct OrientedBVHBounds {
+    bool IntersectP(const Ray &ray) const {
+        Ray r(Point3f(Dot(Vector3f(ray.o), axis[0]),
+                      Dot(Vector3f(ray.o), axis[1]),
+                      Dot(Vector3f(ray.o), axis[2])),
+              Vector3f(Dot(ray.d, axis[0]), Dot(ray.d, axis[1]),
+                       Dot(ray.d, axis[2])),
+              ray.tMax);
+        return bounds.IntersectP(r);
+    }
+    // Orthonormal world-space frame and the bounds in its coordinates
+    Vector3f axis[3];
+    Bounds3f bounds;
+};
+
+// Tests a ray against the four boxes given by _bounds_, stored by lane as
+// in _WideBVHLanes_.  Returns a bit mask of the lanes whose bounds the ray
+// hits and their entry distances in _tNear_, like _Bounds3::IntersectP()_.
+static inline int LanesIntersectP(const Float bounds[2][3][4], const Ray &ray,
+                                  const Vector3f &invDir,
+                                  const int dirIsNeg[3], Float tNear[4]) {
+#ifdef PBRT_HAVE_FLOAT4
+    Float4 t0(0.f), t1(ray.tMax);
+    for (int a = 0; a < 3; ++a) {
+        Float4 o(ray.o[a]), inv(invDir[a]);
+        Float4 tn = (Float4::Load(bounds[dirIsNeg[a]][a]) - o) * inv;
+        Float4 tf = (Float4::Load(bounds[1 - dirIsNeg[a]][a]) - o) * inv;
+        // Update _tf_ to ensure robust ray--bounds intersection
+        tf = tf * Float4(1 + 2 * gamma(3));
+        t0 = Max(tn, t0);
+        t1 = Min(tf, t1);
+    }
+    t0.Store(tNear);
+    return (t0 <= t1).Bits();
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        Float t0 = 0, t1 = ray.tMax;
+        for (int a = 0; a < 3; ++a) {
+            Float tn = (bounds[dirIsNeg[a]][a][i] - ray.o[a]) * invDir[a];
+            Float tf = (bounds[1 - dirIsNeg[a]][a][i] - ray.o[a]) * invDir[a];
+            tf *= 1 + 2 * gamma(3);
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Four children of a wide BVH node, with their bounds stored by lane so
+// that a ray can be tested against all of them at once; nodes of width 8
+// consist of two consecutive _WideBVHLanes_.  Unused lanes have empty
+// bounds and an _offset_ of -1.
+struct WideBVHLanes {
+    WideBVHLanes() {
+        for (int i = 0; i < 4; ++i) {
+            for (int a = 0; a < 3; ++a) {
+                bounds[0][a][i] = Infinity;
+                bounds[1][a][i] = -Infinity;
+            }
+            offset[i] = -1;
+            nPrimitives[i] = 0;
+        }
+    }
+    int IntersectP(const Ray &ray, const Vector3f &invDir,
+                   const int dirIsNeg[3], Float tNear[4]) const {
+        return LanesIntersectP(bounds, ray, invDir, dirIsNeg, tNear);
+    }
+    // Lower and upper corner of each lane's bounds, by axis
+    Float bounds[2][3][4];
+    // Index of the first _WideBVHLanes_ of interior children, or the
+    // offset of the first primitive of leaves
+    int32_t offset[4];
+    uint16_t nPrimitives[4];  // 0 -> interior child
+    uint16_t pad[4];          // ensure 128 byte total size for floats
+};
+
+// _WideBVHLanes_ with the bounds quantized to 8 bits per coordinate on a
+// grid over the union of the lanes' bounds.  The grid spacing along each
+// axis is a power of two, so that decoding only rounds in the final
+// addition; lower corners are rounded down and upper corners up such that
+// the decoded bounds always contain the original ones.  Unused lanes
+// decode to empty bounds, which no ray hits.
+struct CompressedBVHLanes {
+    CompressedBVHLanes(const WideBVHLanes &lanes) {
+        Bounds3f bounds;
+        for (int i = 0; i < 4; ++i)
+            if (lanes.offset[i] >= 0)
+                bounds = Union(
+                    bounds,
+                    Bounds3f(Point3f(lanes.bounds[0][0][i],
+                                     lanes.bounds[0][1][i],
+                                     lanes.bounds[0][2][i]),
+                             Point3f(lanes.bounds[1][0][i],
+                                     lanes.bounds[1][1][i],
+                                     lanes.bounds[1][2][i])));
+        for (int a = 0; a < 3; ++a) {
+            // Find the smallest spacing that spans the bounds in 255 steps
+            origin[a] = bounds.IsEmpty() ? 0 : bounds.pMin[a];
+            Float extent = bounds.pMax[a] - bounds.pMin[a];
+            int e = minExponent;
+            if (extent > 0) std::frexp(extent / 255, &e);
+            e = Clamp(e, minExponent, maxExponent);
+            while (e < maxExponent &&
+                   origin[a] + 255 * Scale(e) < bounds.pMax[a])
+                ++e;
+            exponent[a] = e;
+            Float scale = Scale(e);
+
+            for (int i = 0; i < 4; ++i) {
+                if (lanes.offset[i] < 0) {
+                    q[0][a][i] = 255;
+                    q[1][a][i] = 0;
+                    continue;
+                }
+                Float lo = lanes.bounds[0][a][i], hi = lanes.bounds[1][a][i];
+                int qLo = Clamp(std::floor((lo - origin[a]) / scale), 0, 255);
+                while (qLo > 0 && origin[a] + qLo * scale > lo) --qLo;
+                int qHi = Clamp(std::ceil((hi - origin[a]) / scale), 0, 255);
+                while (qHi < 255 && origin[a] + qHi * scale < hi) ++qHi;
+                q[0][a][i] = qLo;
+                q[1][a][i] = qHi;
+            }
+        }
+        for (int i = 0; i < 4; ++i) {
+            offset[i] = lanes.offset[i];
+            nPrimitives[i] = lanes.nPrimitives[i];
+        }
+    }
+    int IntersectP(const Ray &ray, const Vector3f &invDir,
+                   const int dirIsNeg[3], Float tNear[4]) const {
+        Float bounds[2][3][4];
+        for (int a = 0; a < 3; ++a) {
+            Float scale = Scale(exponent[a]);
+#ifdef PBRT_HAVE_FLOAT4
+            for (int c = 0; c < 2; ++c)
+                (Float4(origin[a]) +
+                 Float4(scale) * Float4(q[c][a][0], q[c][a][1], q[c][a][2],
+                                        q[c][a][3]))
+                    .Store(bounds[c][a]);
+#else
+            for (int c = 0; c < 2; ++c)
+                for (int i = 0; i < 4; ++i)
+                    bounds[c][a][i] = origin[a] + q[c][a][i] * scale;
+#endif
+        }
+        return LanesIntersectP(bounds, ray, invDir, dirIsNeg, tNear);
+    }
+    // Returns 2^_e_, for exponents in the range of normalized floats
+    static Float Scale(int e) { return BitsToFloat(uint32_t(e + 127) << 23); }
+    static PBRT_CONSTEXPR int minExponent = -126, maxExponent = 127;
+
+    Float origin[3];
+    int8_t exponent[3];
+    uint8_t pad;
+    // Quantized lower and upper corner of each lane's bounds, by axis
+    uint8_t q[2][3][4];
+    int32_t offset[4];
+    uint16_t nPrimitives[4];  // 0 -> interior child
+};
+
+// Returns the interior children of the depth-first BVH node at _parent_,
+// whose own children are stored as pairs by layouts other than depth-first
+static int ChildPairs(const std::vector<LinearBVHNode> &nodes, int parent,
+                      int pairs[2]) {
+    int n = 0;
+    for (int c : {parent + 1, nodes[parent].secondChildOffset})
+        if (nodes[c].nPrimitives == 0) pairs[n++] = c;
+    return n;
+}
+
+// Appends the pairs of children in the subtree of the pair of _parent_ that
+// are less than _height_ pairs below it to _order_, in van Emde Boas order,
+// and the pairs _height_ below it to _bottom_.
+static void VanEmdeBoasOrder(const std::vector<LinearBVHNode> &nodes,
+                             int parent, int height, std::vector<int> *order,
+                             std::vector<int> *bottom) {
+    if (height == 1) {
+        order->push_back(parent);
+        int pairs[2];
+        int n = ChildPairs(nodes, parent, pairs);
+        bottom->insert(bottom->end(), pairs, pairs + n);
+        return;
+    }
+    // Lay out the top half of the subtree and then each subtree below it
+    int topHeight = height / 2;
+    std::vector<int> roots;
+    VanEmdeBoasOrder(nodes, parent, topHeight, order, &roots);
+    for (int root : roots)
+        VanEmdeBoasOrder(nodes, root, height - topHeight, order, bottom);
+}
+
+// Returns the nodes of the depth-first BVH _dfsNodes_ laid out in memory
+// according to _layout_, and the new index of each node in _newIndex_.
+// Other layouts than depth-first store the two children of each interior
+// node next to each other so that they share a cache line, following the
+// root and an unused node that aligns the pairs.  _Probability_ orders the
+// pairs depth-first, visiting the children with the larger surface area
+// and thus the more likely to be hit by a ray first, while _VanEmdeBoas_
+// recursively splits the tree by height so that subtrees of all sizes are
+// stored close together.
+static std::vector<LinearBVHNode> LayOutBVHNodes(
+    const std::vector<LinearBVHNode> &dfsNodes, BVHAccel::Layout layout,
+    std::vector<int> *newIndex) {
+    int nNodes = dfsNodes.size();
+    newIndex->resize(nNodes);
+    if (layout == BVHAccel::Layout::DepthFirst) {
+        for (int i = 0; i < nNodes; ++i) (*newIndex)[i] = i;
+        return dfsNodes;
+    }
+
+    // Find the order of the pairs of children, given by their parents
+    std::vector<int> order;
+    if (dfsNodes[0].nPrimitives == 0) {
+        if (layout == BVHAccel::Layout::Probability) {
+            std::vector<int> toVisit(1, 0);
+            while (!toVisit.empty()) {
+                int parent = toVisit.back();
+                toVisit.pop_back();
+                order.push_back(parent);
+                int pairs[2];
+                int n = ChildPairs(dfsNodes, parent, pairs);
+                if (n == 2 && dfsNodes[pairs[0]].bounds.SurfaceArea() >
+                                  dfsNodes[pairs[1]].bounds.SurfaceArea())
+                    std::swap(pairs[0], pairs[1]);
+                toVisit.insert(toVisit.end(), pairs, pairs + n);
+            }
+        } else {
+            // Children follow their parents in the depth-first layout
+            std::vector<int> height(nNodes, 0);
+            for (int i = nNodes - 1; i >= 0; --i) {
+                if (dfsNodes[i].nPrimitives > 0) continue;
+                int pairs[2];
+                int n = ChildPairs(dfsNodes, i, pairs);
+                height[i] = 1;
+                for (int j = 0; j < n; ++j)
+                    height[i] = std::max(height[i], height[pairs[j]] + 1);
+            }
+            std::vector<int> bottom;
+            VanEmdeBoasOrder(dfsNodes, 0, height[0], &order, &bottom);
+            CHECK(bottom.empty());
+        }
+    }
+
+    std::vector<LinearBVHNode> nodes(nNodes + 1);
+    nodes[0] = dfsNodes[0];
+    (*newIndex)[0] = 0;
+    nodes[1].nPrimitives = 0;
+    nodes[1].firstChildOffset = 0;
+    nodes[1].axis = 0;
+    std::vector<int> pairOffset(nNodes, -1);
+    for (size_t i = 0; i < order.size(); ++i) {
+        int parent = order[i], offset = 2 + 2 * i;
+        pairOffset[parent] = offset;
+        int children[2] = {parent + 1, dfsNodes[parent].secondChildOffset};
+        for (int j = 0; j < 2; ++j) {
+            nodes[offset + j] = dfsNodes[children[j]];
+            (*newIndex)[children[j]] = offset + j;
+        }
+    }
+    CHECK_EQ(2 + 2 * order.size(), nodes.size());
+    for (int i = 0; i < nNodes; ++i)
+        if (dfsNodes[i].nPrimitives == 0)
+            nodes[(*newIndex)[i]].firstChildOffset = pairOffset[i];
+    return nodes;
+}
+
+// Oriented bounds are fit to subtrees with at most this many primitives and
+// are kept if their surface area is below this fraction of the node's.
+static PBRT_CONSTEXPR int maxOrientedPrims = 16;
+static PBRT_CONSTEXPR Float maxOrientedAreaRatio = 0.75f;
+
+// The SAH treats rays as independent and doesn't see that a ray grazing a
+// strand tests its consecutive pieces one after the other.  A strand run
+// is only broken where splitting it is estimated to be this many times
+// cheaper than a leaf holding it.
+static PBRT_CONSTEXPR Float strandRunBias = 1.5f;
+
 // BVHAccel Utility Functions
 inline uint32_t LeftShift3(uint32_t x) {
     CHECK_LE(x, (1 << 10));
@@ -181,53 +586,160 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
 
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod,
+                   bool orientedBounds, int width, Float splitBudget,
+                   bool compressed, Layout layout, const std::string &rayFile,
+                   int parallelItems, bool quiet)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
-      primitives(std::move(p)) {
+      parallelItems(std::max(1, parallelItems)),
+      primitives(std::move(p)),
+      layout(layout),
+      width(width) {
+    CHECK(width == 2 || width == 4 || width == 8);
+    CHECK(width == 2 || layout == Layout::DepthFirst);
+    CHECK(rayFile.empty() || (width == 2 && layout == Layout::DepthFirst &&
+                              !orientedBounds));
     ProfilePhase _(Prof::AccelConstruction);
     if (primitives.empty()) return;
     // Build BVH from _primitives_
 
     // Initialize _primitiveInfo_ array for primitives
     std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-    for (size_t i = 0; i < primitives.size(); ++i)
-        primitiveInfo[i] = {i, primitives[i]->WorldBound()};
+    auto initInfo = [&](int64_t i) {
+        primitiveInfo[i] = {size_t(i), primitives[i]->WorldBound()};
+    };
+    if (primitives.size() >= size_t(parallelItems))
+        ParallelFor(initInfo, primitives.size(), 4096);
+    else
+        for (size_t i = 0; i < primitives.size(); ++i) initInfo(i);
 
-    // Build BVH tree for primitives using _primitiveInfo_
-    MemoryArena arena(1024 * 1024);
+    // Build BVH tree for primitives using _primitiveInfo_; the first arena
+    // is used by the main thread and the others by _parallelBuild()_
+    std::vector<MemoryArena> arenas(MaxThreadIndex());
+    MemoryArena &arena = arenas[0];
     int totalNodes = 0;
     std::vector<std::shared_ptr<Primitive>> orderedPrims;
     orderedPrims.reserve(primitives.size());
     BVHBuildNode *root;
     if (splitMethod == SplitMethod::HLBVH)
         root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
+    else if (splitMethod == SplitMethod::Strands)
+        root = strandBuild(arenas, primitiveInfo, orientedBounds, &totalNodes,
+                           orderedPrims);
+    else if (splitMethod == SplitMethod::SAH)
+        root = parallelBuild(arenas, primitiveInfo, &totalNodes, orderedPrims);
+    else if (splitMethod == SplitMethod::SBVH) {
+        Bounds3f bounds;
+        for (const BVHPrimitiveInfo &pi : primitiveInfo)
+            bounds = Union(bounds, pi.bounds);
+        int budget = std::min<double>(splitBudget * primitives.size(),
+                                     std::numeric_limits<int>::max());
+        sbvhPrimitives += primitives.size();
+        root = spatialSplitBuild(arena, primitiveInfo, bounds.SurfaceArea(),
+                                 &budget, &totalNodes, orderedPrims);
+    }
     else
         root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
                               &totalNodes, orderedPrims);
     primitives.swap(orderedPrims);
     primitiveInfo.resize(0);
-    LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
-                              "primitives (%.2f MB), arena allocated %.2f MB",
-                              totalNodes, (int)primitives.size(),
-                              float(totalNodes * sizeof(LinearBVHNode)) /
-                              (1024.f * 1024.f),
-                              float(arena.TotalAllocated()) /
-                              (1024.f * 1024.f));
+    size_t arenaBytes = 0;
+    for (const MemoryArena &a : arenas) arenaBytes += a.TotalAllocated();
+    LOG_IF(INFO, !quiet) << StringPrintf(
+        "BVH created with %d nodes for %d primitives (%.2f MB), arena "
+        "allocated %.2f MB",
+        totalNodes, (int)primitives.size(),
+        float(totalNodes * sizeof(LinearBVHNode)) / (1024.f * 1024.f),
+        float(arenaBytes) / (1024.f * 1024.f));
+
+    if (width > 2) {
+        // Collapse the binary tree into nodes with _width_ children
+        std::vector<WideBVHLanes> lanes;
+        flattenWideBVH(root, &lanes);
+        size_t laneBytes;
+        if (compressed) {
+            compressedNodes = AllocAligned<CompressedBVHLanes>(lanes.size());
+            for (size_t i = 0; i < lanes.size(); ++i)
+                new (&compressedNodes[i]) CompressedBVHLanes(lanes[i]);
+            laneBytes = sizeof(CompressedBVHLanes);
+        } else {
+            wideNodes = AllocAligned<WideBVHLanes>(lanes.size());
+            std::copy(lanes.begin(), lanes.end(), wideNodes);
+            laneBytes = sizeof(WideBVHLanes);
+        }
+        wideBounds = root->bounds;
+        treeBytes += lanes.size() * laneBytes + sizeof(*this) +
+                     primitives.size() * sizeof(primitives[0]);
+        LOG_IF(INFO, !quiet) << StringPrintf(
+            "BVH collapsed to %d %snodes of width %d",
+            int(lanes.size() / (width / 4)), compressed ? "compressed " : "",
+            width);
+        return;
+    }
 
     // Compute representation of depth-first traversal of BVH tree
     treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
                  primitives.size() * sizeof(primitives[0]);
     nodes = AllocAligned<LinearBVHNode>(totalNodes);
+    nNodes = totalNodes;
     int offset = 0;
     flattenBVHTree(root, &offset);
     CHECK_EQ(totalNodes, offset);
+
+    if (orientedBounds) {
+        // Fit oriented bounds to the lower levels of the tree
+        std::vector<OrientedBVHBounds> fitted;
+        std::vector<int> prims;
+        obbOffsets.assign(totalNodes, -1);
+        fitOrientedBounds(0, &prims, &fitted);
+        obbs = AllocAligned<OrientedBVHBounds>(fitted.size());
+        std::copy(fitted.begin(), fitted.end(), obbs);
+        treeBytes += totalNodes * sizeof(int) +
+                     fitted.size() * sizeof(OrientedBVHBounds);
+        LOG_IF(INFO, !quiet) << StringPrintf(
+            "BVH has oriented bounds for %d of %d nodes", (int)fitted.size(),
+            totalNodes);
+    }
+
+    if (layout != Layout::DepthFirst) {
+        // Reorder the nodes and the oriented bounds' offsets for _layout_
+        std::vector<int> newIndex;
+        std::vector<LinearBVHNode> laidOut = LayOutBVHNodes(
+            std::vector<LinearBVHNode>(nodes, nodes + totalNodes), layout,
+            &newIndex);
+        FreeAligned(nodes);
+        nodes = AllocAligned<LinearBVHNode>(laidOut.size());
+        nNodes = laidOut.size();
+        std::copy(laidOut.begin(), laidOut.end(), nodes);
+        treeBytes += (laidOut.size() - totalNodes) * sizeof(LinearBVHNode);
+        if (!obbOffsets.empty()) {
+            std::vector<int> offsets(laidOut.size(), -1);
+            for (int i = 0; i < totalNodes; ++i)
+                offsets[newIndex[i]] = obbOffsets[i];
+            obbOffsets.swap(offsets);
+        }
+    }
+
+    if (!rayFile.empty()) {
+        recorder.reset(new BVHRayRecorder);
+        recorder->filename = rayFile;
+        recorder->recording.nodes.assign(nodes, nodes + totalNodes);
+    }
 }
 
 Bounds3f BVHAccel::WorldBound() const {
+    if (wideNodes || compressedNodes) return wideBounds;
     return nodes ? nodes[0].bounds : Bounds3f();
 }
 
+Bounds3f BVHAccel::Node(int i, int *offset, int *nPrimitives) const {
+    CHECK(i >= 0 && i < nNodes);
+    *offset = nodes[i].primitivesOffset;
+    *nPrimitives = nodes[i].nPrimitives;
+    return nodes[i].bounds;
+}
+
 struct BucketInfo {
     int count = 0;
     Bounds3f bounds;
@@ -236,39 +748,66 @@ struct BucketInfo {
 BVHBuildNode *BVHAccel::recursiveBuild(
     MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
     int end, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+    std::vector<BVHSubtree> *subtrees, int primOffset) {
     CHECK_NE(start, end);
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
     (*totalNodes)++;
     // Compute bounds of all primitives in BVH node
-    Bounds3f bounds;
-    for (int i = start; i < end; ++i)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
-    int nPrimitives = end - start;
-    if (nPrimitives == 1) {
+    struct RangeBounds {
+        Bounds3f bounds, centroidBounds;
+        int nPrimitives;
+    };
+    RangeBounds range = ReduceBuildItems(
+        subtrees != nullptr, parallelItems, start, end,
+        RangeBounds{Bounds3f(), Bounds3f(), 0},
+        [&](int s, int e, RangeBounds *r) {
+            for (int i = s; i < e; ++i) {
+                r->bounds = Union(r->bounds, primitiveInfo[i].bounds);
+                r->centroidBounds =
+                    Union(r->centroidBounds, primitiveInfo[i].centroid);
+                r->nPrimitives += primitiveInfo[i].nPrimitives;
+            }
+        },
+        [](const RangeBounds &a, const RangeBounds &b) {
+            return RangeBounds{Union(a.bounds, b.bounds),
+                               Union(a.centroidBounds, b.centroidBounds),
+                               a.nPrimitives + b.nPrimitives};
+        });
+    const Bounds3f &bounds = range.bounds;
+    int nPrimitives = range.nPrimitives;
+    if (subtrees && end - start <= ParallelSubtreeItems(parallelItems)) {
+        // Leave the subtree to _parallelBuild()_, reserving space for its
+        // primitives
+        node->bounds = bounds;
+        subtrees->push_back({node, start, end, int(orderedPrims.size())});
+        orderedPrims.resize(orderedPrims.size() + nPrimitives);
+        return node;
+    }
+    if (end - start == 1) {
         // Create leaf _BVHBuildNode_
-        int firstPrimOffset = orderedPrims.size();
+        int firstPrimOffset = primOffset + orderedPrims.size();
         for (int i = start; i < end; ++i) {
             int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
+            for (int j = 0; j < primitiveInfo[i].nPrimitives; ++j)
+                orderedPrims.push_back(primitives[primNum + j]);
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
         return node;
     } else {
-        // Compute bound of primitive centroids, choose split dimension _dim_
-        Bounds3f centroidBounds;
-        for (int i = start; i < end; ++i)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+        // Choose split dimension _dim_ using the bound of primitive centroids
+        const Bounds3f &centroidBounds = range.centroidBounds;
         int dim = centroidBounds.MaximumExtent();
 
         // Partition primitives into two sets and build children
         int mid = (start + end) / 2;
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
             // Create leaf _BVHBuildNode_
-            int firstPrimOffset = orderedPrims.size();
+            int firstPrimOffset = primOffset + orderedPrims.size();
             for (int i = start; i < end; ++i) {
                 int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
+                for (int j = 0; j < primitiveInfo[i].nPrimitives; ++j)
+                    orderedPrims.push_back(primitives[primNum + j]);
             }
             node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
             return node;
@@ -305,7 +844,7 @@ BVHBuildNode *BVHAccel::recursiveBuild(
             case SplitMethod::SAH:
             default: {
                 // Partition primitives using approximate SAH
-                if (nPrimitives <= 2) {
+                if (end - start <= 2) {
                     // Partition primitives into equally-sized subsets
                     mid = (start + end) / 2;
                     std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
@@ -318,20 +857,33 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                 } else {
                     // Allocate _BucketInfo_ for SAH partition buckets
                     PBRT_CONSTEXPR int nBuckets = 12;
-                    BucketInfo buckets[nBuckets];
+                    typedef std::array<BucketInfo, nBuckets> Buckets;
 
                     // Initialize _BucketInfo_ for SAH partition buckets
-                    for (int i = start; i < end; ++i) {
-                        int b = nBuckets *
-                                centroidBounds.Offset(
-                                    primitiveInfo[i].centroid)[dim];
-                        if (b == nBuckets) b = nBuckets - 1;
-                        CHECK_GE(b, 0);
-                        CHECK_LT(b, nBuckets);
-                        buckets[b].count++;
-                        buckets[b].bounds =
-                            Union(buckets[b].bounds, primitiveInfo[i].bounds);
-                    }
+                    Buckets buckets = ReduceBuildItems(
+                        subtrees != nullptr, parallelItems, start, end,
+                        Buckets(),
+                        [&](int s, int e, Buckets *buckets) {
+                            for (int i = s; i < e; ++i) {
+                                int b = nBuckets *
+                                        centroidBounds.Offset(
+                                            primitiveInfo[i].centroid)[dim];
+                                if (b == nBuckets) b = nBuckets - 1;
+                                CHECK_GE(b, 0);
+                                CHECK_LT(b, nBuckets);
+                                BucketInfo &bucket = (*buckets)[b];
+                                bucket.count += primitiveInfo[i].nPrimitives;
+                                bucket.bounds = Union(bucket.bounds,
+                                                      primitiveInfo[i].bounds);
+                            }
+                        },
+                        [](Buckets a, const Buckets &b) {
+                            for (int i = 0; i < nBuckets; ++i) {
+                                a[i].count += b[i].count;
+                                a[i].bounds = Union(a[i].bounds, b[i].bounds);
+                            }
+                            return a;
+                        });
 
                     // Compute costs for splitting after each bucket
                     Float cost[nBuckets - 1];
@@ -379,10 +931,13 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                         mid = pmid - &primitiveInfo[0];
                     } else {
                         // Create leaf _BVHBuildNode_
-                        int firstPrimOffset = orderedPrims.size();
+                        int firstPrimOffset = primOffset + orderedPrims.size();
                         for (int i = start; i < end; ++i) {
                             int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
+                            for (int j = 0; j < primitiveInfo[i].nPrimitives;
+                                 ++j)
+                                orderedPrims.push_back(
+                                    primitives[primNum + j]);
                         }
                         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
                         return node;
@@ -391,16 +946,269 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                 break;
             }
             }
-            node->InitInterior(dim,
-                               recursiveBuild(arena, primitiveInfo, start, mid,
-                                              totalNodes, orderedPrims),
-                               recursiveBuild(arena, primitiveInfo, mid, end,
-                                              totalNodes, orderedPrims));
+            node->InitInterior(
+                dim,
+                recursiveBuild(arena, primitiveInfo, start, mid, totalNodes,
+                               orderedPrims, subtrees, primOffset),
+                recursiveBuild(arena, primitiveInfo, mid, end, totalNodes,
+                               orderedPrims, subtrees, primOffset));
         }
     }
     return node;
 }
 
+// Spatial splits use bins of equal width along the axis of greatest extent
+// and are only tried where the children of the best object split overlap
+// by more than _spatialSplitOverlap_ times the surface area of the root,
+// following Stich et al.'s "Spatial Splits in Bounding Volume Hierarchies".
+static PBRT_CONSTEXPR int nSplitBins = 12;
+static PBRT_CONSTEXPR Float spatialSplitOverlap = 1e-5f;
+
+struct SAHSplit {
+    Float cost = Infinity;
+    int bin;  // Last bin on the left side
+    Bounds3f bounds[2];
+    int count[2];
+};
+
+// Finds the split between two bins with the lowest SAH cost for a node
+// with bounds _bounds_.  _enter_ and _exit_ count the references that
+// begin and end in each bin; they are the same for object splits.
+static SAHSplit FindSAHSplit(const Bounds3f &bounds,
+                             const Bounds3f binBounds[nSplitBins],
+                             const int enter[nSplitBins],
+                             const int exit[nSplitBins]) {
+    // Accumulate bounds and counts from the right
+    Bounds3f rightBounds[nSplitBins];
+    int rightCount[nSplitBins];
+    Bounds3f b;
+    int count = 0;
+    for (int i = nSplitBins - 1; i > 0; --i) {
+        b = Union(b, binBounds[i]);
+        count += exit[i];
+        rightBounds[i] = b;
+        rightCount[i] = count;
+    }
+
+    // Sweep from the left, evaluating the cost of each split
+    SAHSplit best;
+    Bounds3f leftBounds;
+    int leftCount = 0;
+    for (int i = 0; i < nSplitBins - 1; ++i) {
+        leftBounds = Union(leftBounds, binBounds[i]);
+        leftCount += enter[i];
+        if (leftCount == 0 || rightCount[i + 1] == 0) continue;
+        Float cost =
+            1 + (leftCount * leftBounds.SurfaceArea() +
+                 rightCount[i + 1] * rightBounds[i + 1].SurfaceArea()) /
+                    bounds.SurfaceArea();
+        if (cost < best.cost) {
+            best.cost = cost;
+            best.bin = i;
+            best.bounds[0] = leftBounds;
+            best.bounds[1] = rightBounds[i + 1];
+            best.count[0] = leftCount;
+            best.count[1] = rightCount[i + 1];
+        }
+    }
+    return best;
+}
+
+// Builds the subtree for the primitive references _refs_ with the SAH,
+// choosing between object splits and spatial splits, which divide the
+// node at a plane and put references that straddle it in both children
+// with bounds clipped to each side.  The number of additional references
+// this creates is deducted from _*splitBudget_; spatial splits that would
+// exceed it aren't used.  _refs_ is cleared.
+BVHBuildNode *BVHAccel::spatialSplitBuild(
+    MemoryArena &arena, std::vector<BVHPrimitiveInfo> &refs, Float rootArea,
+    int *splitBudget, int *totalNodes,
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    CHECK(!refs.empty());
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+    Bounds3f bounds, centroidBounds;
+    for (const BVHPrimitiveInfo &ref : refs) {
+        bounds = Union(bounds, ref.bounds);
+        centroidBounds = Union(centroidBounds, ref.centroid);
+    }
+    int nRefs = refs.size();
+    auto createLeaf = [&]() {
+        int firstPrimOffset = orderedPrims.size();
+        for (const BVHPrimitiveInfo &ref : refs)
+            orderedPrims.push_back(primitives[ref.primitiveNumber]);
+        node->InitLeaf(firstPrimOffset, nRefs, bounds);
+        sbvhReferences += nRefs;
+        std::vector<BVHPrimitiveInfo>().swap(refs);
+        return node;
+    };
+    if (nRefs == 1) return createLeaf();
+
+    // Find the best object split by binning reference centroids
+    SAHSplit objectSplit;
+    int objectDim = centroidBounds.MaximumExtent();
+    auto objectBin = [&](const BVHPrimitiveInfo &ref) {
+        int b = nSplitBins * centroidBounds.Offset(ref.centroid)[objectDim];
+        return std::min(b, nSplitBins - 1);
+    };
+    if (centroidBounds.pMax[objectDim] > centroidBounds.pMin[objectDim]) {
+        Bounds3f binBounds[nSplitBins];
+        int counts[nSplitBins] = {0};
+        for (const BVHPrimitiveInfo &ref : refs) {
+            int b = objectBin(ref);
+            binBounds[b] = Union(binBounds[b], ref.bounds);
+            ++counts[b];
+        }
+        objectSplit = FindSAHSplit(bounds, binBounds, counts, counts);
+    }
+
+    // Find the best spatial split if the object split's children overlap
+    SAHSplit spatialSplit;
+    int spatialDim = bounds.MaximumExtent();
+    Float binWidth = bounds.Diagonal()[spatialDim] / nSplitBins;
+    Bounds3f overlap =
+        pbrt::Intersect(objectSplit.bounds[0], objectSplit.bounds[1]);
+    if (*splitBudget > 0 && binWidth > 0 &&
+        (objectSplit.cost == Infinity ||
+         (!overlap.IsEmpty() &&
+          overlap.SurfaceArea() > spatialSplitOverlap * rootArea))) {
+        // Clip each reference to the bins it overlaps
+        Bounds3f binBounds[nSplitBins];
+        int enter[nSplitBins] = {0}, exit[nSplitBins] = {0};
+        auto spatialBin = [&](Float x) {
+            return Clamp(int((x - bounds.pMin[spatialDim]) / binWidth), 0,
+                         nSplitBins - 1);
+        };
+        for (const BVHPrimitiveInfo &ref : refs) {
+            int first = spatialBin(ref.bounds.pMin[spatialDim]);
+            int last = spatialBin(ref.bounds.pMax[spatialDim]);
+            ++enter[first];
+            ++exit[last];
+            for (int b = first; b <= last; ++b) {
+                Bounds3f clip = ref.bounds;
+                if (b > first)
+                    clip.pMin[spatialDim] =
+                        bounds.pMin[spatialDim] + b * binWidth;
+                if (b < last)
+                    clip.pMax[spatialDim] =
+                        bounds.pMin[spatialDim] + (b + 1) * binWidth;
+                if (first != last)
+                    clip = primitives[ref.primitiveNumber]->ClippedWorldBound(
+                        clip);
+                if (!clip.IsEmpty()) binBounds[b] = Union(binBounds[b], clip);
+            }
+        }
+        spatialSplit = FindSAHSplit(bounds, binBounds, enter, exit);
+
+        // Only use spatial splits that make progress and fit the budget
+        if (spatialSplit.count[0] >= nRefs || spatialSplit.count[1] >= nRefs ||
+            spatialSplit.count[0] + spatialSplit.count[1] - nRefs >
+                *splitBudget)
+            spatialSplit.cost = Infinity;
+    }
+
+    // Create a leaf if splitting doesn't pay off
+    Float splitCost = std::min(objectSplit.cost, spatialSplit.cost);
+    Float leafCost = nRefs;
+    if (splitCost == Infinity ||
+        (nRefs <= maxPrimsInNode && splitCost >= leafCost))
+        return createLeaf();
+
+    // Divide the references between the children
+    std::vector<BVHPrimitiveInfo> left, right;
+    int dim = spatialDim;
+    if (spatialSplit.cost < objectSplit.cost) {
+        Float plane =
+            bounds.pMin[spatialDim] + (spatialSplit.bin + 1) * binWidth;
+        for (const BVHPrimitiveInfo &ref : refs) {
+            if (ref.bounds.pMax[dim] <= plane)
+                left.push_back(ref);
+            else if (ref.bounds.pMin[dim] >= plane)
+                right.push_back(ref);
+            else {
+                // Add the parts of the reference on each side of _plane_
+                Bounds3f clip[2] = {ref.bounds, ref.bounds};
+                clip[0].pMax[dim] = clip[1].pMin[dim] = plane;
+                for (int c = 0; c < 2; ++c) {
+                    Bounds3f b =
+                        primitives[ref.primitiveNumber]->ClippedWorldBound(
+                            clip[c]);
+                    if (!b.IsEmpty())
+                        (c == 0 ? left : right)
+                            .push_back({ref.primitiveNumber, b});
+                }
+            }
+        }
+        if (!left.empty() && !right.empty())
+            ++spatialSplits;
+        else {
+            // Clipping left one side empty; fall back to the object split
+            if (objectSplit.cost == Infinity) return createLeaf();
+            left.clear();
+            right.clear();
+        }
+    }
+    if (left.empty()) {
+        dim = objectDim;
+        for (const BVHPrimitiveInfo &ref : refs)
+            (objectBin(ref) <= objectSplit.bin ? left : right).push_back(ref);
+    }
+    // Share the remaining budget between the children in proportion to
+    // their references so that it isn't all spent on the first one
+    *splitBudget -= std::min<int>(*splitBudget,
+                                  left.size() + right.size() - nRefs);
+    int leftBudget =
+        int64_t(*splitBudget) * left.size() / (left.size() + right.size());
+    int rightBudget = *splitBudget - leftBudget;
+    std::vector<BVHPrimitiveInfo>().swap(refs);
+    BVHBuildNode *c0 = spatialSplitBuild(arena, left, rootArea, &leftBudget,
+                                         totalNodes, orderedPrims);
+    rightBudget += leftBudget;
+    BVHBuildNode *c1 = spatialSplitBuild(arena, right, rootArea, &rightBudget,
+                                         totalNodes, orderedPrims);
+    *splitBudget = rightBudget;
+    node->InitInterior(dim, c0, c1);
+    return node;
+}
+
+// Builds the tree for all of _primitiveInfo_ like _recursiveBuild()_, but
+// computes bounds and SAH buckets for the upper levels in parallel and
+// then builds the remaining subtrees in parallel, each in the arena of the
+// thread that builds it.  The tree is the same as with a single thread.
+BVHBuildNode *BVHAccel::parallelBuild(
+    std::vector<MemoryArena> &arenas,
+    std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    if (MaxThreadIndex() == 1 ||
+        primitiveInfo.size() < size_t(parallelItems))
+        return recursiveBuild(arenas[0], primitiveInfo, 0,
+                              primitiveInfo.size(), totalNodes, orderedPrims);
+
+    // Build upper levels of the tree, collecting the subtrees below them
+    std::vector<BVHSubtree> subtrees;
+    BVHBuildNode *root =
+        recursiveBuild(arenas[0], primitiveInfo, 0, primitiveInfo.size(),
+                       totalNodes, orderedPrims, &subtrees);
+
+    // Build the subtrees in parallel
+    std::atomic<int> subtreeNodes(0);
+    ParallelFor([&](int64_t i) {
+        const BVHSubtree &subtree = subtrees[i];
+        std::vector<std::shared_ptr<Primitive>> prims;
+        int nodes = 0;
+        BVHBuildNode *node = recursiveBuild(
+            arenas[ThreadIndex], primitiveInfo, subtree.start, subtree.end,
+            &nodes, prims, nullptr, subtree.primOffset);
+        // The subtree's root replaces the node that was already counted
+        *subtree.node = *node;
+        subtreeNodes += nodes - 1;
+        std::move(prims.begin(), prims.end(),
+                  orderedPrims.begin() + subtree.primOffset);
+    }, subtrees.size());
+    *totalNodes += subtreeNodes;
+    return root;
+}
+
 BVHBuildNode *BVHAccel::HLBVHBuild(
     MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
     int *totalNodes,
@@ -637,6 +1445,99 @@ BVHBuildNode *BVHAccel::buildUpperSAH(MemoryArena &arena,
     return node;
 }
 
+// Builds a BVH that keeps runs of consecutive pieces of a single strand
+// (see _Shape::StrandPosition()_) together in one leaf, so that rays
+// travelling along a strand find its neighboring pieces there.  Pieces
+// are sorted along their strands and grouped into runs of up to
+// _maxPrimsInNode_ adjacent pieces; a run is only broken where the SAH
+// cost of splitting it is less than that of a leaf holding it by more
+// than _strandRunBias_, which happens where the strand bends sharply.  With
+// _orientedBounds_, that cost is measured with bounds in a frame along the
+// run, as the leaf will have oriented bounds.  The runs are stored
+// consecutively in _primitives_ and partitioned as units by
+// _recursiveBuild()_.
+BVHBuildNode *BVHAccel::strandBuild(
+    std::vector<MemoryArena> &arenas,
+    std::vector<BVHPrimitiveInfo> &primitiveInfo,
+    bool orientedBounds, int *totalNodes,
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    struct StrandPiece {
+        uint64_t strand;
+        Float position;
+        size_t primitiveNumber;
+    };
+    std::vector<StrandPiece> pieces;
+    std::vector<BVHPrimitiveInfo> runInfo;
+    std::vector<std::shared_ptr<Primitive>> runPrims;
+    runPrims.reserve(primitives.size());
+    for (const BVHPrimitiveInfo &info : primitiveInfo) {
+        StrandPiece piece;
+        piece.primitiveNumber = info.primitiveNumber;
+        if (primitives[info.primitiveNumber]->StrandPosition(
+                &piece.strand, &piece.position))
+            pieces.push_back(piece);
+        else {
+            runInfo.push_back({runPrims.size(), info.bounds});
+            runPrims.push_back(primitives[info.primitiveNumber]);
+        }
+    }
+
+    // Sort pieces by strand and position along it
+    std::sort(pieces.begin(), pieces.end(),
+              [](const StrandPiece &a, const StrandPiece &b) {
+                  return a.strand < b.strand ||
+                         (a.strand == b.strand && a.position < b.position);
+              });
+
+    // Group adjacent pieces of the same strand into runs
+    for (size_t start = 0; start < pieces.size();) {
+        const Primitive &first = *primitives[pieces[start].primitiveNumber];
+        Transform worldToFrame;
+        Vector3f axis = first.PrincipalAxis();
+        if (orientedBounds && axis.LengthSquared() > 0) {
+            Vector3f v[3];
+            v[0] = Normalize(axis);
+            CoordinateSystem(v[0], &v[1], &v[2]);
+            Matrix4x4 m(v[0].x, v[0].y, v[0].z, 0, v[1].x, v[1].y, v[1].z, 0,
+                        v[2].x, v[2].y, v[2].z, 0, 0, 0, 0, 1);
+            worldToFrame = Transform(m, Transpose(m));
+        }
+        Bounds3f bounds = primitiveInfo[pieces[start].primitiveNumber].bounds;
+        Bounds3f frameBounds = first.FrameBound(worldToFrame);
+        size_t end = start + 1;
+        while (end < pieces.size() && end - start < (size_t)maxPrimsInNode &&
+               pieces[end].strand == pieces[start].strand &&
+               pieces[end].position - pieces[end - 1].position <= 1) {
+            // Compare the SAH cost of a leaf holding the run and the new
+            // piece to that of an interior node over both, normalized as
+            // in _recursiveBuild()_
+            const Primitive &piece = *primitives[pieces[end].primitiveNumber];
+            Bounds3f b = piece.FrameBound(worldToFrame);
+            Bounds3f runBounds = Union(frameBounds, b);
+            Float n = end - start;
+            Float leafCost = n + 1;
+            Float splitCost = 1 + (n * frameBounds.SurfaceArea() +
+                                   b.SurfaceArea()) /
+                                      runBounds.SurfaceArea();
+            if (strandRunBias * splitCost < leafCost) break;
+            frameBounds = runBounds;
+            bounds = Union(bounds,
+                           primitiveInfo[pieces[end].primitiveNumber].bounds);
+            ++end;
+        }
+        BVHPrimitiveInfo info(runPrims.size(), bounds);
+        info.nPrimitives = end - start;
+        runInfo.push_back(info);
+        for (size_t i = start; i < end; ++i)
+            runPrims.push_back(primitives[pieces[i].primitiveNumber]);
+        strandRunPieces += end - start;
+        ++strandRuns;
+        start = end;
+    }
+    primitives.swap(runPrims);
+    return parallelBuild(arenas, runInfo, totalNodes, orderedPrims);
+}
+
 int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
     LinearBVHNode *linearNode = &nodes[*offset];
     linearNode->bounds = node->bounds;
@@ -657,10 +1558,144 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+// Emits the wide node for the subtree at _node_ and its descendants to
+// _lanes_ and returns the index of its first _WideBVHLanes_.  The node's
+// children are found by repeatedly replacing the interior child with the
+// largest surface area by its two children until there are _width_ of
+// them, which keeps the children that rays are most likely to hit.
+int BVHAccel::flattenWideBVH(BVHBuildNode *node,
+                             std::vector<WideBVHLanes> *lanes) {
+    BVHBuildNode *children[8];
+    int nChildren = 0;
+    if (node->nPrimitives > 0)
+        children[nChildren++] = node;
+    else {
+        children[nChildren++] = node->children[0];
+        children[nChildren++] = node->children[1];
+    }
+    while (nChildren < width) {
+        int open = -1;
+        for (int i = 0; i < nChildren; ++i)
+            if (children[i]->nPrimitives == 0 &&
+                (open == -1 || children[i]->bounds.SurfaceArea() >
+                                   children[open]->bounds.SurfaceArea()))
+                open = i;
+        if (open == -1) break;
+        BVHBuildNode *c = children[open];
+        children[open] = c->children[0];
+        children[nChildren++] = c->children[1];
+    }
+
+    int offset = lanes->size();
+    lanes->resize(offset + width / 4);
+    ++wideInteriorNodes;
+    for (int i = 0; i < nChildren; ++i) {
+        const BVHBuildNode *c = children[i];
+        int childOffset = c->nPrimitives > 0 ? c->firstPrimOffset
+                                             : flattenWideBVH(children[i], lanes);
+        // _lanes_ may have been reallocated by the recursive call
+        WideBVHLanes &l = (*lanes)[offset + i / 4];
+        for (int a = 0; a < 3; ++a) {
+            l.bounds[0][a][i % 4] = c->bounds.pMin[a];
+            l.bounds[1][a][i % 4] = c->bounds.pMax[a];
+        }
+        l.offset[i % 4] = childOffset;
+        l.nPrimitives[i % 4] = c->nPrimitives;
+    }
+    return offset;
+}
+
+// Appends the primitives of the subtree at _nodeIndex_ to _prims_ and fits
+// oriented bounds to it, if it has at most _maxOrientedPrims_ of them.
+// Returns false and leaves _prims_ unchanged for larger subtrees.
+bool BVHAccel::fitOrientedBounds(int nodeIndex, std::vector<int> *prims,
+                                 std::vector<OrientedBVHBounds> *fitted) {
+    const LinearBVHNode *node = &nodes[nodeIndex];
+    size_t start = prims->size();
+    if (node->nPrimitives > 0) {
+        for (int i = 0; i < node->nPrimitives; ++i)
+            prims->push_back(node->primitivesOffset + i);
+    } else {
+        bool fits = fitOrientedBounds(nodeIndex + 1, prims, fitted);
+        fits &= fitOrientedBounds(node->secondChildOffset, prims, fitted);
+        if (!fits) {
+            prims->resize(start);
+            return false;
+        }
+    }
+    if (prims->size() - start > size_t(maxOrientedPrims)) {
+        prims->resize(start);
+        return false;
+    }
+
+    // Orient the frame along the primitives' summed principal axes
+    Vector3f axis(0, 0, 0);
+    for (size_t i = start; i < prims->size(); ++i) {
+        Vector3f a = primitives[(*prims)[i]]->PrincipalAxis();
+        axis += (Dot(axis, a) < 0) ? -a : a;
+    }
+    if (axis.LengthSquared() == 0) return true;
+    OrientedBVHBounds obb;
+    obb.axis[0] = Normalize(axis);
+    CoordinateSystem(obb.axis[0], &obb.axis[1], &obb.axis[2]);
+    Matrix4x4 m(obb.axis[0].x, obb.axis[0].y, obb.axis[0].z, 0,
+                obb.axis[1].x, obb.axis[1].y, obb.axis[1].z, 0,
+                obb.axis[2].x, obb.axis[2].y, obb.axis[2].z, 0,
+                0, 0, 0, 1);
+    Transform worldToFrame(m, Transpose(m));
+    for (size_t i = start; i < prims->size(); ++i)
+        obb.bounds = Union(obb.bounds,
+                           primitives[(*prims)[i]]->FrameBound(worldToFrame));
+    if (obb.bounds.SurfaceArea() >
+        maxOrientedAreaRatio * node->bounds.SurfaceArea())
+        return true;
+    // Pad the bounds by the error of rotating points into the frame
+    Float maxCoord = std::max(MaxComponent(Abs(Vector3f(obb.bounds.pMin))),
+                              MaxComponent(Abs(Vector3f(obb.bounds.pMax))));
+    obb.bounds = Expand(obb.bounds, gamma(3) * maxCoord);
+    obbOffsets[nodeIndex] = fitted->size();
+    fitted->push_back(obb);
+    ++orientedNodes;
+    return true;
+}
+
+inline bool BVHAccel::orientedBoundsIntersectP(int nodeIndex,
+                                               const Ray &ray) const {
+    if (obbOffsets.empty() || obbOffsets[nodeIndex] < 0) return true;
+    ++nOrientedTests;
+    if (obbs[obbOffsets[nodeIndex]].IntersectP(ray)) return true;
+    ++nOrientedCulled;
+    return false;
+}
+
+BVHAccel::~BVHAccel() {
+    FreeAligned(nodes);
+    FreeAligned(obbs);
+    FreeAligned(wideNodes);
+    FreeAligned(compressedNodes);
+    if (recorder) {
+        if (recorder->nDropped > 0)
+            Warning("Recorded only the first %d of %" PRId64 " BVH rays.",
+                    (int)recorder->recording.rays.size(),
+                    int64_t(recorder->nDropped +
+                            recorder->recording.rays.size()));
+        WriteBVHRayRecording(recorder->filename, recorder->recording);
+    }
+}
+
+inline int BVHAccel::childIndex(int nodeIndex, int child) const {
+    const LinearBVHNode &node = nodes[nodeIndex];
+    if (layout == Layout::DepthFirst)
+        return child == 0 ? nodeIndex + 1 : node.secondChildOffset;
+    return node.firstChildOffset + child;
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    if (wideNodes) return wideIntersect<false>(wideNodes, ray, isect);
+    if (compressedNodes)
+        return wideIntersect<false>(compressedNodes, ray, isect);
     if (!nodes) return false;
+    if (recorder) return recordingIntersect<false>(ray, isect);
     ProfilePhase p(Prof::AccelIntersect);
     bool hit = false;
     Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
@@ -671,7 +1706,8 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
         // Check ray against BVH node
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg) &&
+            orientedBoundsIntersectP(currentNodeIndex, ray)) {
             if (node->nPrimitives > 0) {
                 // Intersect ray with primitives in leaf BVH node
                 for (int i = 0; i < node->nPrimitives; ++i)
@@ -683,13 +1719,10 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
             } else {
                 // Put far BVH node on _nodesToVisit_ stack, advance to near
                 // node
-                if (dirIsNeg[node->axis]) {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node->secondChildOffset;
-                } else {
-                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
-                }
+                int isNeg = dirIsNeg[node->axis];
+                nodesToVisit[toVisitOffset++] =
+                    childIndex(currentNodeIndex, 1 - isNeg);
+                currentNodeIndex = childIndex(currentNodeIndex, isNeg);
             }
         } else {
             if (toVisitOffset == 0) break;
@@ -700,7 +1733,11 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
 }
 
 bool BVHAccel::IntersectP(const Ray &ray) const {
+    if (wideNodes) return wideIntersect<true>(wideNodes, ray, nullptr);
+    if (compressedNodes)
+        return wideIntersect<true>(compressedNodes, ray, nullptr);
     if (!nodes) return false;
+    if (recorder) return recordingIntersect<true>(ray, nullptr);
     ProfilePhase p(Prof::AccelIntersectP);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
@@ -708,7 +1745,8 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
     int toVisitOffset = 0, currentNodeIndex = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg) &&
+            orientedBoundsIntersectP(currentNodeIndex, ray)) {
             // Process BVH node _node_ for traversal
             if (node->nPrimitives > 0) {
                 for (int i = 0; i < node->nPrimitives; ++i) {
@@ -720,14 +1758,10 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
             } else {
-                if (dirIsNeg[node->axis]) {
-                    /// second child first
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node->secondChildOffset;
-                } else {
-                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
-                }
+                int isNeg = dirIsNeg[node->axis];
+                nodesToVisit[toVisitOffset++] =
+                    childIndex(currentNodeIndex, 1 - isNeg);
+                currentNodeIndex = childIndex(currentNodeIndex, isNeg);
             }
         } else {
             if (toVisitOffset == 0) break;
@@ -737,6 +1771,129 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
     return false;
 }
 
+// Traverses the wide BVH.  All children of a node are tested at once and
+// the ones that are hit are pushed with their entry distance, nearest last
+// for closest-hit queries, so that they are visited front to back and
+// skipped once a closer intersection has been found.  With _AnyHit_, the
+// first intersection found is returned.  _Lanes_ is _WideBVHLanes_ or
+// _CompressedBVHLanes_.
+template <bool AnyHit, typename Lanes>
+bool BVHAccel::wideIntersect(const Lanes *laneNodes, const Ray &ray,
+                             SurfaceInteraction *isect) const {
+    ProfilePhase p(AnyHit ? Prof::AccelIntersectP : Prof::AccelIntersect);
+    bool hit = false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    struct ToVisit {
+        int32_t offset;
+        int nPrimitives;
+        Float tNear;
+    };
+    // Each level of the tree adds at most _width_ - 1 entries
+    ToVisit toVisit[64 * 7 + 1];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = {0, 0, 0};
+    while (toVisitOffset > 0) {
+        const ToVisit node = toVisit[--toVisitOffset];
+        if (node.tNear > ray.tMax) continue;
+        if (node.nPrimitives > 0) {
+            // Intersect ray with primitives in leaf
+            for (int i = 0; i < node.nPrimitives; ++i) {
+                const Primitive &prim = *primitives[node.offset + i];
+                if (AnyHit) {
+                    if (prim.IntersectP(ray)) return true;
+                } else if (prim.Intersect(ray, isect))
+                    hit = true;
+            }
+            continue;
+        }
+
+        // Test ray against all children and sort the hit ones by distance
+        ToVisit children[8];
+        int nHit = 0;
+        for (int b = 0; b < width / 4; ++b) {
+            const Lanes &lanes = laneNodes[node.offset + b];
+            Float tNear[4];
+            int mask = lanes.IntersectP(ray, invDir, dirIsNeg, tNear);
+            for (int i = 0; i < 4; ++i)
+                if ((mask & (1 << i)) && lanes.offset[i] >= 0) {
+                    ToVisit c = {lanes.offset[i], lanes.nPrimitives[i],
+                                 tNear[i]};
+                    int j = nHit++;
+                    if (!AnyHit)
+                        for (; j > 0 && children[j - 1].tNear < c.tNear; --j)
+                            children[j] = children[j - 1];
+                    children[j] = c;
+                }
+        }
+        for (int i = 0; i < nHit; ++i) toVisit[toVisitOffset++] = children[i];
+    }
+    return hit;
+}
+
+// Traverses the BVH like _Intersect()_ or, with _AnyHit_, _IntersectP()_,
+// and records the ray along with the leaves where intersections were found
+// so that _ReplayBVHRays()_ can repeat the traversal without primitives.
+template <bool AnyHit>
+bool BVHAccel::recordingIntersect(const Ray &ray,
+                                  SurfaceInteraction *isect) const {
+    ProfilePhase p(AnyHit ? Prof::AccelIntersectP : Prof::AccelIntersect);
+    RecordedBVHRay recorded;
+    for (int a = 0; a < 3; ++a) {
+        recorded.o[a] = ray.o[a];
+        recorded.d[a] = ray.d[a];
+    }
+    recorded.tMax = ray.tMax;
+    recorded.anyHit = AnyHit;
+    std::vector<RecordedBVHHit> hits;
+
+    bool hit = false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                Float tMax = ray.tMax;
+                for (int i = 0; i < node->nPrimitives; ++i) {
+                    const Primitive &prim =
+                        *primitives[node->primitivesOffset + i];
+                    if (AnyHit ? prim.IntersectP(ray)
+                               : prim.Intersect(ray, isect)) {
+                        hit = true;
+                        if (AnyHit) break;
+                    }
+                }
+                if (AnyHit ? hit : ray.tMax < tMax)
+                    hits.push_back({currentNodeIndex, ray.tMax});
+                if ((AnyHit && hit) || toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                int isNeg = dirIsNeg[node->axis];
+                nodesToVisit[toVisitOffset++] =
+                    childIndex(currentNodeIndex, 1 - isNeg);
+                currentNodeIndex = childIndex(currentNodeIndex, isNeg);
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(recorder->mutex);
+    BVHRayRecording &recording = recorder->recording;
+    if (recording.rays.size() < maxRecordedRays) {
+        recorded.firstHit = recording.hits.size();
+        recorded.nHits = hits.size();
+        recording.rays.push_back(recorded);
+        recording.hits.insert(recording.hits.end(), hits.begin(), hits.end());
+    } else
+        ++recorder->nDropped;
+    return hit;
+}
+
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) {
     std::string splitMethodName = ps.FindOneString("splitmethod", "sah");
@@ -749,14 +1906,190 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
         splitMethod = BVHAccel::SplitMethod::Middle;
     else if (splitMethodName == "equal")
         splitMethod = BVHAccel::SplitMethod::EqualCounts;
+    else if (splitMethodName == "strands")
+        splitMethod = BVHAccel::SplitMethod::Strands;
+    else if (splitMethodName == "sbvh")
+        splitMethod = BVHAccel::SplitMethod::SBVH;
     else {
         Warning("BVH split method \"%s\" unknown.  Using \"sah\".",
                 splitMethodName.c_str());
         splitMethod = BVHAccel::SplitMethod::SAH;
     }
 
+    std::string curveBounds = ps.FindOneString("curvebounds", "aabb");
+    if (curveBounds != "aabb" && curveBounds != "obb") {
+        Warning("BVH curve bounds \"%s\" unknown.  Using \"aabb\".",
+                curveBounds.c_str());
+        curveBounds = "aabb";
+    }
+
+    int width = ps.FindOneInt("width", 2);
+    if (width != 2 && width != 4 && width != 8) {
+        Warning("BVH width %d unsupported; must be 2, 4 or 8.  Using 2.",
+                width);
+        width = 2;
+    }
+    // Quantized child bounds are only supported by wide nodes
+    bool compressed = ps.FindOneBool("compressed", false);
+    if (compressed && width == 2) {
+        Warning("Compressed BVH nodes require \"width\" 4 or 8.  Using 4.");
+        width = 4;
+    }
+    if (width > 2 && curveBounds == "obb") {
+        Warning("Wide BVHs don't support \"obb\" curve bounds.  Using "
+                "\"aabb\".");
+        curveBounds = "aabb";
+    }
+
+    // Additional primitive references that "sbvh" may create, as a fraction
+    // of the number of primitives
+    Float splitBudget = ps.FindOneFloat("splitbudget", .5f);
+    if (splitBudget < 0) {
+        Warning("Negative \"splitbudget\" %f.  Using 0.", splitBudget);
+        splitBudget = 0;
+    }
+
+    std::string layoutName = ps.FindOneString("layout", "depthfirst");
+    BVHAccel::Layout layout;
+    if (layoutName == "depthfirst")
+        layout = BVHAccel::Layout::DepthFirst;
+    else if (layoutName == "probability")
+        layout = BVHAccel::Layout::Probability;
+    else if (layoutName == "veb")
+        layout = BVHAccel::Layout::VanEmdeBoas;
+    else {
+        Warning("BVH layout \"%s\" unknown.  Using \"depthfirst\".",
+                layoutName.c_str());
+        layout = BVHAccel::Layout::DepthFirst;
+    }
+    if (width > 2 && layout != BVHAccel::Layout::DepthFirst) {
+        Warning("BVH layout \"%s\" only applies to width 2.  Using "
+                "\"depthfirst\".", layoutName.c_str());
+        layout = BVHAccel::Layout::DepthFirst;
+    }
+
+    // Traced rays are recorded for replaying them against other layouts
+    // with bvhbench
+    std::string rayFile = ps.FindOneString("rayfile", "");
+    if (!rayFile.empty() &&
+        (width > 2 || curveBounds == "obb" ||
+         layout != BVHAccel::Layout::DepthFirst)) {
+        Warning("BVH rays can only be recorded with width 2, \"aabb\" curve "
+                "bounds and the \"depthfirst\" layout.  Not recording.");
+        rayFile.clear();
+    }
+
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, curveBounds == "obb",
+                                      width, splitBudget, compressed,
+                                      layout, rayFile);
+}
+
+std::shared_ptr<BVHRayRecording> ReadBVHRayRecording(
+    const std::string &filename) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        Error("%s: unable to open BVH ray file.", filename.c_str());
+        return nullptr;
+    }
+    std::shared_ptr<BVHRayRecording> recording =
+        std::make_shared<BVHRayRecording>();
+    BVHRayFileHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              memcmp(header.magic, bvhRayFileMagic, sizeof(header.magic)) ==
+                  0 &&
+              header.floatSize == sizeof(Float) &&
+              header.nodeSize == sizeof(LinearBVHNode) && header.nNodes > 0 &&
+              header.nRays >= 0 && header.nHits >= 0;
+    if (ok) {
+        recording->nodes.resize(header.nNodes);
+        recording->rays.resize(header.nRays);
+        recording->hits.resize(header.nHits);
+        ok = fread(recording->nodes.data(), sizeof(LinearBVHNode),
+                   header.nNodes, f) == size_t(header.nNodes) &&
+             fread(recording->rays.data(), sizeof(RecordedBVHRay),
+                   header.nRays, f) == size_t(header.nRays) &&
+             fread(recording->hits.data(), sizeof(RecordedBVHHit),
+                   header.nHits, f) == size_t(header.nHits);
+    }
+    // Make sure that replaying the rays stays within the arrays
+    for (int64_t i = 0; ok && i < header.nNodes; ++i) {
+        const LinearBVHNode &node = recording->nodes[i];
+        ok = node.nPrimitives > 0 || (i + 1 < header.nNodes &&
+                                      node.secondChildOffset > i + 1 &&
+                                      node.secondChildOffset < header.nNodes);
+    }
+    for (int64_t i = 0; ok && i < header.nRays; ++i) {
+        const RecordedBVHRay &r = recording->rays[i];
+        ok = r.firstHit >= 0 && r.nHits >= 0 &&
+             int64_t(r.firstHit) + r.nHits <= header.nHits;
+    }
+    for (int64_t i = 0; ok && i < header.nHits; ++i)
+        ok = recording->hits[i].nodeIndex >= 0 &&
+             recording->hits[i].nodeIndex < header.nNodes;
+    fclose(f);
+    if (!ok) {
+        Error("%s: not a BVH ray file recorded by this build of pbrt.",
+              filename.c_str());
+        return nullptr;
+    }
+    return recording;
+}
+
+// Traverses the recorded BVH laid out with _layout_ with each recorded
+// ray, updating its _tMax_ and terminating shadow rays at the recorded
+// leaves, so that the same nodes are visited as when it was traced.
+// _fetch_, if given, is called with the offset in bytes of each node
+// visited in the node array.  Returns the number of rays.
+int64_t ReplayBVHRays(const BVHRayRecording &recording,
+                      BVHAccel::Layout layout,
+                      const std::function<void(size_t)> &fetch) {
+    std::vector<int> newIndex;
+    std::vector<LinearBVHNode> nodes =
+        LayOutBVHNodes(recording.nodes, layout, &newIndex);
+    bool paired = layout != BVHAccel::Layout::DepthFirst;
+    for (const RecordedBVHRay &r : recording.rays) {
+        Ray ray(Point3f(r.o[0], r.o[1], r.o[2]),
+                Vector3f(r.d[0], r.d[1], r.d[2]), r.tMax);
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+        int hit = r.firstHit, hitEnd = r.firstHit + r.nHits;
+        int toVisitOffset = 0, currentNodeIndex = 0;
+        int nodesToVisit[64];
+        while (true) {
+            const LinearBVHNode *node = &nodes[currentNodeIndex];
+            if (fetch) fetch(currentNodeIndex * sizeof(LinearBVHNode));
+            if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
+                if (node->nPrimitives > 0) {
+                    if (hit < hitEnd &&
+                        newIndex[recording.hits[hit].nodeIndex] ==
+                            currentNodeIndex) {
+                        if (r.anyHit) break;
+                        ray.tMax = recording.hits[hit++].tMax;
+                    }
+                    if (toVisitOffset == 0) break;
+                    currentNodeIndex = nodesToVisit[--toVisitOffset];
+                } else {
+                    int children[2];
+                    if (paired) {
+                        children[0] = node->firstChildOffset;
+                        children[1] = node->firstChildOffset + 1;
+                    } else {
+                        children[0] = currentNodeIndex + 1;
+                        children[1] = node->secondChildOffset;
+                    }
+                    int isNeg = dirIsNeg[node->axis];
+                    nodesToVisit[toVisitOffset++] = children[1 - isNeg];
+                    currentNodeIndex = children[isNeg];
+                }
+            } else {
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+        }
+    }
+    return recording.rays.size();
 }
 
 }  // namespace pbrt
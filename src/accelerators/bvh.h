@@ -42,35 +42,65 @@
 #include "pbrt.h"
 #include "primitive.h"
 #include <atomic>
+#include <functional>
 
 namespace pbrt {
 struct BVHBuildNode;
 
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct BVHRayRecorder;
+struct BVHRayRecording;
+struct BVHSubtree;
 struct MortonPrimitive;
 struct LinearBVHNode;
+struct OrientedBVHBounds;
+struct WideBVHLanes;
+struct CompressedBVHLanes;
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
   public:
     // BVHAccel Public Types
-    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts };
+    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts, Strands, SBVH };
+    enum class Layout { DepthFirst, Probability, VanEmdeBoas };
 
     // BVHAccel Public Methods
+    // _quiet_ skips the build summary in the log, for BVHs built for
+    // geometry generated during rendering.
     BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH,
+             bool orientedBounds = false, int width = 2,
+             Float splitBudget = 0.5f, bool compressed = false,
+             Layout layout = Layout::DepthFirst,
+             const std::string &rayFile = "", int parallelItems = 1 << 17,
+             bool quiet = false);
     Bounds3f WorldBound() const;
     ~BVHAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Access to the nodes of binary BVHs for tests: node _i_ of
+    // _NumNodes()_ has the returned bounds and _nPrimitives_ primitives
+    // starting at _offset_ in _LeafPrimitives()_, or, for interior nodes,
+    // zero primitives and the offset of a child as stored for the layout.
+    // Wide BVHs have no such nodes.
+    int NumNodes() const { return nNodes; }
+    Bounds3f Node(int i, int *offset, int *nPrimitives) const;
+    const std::vector<std::shared_ptr<Primitive>> &LeafPrimitives() const {
+        return primitives;
+    }
 
   private:
     // BVHAccel Private Methods
     BVHBuildNode *recursiveBuild(
         MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
         int start, int end, int *totalNodes,
+        std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+        std::vector<BVHSubtree> *subtrees = nullptr, int primOffset = 0);
+    BVHBuildNode *parallelBuild(
+        std::vector<MemoryArena> &arenas,
+        std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims);
     BVHBuildNode *HLBVHBuild(
         MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
@@ -82,21 +112,67 @@ class BVHAccel : public Aggregate {
         MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims,
         std::atomic<int> *orderedPrimsOffset, int bitIndex) const;
+    BVHBuildNode *strandBuild(
+        std::vector<MemoryArena> &arenas,
+        std::vector<BVHPrimitiveInfo> &primitiveInfo,
+        bool orientedBounds, int *totalNodes,
+        std::vector<std::shared_ptr<Primitive>> &orderedPrims);
+    BVHBuildNode *spatialSplitBuild(
+        MemoryArena &arena, std::vector<BVHPrimitiveInfo> &refs,
+        Float rootArea, int *splitBudget, int *totalNodes,
+        std::vector<std::shared_ptr<Primitive>> &orderedPrims);
     BVHBuildNode *buildUpperSAH(MemoryArena &arena,
                                 std::vector<BVHBuildNode *> &treeletRoots,
                                 int start, int end, int *totalNodes) const;
     int flattenBVHTree(BVHBuildNode *node, int *offset);
+    int childIndex(int nodeIndex, int child) const;
+    int flattenWideBVH(BVHBuildNode *node, std::vector<WideBVHLanes> *lanes);
+    template <bool AnyHit, typename Lanes>
+    bool wideIntersect(const Lanes *laneNodes, const Ray &ray,
+                       SurfaceInteraction *isect) const;
+    bool fitOrientedBounds(int nodeIndex, std::vector<int> *prims,
+                           std::vector<OrientedBVHBounds> *fitted);
+    bool orientedBoundsIntersectP(int nodeIndex, const Ray &ray) const;
+    template <bool AnyHit>
+    bool recordingIntersect(const Ray &ray, SurfaceInteraction *isect) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    // Number of build items from which the SAH build works in parallel
+    const int parallelItems;
     std::vector<std::shared_ptr<Primitive>> primitives;
     LinearBVHNode *nodes = nullptr;
+    int nNodes = 0;
+    // Order of _nodes_ in memory; with layouts other than depth-first, the
+    // two children of each interior node are stored next to each other
+    const Layout layout;
+    // Oriented bounds of nodes over long, thin primitives, which rays must
+    // also hit; _obbOffsets_ is empty if they aren't used, otherwise it
+    // gives the index in _obbs_ for each node, or -1.
+    std::vector<int> obbOffsets;
+    OrientedBVHBounds *obbs = nullptr;
+    // Wide BVHs with 4 or 8 children per node store them in _wideNodes_
+    // instead of _nodes_, or in _compressedNodes_ if their bounds are
+    // quantized; see _WideBVHLanes_ and _CompressedBVHLanes_.
+    const int width;
+    WideBVHLanes *wideNodes = nullptr;
+    CompressedBVHLanes *compressedNodes = nullptr;
+    Bounds3f wideBounds;
+    // Rays are recorded here if the "rayfile" parameter is given
+    std::unique_ptr<BVHRayRecorder> recorder;
 };
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps);
 
+// BVH Ray Recording Declarations
+std::shared_ptr<BVHRayRecording> ReadBVHRayRecording(
+    const std::string &filename);
+int64_t ReplayBVHRays(const BVHRayRecording &recording,
+                      BVHAccel::Layout layout,
+                      const std::function<void(size_t)> &fetch);
+
 }  // namespace pbrt
 
 #endif  // PBRT_ACCELERATORS_BVH_H
@@ -155,11 +155,24 @@ struct TransformSet {
     Transform t[MaxTransforms];
 };
 
+// DeferredShape records a shape until _pbrtWorldEnd()_, when the camera is
+// available to choose its level of detail: a "hairlod" shape, or a "curve"
+// shape pruned by its projected width.
+struct DeferredShape {
+    std::string name;
+    const Transform *ObjectToWorld, *WorldToObject;
+    bool reverseOrientation;
+    ParamSet params;
+    std::shared_ptr<Material> material;
+    MediumInterface mediumInterface;
+};
+
 struct RenderOptions {
     // RenderOptions Public Methods
-    Integrator *MakeIntegrator() const;
+    Integrator *MakeIntegrator(std::shared_ptr<const Camera> camera) const;
     Scene *MakeScene();
     Camera *MakeCamera() const;
+    void MakeDeferredShapes(const Camera *camera);
 
     // RenderOptions Public Data
     Float transformStartTime = 0, transformEndTime = 1;
@@ -181,6 +194,7 @@ struct RenderOptions {
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
     std::vector<std::shared_ptr<Primitive>> *currentInstance = nullptr;
+    std::vector<DeferredShape> deferredShapes;
     bool haveScatteringMedia = false;
 };
 
@@ -376,25 +390,6 @@ static TransformCache transformCache;
 int catIndentCount = 0;
 
 
-//struct HairShape {
-//	std::shared_ptr<Curve> curve;
-//	const int primID;
-//
-//	HairShape(const int PID, std::shared_ptr<Curve> c) :
-//		primID(PID), curve(c) {}
-//
-//	HairShape(const HairShape&& hs) :
-//		primID(hs.primID), curve(hs.curve) {}
-//};
-
-//pre LOD calculation hair curves
-typedef std::vector<std::shared_ptr<Shape>> shapeVector;
-typedef std::vector<Point3f> P3FVec;
-static std::vector<shapeVector> hairs;
-static std::vector<P3FVec> hairPoints;
-static int lastPrim = 0;
-static int LODLevel = 0;
-
 // API Forward Declarations
 std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
                                                const Transform *ObjectToWorld,
@@ -479,6 +474,17 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
     else if (name == "curve")
         shapes = CreateCurveShape(object2world, world2object,
                                   reverseOrientation, paramSet);
+    else if (name == "hairmesh")
+        shapes = CreateHairMeshShape(object2world, world2object,
+                                     reverseOrientation, paramSet);
+    else if (name == "childhair")
+        shapes = CreateChildHairShape(object2world, world2object,
+                                      reverseOrientation, paramSet);
+    else if (name == "hairlod")
+        // Only reached for per-ray LOD selection or when the shape can't be
+        // deferred to _pbrtWorldEnd()_
+        shapes = CreateHairLODShape(object2world, world2object,
+                                    reverseOrientation, paramSet, nullptr);
     else if (name == "trianglemesh") {
         if (PbrtOptions.toPly) {
             int nvi;
@@ -1362,6 +1368,24 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         printf("\n");
     }
 
+    if (((name == "hairlod" &&
+          params.FindOneString("lodselection", "camera") == "camera") ||
+         (name == "curve" && params.FindOneFloat("prunepixelwidth", 0) > 0)) &&
+        !curTransform.IsAnimated() && !renderOptions->currentInstance &&
+        !PbrtOptions.cat && !PbrtOptions.toPly) {
+        // Defer shape creation until the camera is known
+        if (graphicsState.areaLight != "")
+            Warning("Ignoring currently set area light for \"%s\" shape",
+                    name.c_str());
+        renderOptions->deferredShapes.push_back(
+            {name, transformCache.Lookup(curTransform[0]),
+             transformCache.Lookup(Inverse(curTransform[0])),
+             graphicsState.reverseOrientation, params,
+             graphicsState.GetMaterialForShape(params),
+             graphicsState.CreateMediumInterface()});
+        return;
+    }
+
     if (!curTransform.IsAnimated()) {
         // Initialize _prims_ and _areaLights_ for static shape
 
@@ -1596,10 +1620,13 @@ void pbrtObjectInstance(const std::string &name) {
     if (in.empty()) return;
     ++nObjectInstancesUsed;
     if (in.size() > 1) {
-        // Create aggregate for instance _Primitive_s
+        // Create aggregate for instance _Primitive_s; only the scene's
+        // aggregate records rays
+        ParamSet accelParams = renderOptions->AcceleratorParams;
+        accelParams.EraseString("rayfile");
         std::shared_ptr<Primitive> accel(
             MakeAccelerator(renderOptions->AcceleratorName, std::move(in),
-                            renderOptions->AcceleratorParams));
+                            accelParams));
         if (!accel) accel = std::make_shared<BVHAccel>(in);
         in.clear();
         in.push_back(accel);
@@ -1636,7 +1663,10 @@ void pbrtWorldEnd() {
     if (PbrtOptions.cat || PbrtOptions.toPly) {
         printf("%*sWorldEnd\n", catIndentCount, "");
     } else {
-        std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
+        std::shared_ptr<const Camera> camera(renderOptions->MakeCamera());
+        renderOptions->MakeDeferredShapes(camera.get());
+        std::unique_ptr<Integrator> integrator(
+            renderOptions->MakeIntegrator(camera));
         std::unique_ptr<Scene> scene(renderOptions->MakeScene());
 
         // This is kind of ugly; we directly override the current profiler
@@ -1691,8 +1721,26 @@ Scene *RenderOptions::MakeScene() {
     return scene;
 }
 
-Integrator *RenderOptions::MakeIntegrator() const {
-    std::shared_ptr<const Camera> camera(MakeCamera());
+void RenderOptions::MakeDeferredShapes(const Camera *camera) {
+    for (const DeferredShape &shape : deferredShapes) {
+        std::vector<std::shared_ptr<Shape>> shapes =
+            shape.name == "hairlod"
+                ? CreateHairLODShape(shape.ObjectToWorld, shape.WorldToObject,
+                                     shape.reverseOrientation, shape.params,
+                                     camera)
+                : CreateCurveShape(shape.ObjectToWorld, shape.WorldToObject,
+                                   shape.reverseOrientation, shape.params,
+                                   camera);
+        shape.params.ReportUnused();
+        for (auto s : shapes)
+            primitives.push_back(std::make_shared<GeometricPrimitive>(
+                s, shape.material, nullptr, shape.mediumInterface));
+    }
+    deferredShapes.clear();
+}
+
+Integrator *RenderOptions::MakeIntegrator(
+    std::shared_ptr<const Camera> camera) const {
     if (!camera) {
         Error("Unable to create camera");
         return nullptr;
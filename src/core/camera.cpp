@@ -112,4 +112,31 @@ Spectrum Camera::Sample_Wi(const Interaction &ref, const Point2f &u,
     return Spectrum(0.f);
 }
 
+Float ProjectedPixelWidth(const Camera &camera, const Bounds3f &worldBounds) {
+    Point3f center;
+    Float radius;
+    worldBounds.BoundingSphere(&center, &radius);
+
+    // Generate ray differentials through the center of the film
+    CameraSample cs;
+    cs.pFilm = Point2f(camera.film->fullResolution.x * 0.5f,
+                       camera.film->fullResolution.y * 0.5f);
+    cs.pLens = Point2f(0.5f, 0.5f);
+    cs.time = 0.5f;
+    RayDifferential ray;
+    if (camera.GenerateRayDifferential(cs, &ray) == 0 || !ray.hasDifferentials)
+        return Infinity;
+    if (DistanceSquared(ray.o, center) <= radius * radius) return Infinity;
+
+    // Compute pixel footprint at the distance of the sphere center
+    Float t = Dot(center - ray.o, ray.d) / ray.d.LengthSquared();
+    if (t <= 0) return 0;
+    Point3f p = ray(t);
+    Float footprint =
+        std::max(Distance(p, ray.rxOrigin + t * ray.rxDirection),
+                 Distance(p, ray.ryOrigin + t * ray.ryDirection));
+    if (footprint == 0) return Infinity;
+    return 2 * radius / footprint;
+}
+
 }  // namespace pbrt
@@ -75,6 +75,14 @@ struct CameraSample {
     Float time;
 };
 
+// Camera Utility Declarations
+
+// Returns the approximate width in pixels of the bounding sphere of
+// _worldBounds_ as seen from _camera_. The pixel footprint is taken from
+// the ray differentials of the film center ray at the distance of the
+// sphere center. Returns _Infinity_ if the camera is inside the sphere.
+Float ProjectedPixelWidth(const Camera &camera, const Bounds3f &worldBounds);
+
 inline std::ostream &operator<<(std::ostream &os, const CameraSample &cs) {
     os << "[ pFilm: " << cs.pFilm << " , pLens: " << cs.pLens <<
         StringPrintf(", time %f ]", cs.time);
@@ -784,6 +784,9 @@ class Bounds3 {
         Vector3<T> d = Diagonal();
         return d.x * d.y * d.z;
     }
+    bool IsEmpty() const {
+        return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z;
+    }
     int MaximumExtent() const {
         Vector3<T> d = Diagonal();
         if (d.x > d.y && d.x > d.z)
@@ -869,11 +872,25 @@ class Bounds2iIterator : public std::forward_iterator_tag {
 class Ray {
   public:
     // Ray Public Methods
-    Ray() : tMax(Infinity), time(0.f), medium(nullptr) {}
+    Ray()
+        : tMax(Infinity),
+          time(0.f),
+          medium(nullptr),
+          coneWidth(0.f),
+          coneSpread(0.f) {}
     Ray(const Point3f &o, const Vector3f &d, Float tMax = Infinity,
         Float time = 0.f, const Medium *medium = nullptr)
-        : o(o), d(d), tMax(tMax), time(time), medium(medium) {}
+        : o(o),
+          d(d),
+          tMax(tMax),
+          time(time),
+          medium(medium),
+          coneWidth(0.f),
+          coneSpread(0.f) {}
     Point3f operator()(Float t) const { return o + d * t; }
+    Float Footprint(Float dist) const {
+        return coneWidth * d.Length() + coneSpread * dist;
+    }
     bool HasNaNs() const { return (o.HasNaNs() || d.HasNaNs() || isNaN(tMax)); }
     friend std::ostream &operator<<(std::ostream &os, const Ray &r) {
         os << "[o=" << r.o << ", d=" << r.d << ", tMax=" << r.tMax
@@ -887,6 +904,12 @@ class Ray {
     mutable Float tMax;
     Float time;
     const Medium *medium;
+    // Ray cone used for geometric level of detail: the width of the ray's
+    // footprint at distance _dist_ is given by _Footprint()_.  _coneWidth_
+    // is relative to the length of _d_ so that both values are unchanged by
+    // (uniformly scaling) transformations.  Zero means an infinitely thin
+    // ray.
+    Float coneWidth, coneSpread;
 };
 
 class RayDifferential : public Ray {
@@ -911,6 +934,14 @@ class RayDifferential : public Ray {
         rxDirection = d + (rxDirection - d) * s;
         ryDirection = d + (ryDirection - d) * s;
     }
+    void ComputeCone() {
+        if (!hasDifferentials) return;
+        Float invLength = 1 / d.Length();
+        coneWidth = std::max((rxOrigin - o).Length(), (ryOrigin - o).Length()) *
+                    invLength;
+        coneSpread = std::max((rxDirection - d).Length(),
+                              (ryDirection - d).Length()) * invLength;
+    }
     friend std::ostream &operator<<(std::ostream &os, const RayDifferential &r) {
         os << "[ " << (Ray &)r << " has differentials: " <<
             (r.hasDifferentials ? "true" : "false") << ", xo = " << r.rxOrigin <<
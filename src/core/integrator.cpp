@@ -282,6 +282,7 @@ void SamplerIntegrator::Render(const Scene &scene) {
                     RayDifferential ray;
                     Float rayWeight =
                         camera->GenerateRayDifferential(cameraSample, &ray);
+                    ray.ComputeCone();
                     ray.ScaleDifferentials(
                         1 / std::sqrt((Float)tileSampler->samplesPerPixel));
                     ++nCameraRays;
@@ -63,18 +63,27 @@ struct Interaction {
     bool IsSurfaceInteraction() const { return n != Normal3f(); }
     Ray SpawnRay(const Vector3f &d) const {
         Point3f o = OffsetRayOrigin(p, pError, n, d);
-        return Ray(o, d, Infinity, time, GetMedium(d));
+        return ContinueCone(Ray(o, d, Infinity, time, GetMedium(d)));
     }
     Ray SpawnRayTo(const Point3f &p2) const {
         Point3f origin = OffsetRayOrigin(p, pError, n, p2 - p);
         Vector3f d = p2 - p;
-        return Ray(origin, d, 1 - ShadowEpsilon, time, GetMedium(d));
+        return ContinueCone(
+            Ray(origin, d, 1 - ShadowEpsilon, time, GetMedium(d)));
     }
     Ray SpawnRayTo(const Interaction &it) const {
         Point3f origin = OffsetRayOrigin(p, pError, n, it.p - p);
         Point3f target = OffsetRayOrigin(it.p, it.pError, it.n, origin - it.p);
         Vector3f d = target - origin;
-        return Ray(origin, d, 1 - ShadowEpsilon, time, GetMedium(d));
+        return ContinueCone(
+            Ray(origin, d, 1 - ShadowEpsilon, time, GetMedium(d)));
+    }
+    // Starts the ray cone of _ray_, which leaves this interaction, with the
+    // footprint and spread of the ray that found it.
+    Ray ContinueCone(Ray ray) const {
+        if (coneFootprint > 0) ray.coneWidth = coneFootprint / ray.d.Length();
+        ray.coneSpread = coneSpread;
+        return ray;
     }
     Interaction(const Point3f &p, const Vector3f &wo, Float time,
                 const MediumInterface &mediumInterface)
@@ -98,6 +107,10 @@ struct Interaction {
     Vector3f wo;
     Normal3f n;
     MediumInterface mediumInterface;
+    // Width of the ray cone of the ray that found the interaction at _p_,
+    // and its spread; see _Ray::Footprint()_.  Rays spawned here continue
+    // the cone, so geometric level of detail stays coarse along the path.
+    Float coneFootprint = 0, coneSpread = 0;
 };
 
 class MediumInteraction : public Interaction {
@@ -53,6 +53,18 @@ class Primitive {
     // Primitive Interface
     virtual ~Primitive();
     virtual Bounds3f WorldBound() const = 0;
+    // See _Shape::FrameBound()_, _Shape::PrincipalAxis()_,
+    // _Shape::StrandPosition()_ and _Shape::ClippedWorldBound()_.
+    virtual Bounds3f FrameBound(const Transform &WorldToFrame) const {
+        return WorldToFrame(WorldBound());
+    }
+    virtual Vector3f PrincipalAxis() const { return Vector3f(0, 0, 0); }
+    virtual bool StrandPosition(uint64_t *strand, Float *position) const {
+        return false;
+    }
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const {
+        return pbrt::Intersect(WorldBound(), clip);
+    }
     virtual bool Intersect(const Ray &r, SurfaceInteraction *) const = 0;
     virtual bool IntersectP(const Ray &r) const = 0;
     virtual const AreaLight *GetAreaLight() const = 0;
@@ -68,6 +80,16 @@ class GeometricPrimitive : public Primitive {
   public:
     // GeometricPrimitive Public Methods
     virtual Bounds3f WorldBound() const;
+    Bounds3f FrameBound(const Transform &WorldToFrame) const {
+        return shape->FrameBound(WorldToFrame);
+    }
+    Vector3f PrincipalAxis() const { return shape->PrincipalAxis(); }
+    bool StrandPosition(uint64_t *strand, Float *position) const {
+        return shape->StrandPosition(strand, position);
+    }
+    Bounds3f ClippedWorldBound(const Bounds3f &clip) const {
+        return shape->ClippedWorldBound(clip);
+    }
     virtual bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
     virtual bool IntersectP(const Ray &r) const;
     GeometricPrimitive(const std::shared_ptr<Shape> &shape,
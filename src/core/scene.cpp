@@ -45,7 +45,10 @@ STAT_COUNTER("Intersections/Shadow ray intersection tests", nShadowTests);
 bool Scene::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     ++nIntersectionTests;
     DCHECK_NE(ray.d, Vector3f(0,0,0));
-    return aggregate->Intersect(ray, isect);
+    if (!aggregate->Intersect(ray, isect)) return false;
+    isect->coneFootprint = ray.Footprint(Distance(ray.o, isect->p));
+    isect->coneSpread = ray.coneSpread;
+    return true;
 }
 
 bool Scene::IntersectP(const Ray &ray) const {
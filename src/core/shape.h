@@ -56,6 +56,23 @@ class Shape {
     virtual ~Shape();
     virtual Bounds3f ObjectBound() const = 0;
     virtual Bounds3f WorldBound() const;
+    // Returns the bounds of the shape in the coordinate system given by
+    // |WorldToFrame| and a world-space vector along which the shape is
+    // elongated, or (0,0,0).  Accelerators use them to fit oriented bounds
+    // around long, thin shapes such as curves.
+    virtual Bounds3f FrameBound(const Transform &WorldToFrame) const;
+    virtual Vector3f PrincipalAxis() const { return Vector3f(0, 0, 0); }
+    // Shapes that are pieces of a longer strand, such as curve segments,
+    // return true, set |strand| to a value shared by all pieces of the
+    // strand and |position| to their position along it, in units of
+    // segments.  Accelerators use them to keep strands together.
+    virtual bool StrandPosition(uint64_t *strand, Float *position) const {
+        return false;
+    }
+    // Returns bounds of the part of the shape inside |clip|, which are
+    // empty if there is none.  Accelerators that split shapes between
+    // nodes use them to bound each part.
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
     virtual bool Intersect(const Ray &ray, Float *tHit,
                            SurfaceInteraction *isect,
                            bool testAlphaTexture = true) const = 0;
@@ -0,0 +1,101 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_SIMD_H
+#define PBRT_CORE_SIMD_H
+
+// core/simd.h*
+#include "pbrt.h"
+
+// Float4 is only available if the compiler supports SSE and _Float_ is a
+// 32-bit float; code using it must provide a scalar fallback otherwise.
+#if defined(PBRT_HAVE_SSE) && !defined(PBRT_FLOAT_AS_DOUBLE)
+#define PBRT_HAVE_FLOAT4
+#include <xmmintrin.h>
+
+namespace pbrt {
+
+// Float4 Declarations
+struct Float4 {
+    Float4() {}
+    Float4(float f) : v(_mm_set1_ps(f)) {}
+    Float4(float f0, float f1, float f2, float f3)
+        : v(_mm_setr_ps(f0, f1, f2, f3)) {}
+    Float4(__m128 v) : v(v) {}
+    static Float4 Load(const float f[4]) { return _mm_loadu_ps(f); }
+    void Store(float f[4]) const { _mm_storeu_ps(f, v); }
+    __m128 v;
+};
+
+// Result of a lane-wise comparison of _Float4_s
+struct Mask4 {
+    Mask4(__m128 m) : m(m) {}
+    // Returns a bit mask with bit _i_ set if lane _i_ is true
+    int Bits() const { return _mm_movemask_ps(m); }
+    bool Any() const { return Bits() != 0; }
+    __m128 m;
+};
+
+// Float4 Inline Functions
+inline Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+inline Float4 operator-(Float4 a) { return _mm_sub_ps(_mm_setzero_ps(), a.v); }
+inline Float4 Min(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+inline Float4 Max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+inline Float4 Clamp(Float4 v, Float4 low, Float4 high) {
+    return Min(Max(v, low), high);
+}
+inline Float4 Lerp(Float4 t, Float4 v1, Float4 v2) {
+    return (Float4(1) - t) * v1 + t * v2;
+}
+inline Mask4 operator<(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Mask4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline Mask4 operator>(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Mask4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+inline Mask4 operator!=(Float4 a, Float4 b) {
+    return _mm_cmpneq_ps(a.v, b.v);
+}
+inline Mask4 operator&(Mask4 a, Mask4 b) { return _mm_and_ps(a.m, b.m); }
+inline Mask4 operator|(Mask4 a, Mask4 b) { return _mm_or_ps(a.m, b.m); }
+
+}  // namespace pbrt
+
+#endif  // PBRT_HAVE_SSE && !PBRT_FLOAT_AS_DOUBLE
+
+#endif  // PBRT_CORE_SIMD_H
@@ -232,7 +232,14 @@ Transform LookAt(const Point3f &pos, const Point3f &look, const Vector3f &up) {
     cameraToWorld.m[1][2] = dir.y;
     cameraToWorld.m[2][2] = dir.z;
     cameraToWorld.m[3][2] = 0.;
-    return Transform(Inverse(cameraToWorld), cameraToWorld);
+    // The rotation is orthonormal, so the inverse is its transpose; this
+    // avoids a general matrix inversion for every ray-curve test.
+    Vector3f p(pos);
+    Matrix4x4 worldToCamera(right.x, right.y, right.z, -Dot(right, p),
+                            newUp.x, newUp.y, newUp.z, -Dot(newUp, p),
+                            dir.x, dir.y, dir.z, -Dot(dir, p),
+                            0, 0, 0, 1);
+    return Transform(worldToCamera, cameraToWorld);
 }
 
 Bounds3f Transform::operator()(const Bounds3f &b) const {
@@ -260,12 +260,15 @@ inline Ray Transform::operator()(const Ray &r) const {
         o += d * dt;
         tMax -= dt;
     }
-    return Ray(o, d, tMax, r.time, r.medium);
+    Ray ret(o, d, tMax, r.time, r.medium);
+    ret.coneWidth = r.coneWidth;
+    ret.coneSpread = r.coneSpread;
+    return ret;
 }
 
 inline RayDifferential Transform::operator()(const RayDifferential &r) const {
     Ray tr = (*this)(Ray(r));
-    RayDifferential ret(tr.o, tr.d, tr.tMax, tr.time, tr.medium);
+    RayDifferential ret(tr);
     ret.hasDifferentials = r.hasDifferentials;
     ret.rxOrigin = (*this)(r.rxOrigin);
     ret.ryOrigin = (*this)(r.ryOrigin);
@@ -390,7 +393,10 @@ inline Ray Transform::operator()(const Ray &r, Vector3f *oError,
         o += d * dt;
         //        tMax -= dt;
     }
-    return Ray(o, d, tMax, r.time, r.medium);
+    Ray ret(o, d, tMax, r.time, r.medium);
+    ret.coneWidth = r.coneWidth;
+    ret.coneSpread = r.coneSpread;
+    return ret;
 }
 
 inline Ray Transform::operator()(const Ray &r, const Vector3f &oErrorIn,
@@ -405,7 +411,10 @@ inline Ray Transform::operator()(const Ray &r, const Vector3f &oErrorIn,
         o += d * dt;
         //        tMax -= dt;
     }
-    return Ray(o, d, tMax, r.time, r.medium);
+    Ray ret(o, d, tMax, r.time, r.medium);
+    ret.coneWidth = r.coneWidth;
+    ret.coneSpread = r.coneSpread;
+    return ret;
 }
 
 // AnimatedTransform Declarations
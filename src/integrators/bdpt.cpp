@@ -79,6 +79,7 @@ int GenerateCameraSubpath(const Scene &scene, Sampler &sampler,
     cameraSample.pLens = sampler.Get2D();
     RayDifferential ray;
     Spectrum beta = camera.GenerateRayDifferential(cameraSample, &ray);
+    ray.ComputeCone();
     ray.ScaleDifferentials(1 / std::sqrt(sampler.samplesPerPixel));
 
     // Generate first vertex on camera subpath and start random walk
@@ -39,22 +39,33 @@
 #include "paramset.h"
 #include "scene.h"
 #include "stats.h"
+#include "materials/hair.h"
 
 namespace pbrt {
 
 STAT_PERCENT("Integrator/Zero-radiance paths", zeroRadiancePaths, totalPaths);
 STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+STAT_INT_DISTRIBUTION("Integrator/Hair fibers crossed by shadow rays",
+                      hairCrossings);
+
+// Shadow rays crossing more hair fibers than this are considered occluded.
+static PBRT_CONSTEXPR int maxHairCrossings = 64;
 
 // PathIntegrator Method Definitions
 PathIntegrator::PathIntegrator(int maxDepth,
                                std::shared_ptr<const Camera> camera,
                                std::shared_ptr<Sampler> sampler,
                                const Bounds2i &pixelBounds, Float rrThreshold,
-                               const std::string &lightSampleStrategy)
+                               const std::string &lightSampleStrategy,
+                               bool dualScattering, Float hairForwardDensity,
+                               Float hairBackDensity)
     : SamplerIntegrator(camera, sampler, pixelBounds),
       maxDepth(maxDepth),
       rrThreshold(rrThreshold),
-      lightSampleStrategy(lightSampleStrategy) {}
+      lightSampleStrategy(lightSampleStrategy),
+      dualScattering(dualScattering),
+      hairForwardDensity(hairForwardDensity),
+      hairBackDensity(hairBackDensity) {}
 
 void PathIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
     lightDistribution =
@@ -114,6 +125,23 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
 
         const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
 
+        // Approximate all scattering at hair with dual scattering
+        if (dualScattering) {
+            const HairMaterial *hair = dynamic_cast<const HairMaterial *>(
+                isect.primitive->GetMaterial());
+            const HairDualScattering *dual =
+                hair ? hair->DualScattering() : nullptr;
+            if (dual) {
+                ++totalPaths;
+                Spectrum Ld = beta * HairDualScatteringLd(isect, *dual, scene,
+                                                          sampler, distrib);
+                VLOG(2) << "Dual scattering Ld = " << Ld;
+                if (Ld.IsBlack()) ++zeroRadiancePaths;
+                L += Ld;
+                break;
+            }
+        }
+
         // Sample illumination from lights to find path contribution.
         // (But skip this for perfectly specular BSDFs.)
         if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) >
@@ -187,6 +215,44 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
     return L;
 }
 
+Spectrum PathIntegrator::HairDualScatteringLd(
+    const SurfaceInteraction &isect, const HairDualScattering &dual,
+    const Scene &scene, Sampler &sampler,
+    const Distribution1D *distrib) const {
+    // Sample a light source as in _UniformSampleOneLight()_
+    if (scene.lights.empty()) return Spectrum(0.f);
+    Float lightPdf;
+    int lightNum = distrib->SampleDiscrete(sampler.Get1D(), &lightPdf);
+    if (lightPdf == 0) return Spectrum(0.f);
+    const std::shared_ptr<Light> &light = scene.lights[lightNum];
+    Vector3f wi;
+    Float pdf;
+    VisibilityTester visibility;
+    Spectrum Li =
+        light->Sample_Li(isect, sampler.Get2D(), &wi, &pdf, &visibility);
+    if (Li.IsBlack() || pdf == 0) return Spectrum(0.f);
+
+    // Count the hair fibers between the hit and the light
+    int nCrossings = 0;
+    Ray ray = visibility.P0().SpawnRayTo(visibility.P1());
+    SurfaceInteraction hit;
+    while (scene.Intersect(ray, &hit)) {
+        if (!dynamic_cast<const HairMaterial *>(hit.primitive->GetMaterial()) ||
+            ++nCrossings > maxHairCrossings)
+            return Spectrum(0.f);
+        ray = hit.SpawnRayTo(visibility.P1());
+    }
+    ReportValue(hairCrossings, nCrossings);
+
+    // Evaluate single scattering if the light is unoccluded and add the
+    // dual scattering terms
+    const BSDF &bsdf = *isect.bsdf;
+    Spectrum f = dual.f(bsdf.WorldToLocal(isect.wo), bsdf.WorldToLocal(wi),
+                        nCrossings, hairForwardDensity, hairBackDensity);
+    if (nCrossings == 0) f += bsdf.f(isect.wo, wi);
+    return f * Li * AbsDot(wi, isect.shading.n) / (pdf * lightPdf);
+}
+
 PathIntegrator *CreatePathIntegrator(const ParamSet &params,
                                      std::shared_ptr<Sampler> sampler,
                                      std::shared_ptr<const Camera> camera) {
@@ -208,8 +274,12 @@ PathIntegrator *CreatePathIntegrator(const ParamSet &params,
     Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
     std::string lightStrategy =
         params.FindOneString("lightsamplestrategy", "spatial");
+    bool dualScattering = params.FindOneBool("dualscattering", false);
+    Float forwardDensity = params.FindOneFloat("hairforwarddensity", .7f);
+    Float backDensity = params.FindOneFloat("hairbackdensity", .7f);
     return new PathIntegrator(maxDepth, camera, sampler, pixelBounds,
-                              rrThreshold, lightStrategy);
+                              rrThreshold, lightStrategy, dualScattering,
+                              forwardDensity, backDensity);
 }
 
 }  // namespace pbrt
@@ -44,6 +44,7 @@
 #include "lightdistrib.h"
 
 namespace pbrt {
+class HairDualScattering;
 
 // PathIntegrator Declarations
 class PathIntegrator : public SamplerIntegrator {
@@ -52,17 +53,30 @@ class PathIntegrator : public SamplerIntegrator {
     PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
                    std::shared_ptr<Sampler> sampler,
                    const Bounds2i &pixelBounds, Float rrThreshold = 1,
-                   const std::string &lightSampleStrategy = "spatial");
+                   const std::string &lightSampleStrategy = "spatial",
+                   bool dualScattering = false, Float hairForwardDensity = .7f,
+                   Float hairBackDensity = .7f);
 
     void Preprocess(const Scene &scene, Sampler &sampler);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
 
   private:
+    // PathIntegrator Private Methods
+    Spectrum HairDualScatteringLd(const SurfaceInteraction &isect,
+                                  const HairDualScattering &dual,
+                                  const Scene &scene, Sampler &sampler,
+                                  const Distribution1D *distrib) const;
+
     // PathIntegrator Private Data
     const int maxDepth;
     const Float rrThreshold;
     const std::string lightSampleStrategy;
+    // With _dualScattering_ set, paths end at hair whose material supports
+    // the dual scattering approximation and multiple scattering between
+    // the fibers is estimated from the fibers crossed by the shadow ray.
+    const bool dualScattering;
+    const Float hairForwardDensity, hairBackDensity;
     std::unique_ptr<LightDistribution> lightDistribution;
 };
 
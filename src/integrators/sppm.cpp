@@ -160,6 +160,7 @@ void SPPMIntegrator::Render(const Scene &scene) {
                         camera->GenerateRayDifferential(cameraSample, &ray);
                     if (beta.IsBlack())
                         continue;
+                    ray.ComputeCone();
                     ray.ScaleDifferentials(invSqrtSPP);
 
                     // Follow camera ray path until a visible point is created
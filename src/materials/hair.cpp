@@ -37,6 +37,7 @@
 #include "materials/hair.h"
 #include "paramset.h"
 #include "reflection.h"
+#include "rng.h"
 #include "sampling.h"
 #include "spectrum.h"
 #include "texture.h"
@@ -60,6 +61,37 @@ static Float Mp(Float cosThetaI, Float cosThetaO, Float sinThetaI,
     return mp;
 }
 
+// $\log I_0$ is tabulated on $[0, 12]$, where _LogI0()_ uses the series
+// expansion.  Its second derivative lies in $(0, 1/2]$, so linear
+// interpolation with spacing $\delta$ is off by at most $\delta^2/16$, which
+// bounds the relative error of tabulated $M_p$ values by $10^{-5}$.
+static PBRT_CONSTEXPR int nLogI0Samples = 1025;
+static PBRT_CONSTEXPR Float LogI0TableMax = 12;
+
+static Float LogI0Tabulated(Float x) {
+    static const std::vector<Float> table = []() {
+        std::vector<Float> t(nLogI0Samples);
+        for (int i = 0; i < nLogI0Samples; ++i)
+            t[i] = LogI0(i * LogI0TableMax / (nLogI0Samples - 1));
+        return t;
+    }();
+    if (x >= LogI0TableMax) return LogI0(x);
+    Float xs = x * ((nLogI0Samples - 1) / LogI0TableMax);
+    int i = std::min((int)xs, nLogI0Samples - 2);
+    return Lerp(xs - i, table[i], table[i + 1]);
+}
+
+// _logScale_ is the logarithm of $M_p$'s normalization for _v_; see
+// _HairBSDF::HairBSDF()_.
+static Float MpTabulated(Float cosThetaI, Float cosThetaO, Float sinThetaI,
+                         Float sinThetaO, Float v, Float logScale) {
+    Float a = cosThetaI * cosThetaO / v;
+    Float b = sinThetaI * sinThetaO / v;
+    Float mp = std::exp(LogI0Tabulated(a) - b + logScale);
+    CHECK(!std::isinf(mp) && !std::isnan(mp));
+    return mp;
+}
+
 inline Float I0(Float x) {
     Float val = 0;
     Float x2i = 1;
@@ -128,6 +160,10 @@ inline Float Np(Float phi, int p, Float s, Float gammaO, Float gammaT) {
     return TrimmedLogistic(dphi, s, -Pi, Pi);
 }
 
+inline Float Gaussian(Float x, Float mu, Float var) {
+    return std::exp(-Sqr(x - mu) / (2 * var)) / std::sqrt(2 * Pi * var);
+}
+
 static Float SampleTrimmedLogistic(Float u, Float s, Float a, Float b) {
     CHECK_LT(a, b);
     Float k = LogisticCDF(b, s) - LogisticCDF(a, s);
@@ -137,6 +173,79 @@ static Float SampleTrimmedLogistic(Float u, Float s, Float a, Float b) {
 }
 
 // HairMaterial Method Definitions
+template <typename T>
+static bool IsConstant(const std::shared_ptr<Texture<T>> &tex) {
+    return !tex || dynamic_cast<const ConstantTexture<T> *>(tex.get());
+}
+
+HairMaterial::HairMaterial(const std::shared_ptr<Texture<Spectrum>> &sigma_a,
+                           const std::shared_ptr<Texture<Spectrum>> &color,
+                           const std::shared_ptr<Texture<Float>> &eumelanin,
+                           const std::shared_ptr<Texture<Float>> &pheomelanin,
+                           const std::shared_ptr<Texture<Float>> &eta,
+                           const std::shared_ptr<Texture<Float>> &beta_m,
+                           const std::shared_ptr<Texture<Float>> &beta_n,
+                           const std::shared_ptr<Texture<Float>> &alpha,
+                           bool tabulated)
+    : sigma_a(sigma_a),
+      color(color),
+      eumelanin(eumelanin),
+      pheomelanin(pheomelanin),
+      eta(eta),
+      beta_m(beta_m),
+      beta_n(beta_n),
+      alpha(alpha),
+      tabulated(tabulated) {
+    if (!tabulated) return;
+    // Tabulate $A_p$ if absorption and index of refraction are constant
+    if (HasConstantAbsorption()) {
+        SurfaceInteraction si;
+        apTable = std::make_shared<HairAttenuationTable>(
+            eta->Evaluate(si), SigmaA(si, beta_n->Evaluate(si)));
+    } else
+        Warning(
+            "Hair absorption or index of refraction is textured; only "
+            "tabulating the longitudinal scattering term.");
+}
+
+bool HairMaterial::HasConstantAbsorption() const {
+    return IsConstant(sigma_a) && IsConstant(color) && IsConstant(eumelanin) &&
+           IsConstant(pheomelanin) && IsConstant(eta) &&
+           (!color || IsConstant(beta_n));
+}
+
+const HairDualScattering *HairMaterial::DualScattering() const {
+    std::call_once(dualScatteringFlag, [this]() {
+        if (!HasConstantAbsorption() || !IsConstant(beta_m) ||
+            !IsConstant(beta_n) || !IsConstant(alpha)) {
+            Warning(
+                "Dual scattering is not supported for textured hair "
+                "parameters; tracing multiple scattering instead.");
+            return;
+        }
+        SurfaceInteraction si;
+        Float bn = beta_n->Evaluate(si);
+        dualScattering.reset(new HairDualScattering(
+            eta->Evaluate(si), SigmaA(si, bn), beta_m->Evaluate(si), bn,
+            alpha->Evaluate(si)));
+    });
+    return dualScattering.get();
+}
+
+Spectrum HairMaterial::SigmaA(const SurfaceInteraction &si, Float bn) const {
+    if (sigma_a)
+        return sigma_a->Evaluate(si).Clamp();
+    else if (color) {
+        Spectrum c = color->Evaluate(si).Clamp();
+        return HairBSDF::SigmaAFromReflectance(c, bn);
+    } else {
+        CHECK(eumelanin || pheomelanin);
+        return HairBSDF::SigmaAFromConcentration(
+            std::max(Float(0), eumelanin ? eumelanin->Evaluate(si) : 0),
+            std::max(Float(0), pheomelanin ? pheomelanin->Evaluate(si) : 0));
+    }
+}
+
 void HairMaterial::ComputeScatteringFunctions(SurfaceInteraction *si,
                                               MemoryArena &arena,
                                               TransportMode mode,
@@ -148,22 +257,12 @@ void HairMaterial::ComputeScatteringFunctions(SurfaceInteraction *si,
 
     si->bsdf = ARENA_ALLOC(arena, BSDF)(*si, e);
 
-    Spectrum sig_a;
-    if (sigma_a)
-        sig_a = sigma_a->Evaluate(*si).Clamp();
-    else if (color) {
-        Spectrum c = color->Evaluate(*si).Clamp();
-        sig_a = HairBSDF::SigmaAFromReflectance(c, bn);
-    } else {
-        CHECK(eumelanin || pheomelanin);
-        sig_a = HairBSDF::SigmaAFromConcentration(
-            std::max(Float(0), eumelanin ? eumelanin->Evaluate(*si) : 0),
-            std::max(Float(0), pheomelanin ? pheomelanin->Evaluate(*si) : 0));
-    }
+    Spectrum sig_a = SigmaA(*si, bn);
 
     // Offset along width
     Float h = -1 + 2 * si->uv[1];
-    si->bsdf->Add(ARENA_ALLOC(arena, HairBSDF)(h, e, sig_a, bm, bn, a));
+    si->bsdf->Add(ARENA_ALLOC(arena, HairBSDF)(h, e, sig_a, bm, bn, a,
+                                               tabulated, apTable.get()));
 }
 
 HairMaterial *CreateHairMaterial(const TextureParams &mp) {
@@ -218,21 +317,25 @@ HairMaterial *CreateHairMaterial(const TextureParams &mp) {
     std::shared_ptr<Texture<Float>> beta_m = mp.GetFloatTexture("beta_m", 0.3f);
     std::shared_ptr<Texture<Float>> beta_n = mp.GetFloatTexture("beta_n", 0.3f);
     std::shared_ptr<Texture<Float>> alpha = mp.GetFloatTexture("alpha", 2.f);
+    bool tabulated = mp.FindBool("tabulated", false);
 
     return new HairMaterial(sigma_a, color, eumelanin, pheomelanin, eta, beta_m,
-                            beta_n, alpha);
+                            beta_n, alpha, tabulated);
 }
 
 // HairBSDF Method Definitions
 HairBSDF::HairBSDF(Float h, Float eta, const Spectrum &sigma_a, Float beta_m,
-                   Float beta_n, Float alpha)
+                   Float beta_n, Float alpha, bool tabulated,
+                   const HairAttenuationTable *apTable)
     : BxDF(BxDFType(BSDF_GLOSSY | BSDF_REFLECTION | BSDF_TRANSMISSION)),
       h(h),
       gammaO(SafeASin(h)),
       eta(eta),
       sigma_a(sigma_a),
       beta_m(beta_m),
-      beta_n(beta_n) {
+      beta_n(beta_n),
+      tabulated(tabulated),
+      apTable(apTable) {
     CHECK(h >= -1 && h <= 1);
     CHECK(beta_m >= 0 && beta_m <= 1);
     CHECK(beta_n >= 0 && beta_n <= 1);
@@ -247,6 +350,13 @@ HairBSDF::HairBSDF(Float h, Float eta, const Spectrum &sigma_a, Float beta_m,
         // TODO: is there anything better here?
         v[p] = v[2];
 
+    // Compute $\log$ of the $M_p$ normalization for tabulated evaluation
+    if (tabulated)
+        for (int p = 0; p <= pMax; ++p)
+            logMpScale[p] =
+                (v[p] <= .1) ? (-1 / v[p] + 0.6931f + std::log(1 / (2 * v[p])))
+                             : -std::log(std::sinh(1 / v[p]) * 2 * v[p]);
+
     // Compute azimuthal logistic scale factor from $\beta_n$
     s = SqrtPiOver8 *
         (0.265f * beta_n + 1.194f * Sqr(beta_n) + 5.372f * Pow<22>(beta_n));
@@ -272,22 +382,26 @@ Spectrum HairBSDF::f(const Vector3f &wo, const Vector3f &wi) const {
     Float cosThetaI = SafeSqrt(1 - Sqr(sinThetaI));
     Float phiI = std::atan2(wi.z, wi.y);
 
-    // Compute $\cos \thetat$ for refracted ray
-    Float sinThetaT = sinThetaO / eta;
-    Float cosThetaT = SafeSqrt(1 - Sqr(sinThetaT));
-
     // Compute $\gammat$ for refracted ray
     Float etap = std::sqrt(eta * eta - Sqr(sinThetaO)) / cosThetaO;
     Float sinGammaT = h / etap;
-    Float cosGammaT = SafeSqrt(1 - Sqr(sinGammaT));
     Float gammaT = SafeASin(sinGammaT);
 
-    // Compute the transmittance _T_ of a single path through the cylinder
-    Spectrum T = Exp(-sigma_a * (2 * cosGammaT / cosThetaT));
+    // Compute attenuation terms, tabulated or from the transmittance _T_ of
+    // a single path through the cylinder
+    std::array<Spectrum, pMax + 1> ap;
+    if (apTable)
+        ap = apTable->Ap(cosThetaO, h);
+    else {
+        Float sinThetaT = sinThetaO / eta;
+        Float cosThetaT = SafeSqrt(1 - Sqr(sinThetaT));
+        Float cosGammaT = SafeSqrt(1 - Sqr(sinGammaT));
+        Spectrum T = Exp(-sigma_a * (2 * cosGammaT / cosThetaT));
+        ap = Ap(cosThetaO, eta, h, T);
+    }
 
     // Evaluate hair BSDF
     Float phi = phiI - phiO;
-    std::array<Spectrum, pMax + 1> ap = Ap(cosThetaO, eta, h, T);
     Spectrum fsum(0.);
     for (int p = 0; p < pMax; ++p) {
         // Compute $\sin \thetai$ and $\cos \thetai$ terms accounting for scales
@@ -311,19 +425,28 @@ Spectrum HairBSDF::f(const Vector3f &wo, const Vector3f &wi) const {
 
         // Handle out-of-range $\cos \thetai$ from scale adjustment
         cosThetaIp = std::abs(cosThetaIp);
-        fsum += Mp(cosThetaIp, cosThetaO, sinThetaIp, sinThetaO, v[p]) * ap[p] *
-                Np(phi, p, s, gammaO, gammaT);
+        fsum += EvalMp(p, cosThetaIp, cosThetaO, sinThetaIp, sinThetaO) *
+                ap[p] * Np(phi, p, s, gammaO, gammaT);
     }
 
     // Compute contribution of remaining terms after _pMax_
-    fsum += Mp(cosThetaI, cosThetaO, sinThetaI, sinThetaO, v[pMax]) * ap[pMax] /
-            (2.f * Pi);
+    fsum += EvalMp(pMax, cosThetaI, cosThetaO, sinThetaI, sinThetaO) *
+            ap[pMax] / (2.f * Pi);
     if (AbsCosTheta(wi) > 0) fsum /= AbsCosTheta(wi);
     CHECK(!std::isinf(fsum.y()) && !std::isnan(fsum.y()));
     return fsum;
 }
 
+Float HairBSDF::EvalMp(int p, Float cosThetaI, Float cosThetaO, Float sinThetaI,
+                       Float sinThetaO) const {
+    if (tabulated)
+        return MpTabulated(cosThetaI, cosThetaO, sinThetaI, sinThetaO, v[p],
+                           logMpScale[p]);
+    return Mp(cosThetaI, cosThetaO, sinThetaI, sinThetaO, v[p]);
+}
+
 std::array<Float, pMax + 1> HairBSDF::ComputeApPdf(Float cosThetaO) const {
+    if (apTable) return apTable->ApPdf(cosThetaO, h);
     // Compute array of $A_p$ values for _cosThetaO_
     Float sinThetaO = SafeSqrt(1 - cosThetaO * cosThetaO);
 
@@ -433,10 +556,10 @@ Spectrum HairBSDF::Sample_f(const Vector3f &wo, Vector3f *wi, const Point2f &u2,
 
         // Handle out-of-range $\cos \thetai$ from scale adjustment
         cosThetaIp = std::abs(cosThetaIp);
-        *pdf += Mp(cosThetaIp, cosThetaO, sinThetaIp, sinThetaO, v[p]) *
+        *pdf += EvalMp(p, cosThetaIp, cosThetaO, sinThetaIp, sinThetaO) *
                 apPdf[p] * Np(dphi, p, s, gammaO, gammaT);
     }
-    *pdf += Mp(cosThetaI, cosThetaO, sinThetaI, sinThetaO, v[pMax]) *
+    *pdf += EvalMp(pMax, cosThetaI, cosThetaO, sinThetaI, sinThetaO) *
             apPdf[pMax] * (1 / (2 * Pi));
     // if (std::abs(wi->x) < .9999) CHECK_NEAR(*pdf, Pdf(wo, *wi), .01);
     return f(wo, *wi);
@@ -486,10 +609,10 @@ Float HairBSDF::Pdf(const Vector3f &wo, const Vector3f &wi) const {
 
         // Handle out-of-range $\cos \thetai$ from scale adjustment
         cosThetaIp = std::abs(cosThetaIp);
-        pdf += Mp(cosThetaIp, cosThetaO, sinThetaIp, sinThetaO, v[p]) *
+        pdf += EvalMp(p, cosThetaIp, cosThetaO, sinThetaIp, sinThetaO) *
                apPdf[p] * Np(phi, p, s, gammaO, gammaT);
     }
-    pdf += Mp(cosThetaI, cosThetaO, sinThetaI, sinThetaO, v[pMax]) *
+    pdf += EvalMp(pMax, cosThetaI, cosThetaO, sinThetaI, sinThetaO) *
            apPdf[pMax] * (1 / (2 * Pi));
     return pdf;
 }
@@ -503,6 +626,181 @@ std::string HairBSDF::ToString() const {
         std::string("  ]");
 }
 
+// HairAttenuationTable Method Definitions
+HairAttenuationTable::HairAttenuationTable(Float eta, const Spectrum &sigma_a)
+    : ap(nCosThetaO * nGammaO), apPdf(nCosThetaO * nGammaO) {
+    for (int i = 0; i < nCosThetaO; ++i)
+        for (int j = 0; j < nGammaO; ++j) {
+            // Keep the samples off the grazing limits, where the attenuation
+            // of $p=pMax$ is $0/0$ for non-absorbing hair
+            Float cosThetaO =
+                std::max(Sqr(Float(i) / (nCosThetaO - 1)), Float(1e-3));
+            Float gammaO =
+                std::min(Float(j) / (nGammaO - 1) * PiOver2, PiOver2 - 1e-3f);
+            Float h = std::sin(gammaO);
+
+            // Compute the transmittance _T_ as in _HairBSDF::f()_
+            Float sinThetaO = SafeSqrt(1 - Sqr(cosThetaO));
+            Float cosThetaT = SafeSqrt(1 - Sqr(sinThetaO / eta));
+            Float etap = std::sqrt(eta * eta - Sqr(sinThetaO)) / cosThetaO;
+            Float cosGammaT = SafeSqrt(1 - Sqr(h / etap));
+            Spectrum T = Exp(-sigma_a * (2 * cosGammaT / cosThetaT));
+
+            int offset = i * nGammaO + j;
+            ap[offset] = pbrt::Ap(cosThetaO, eta, h, T);
+            Float sumY = 0;
+            for (const Spectrum &a : ap[offset]) sumY += a.y();
+            for (int p = 0; p <= pMax; ++p)
+                apPdf[offset][p] = ap[offset][p].y() / sumY;
+        }
+}
+
+void HairAttenuationTable::Weights(Float cosThetaO, Float h, int offset[4],
+                                   Float w[4]) const {
+    // $A_p$ only depends on $|h|$; tabulate over $\gamma_o$ to avoid the
+    // infinite slope of $\cos \gamma_o$ at $|h|=1$ and over $\sqrt{\cos
+    // \theta_o}$ to refine the grazing angles where $\eta'$ diverges
+    Float x = std::sqrt(Clamp(cosThetaO, 0, 1)) * (nCosThetaO - 1);
+    Float y = SafeASin(std::abs(h)) * (nGammaO - 1) * InvPi * 2;
+    int i = std::min((int)x, nCosThetaO - 2);
+    int j = std::min((int)y, nGammaO - 2);
+    Float dx = x - i, dy = y - j;
+    offset[0] = i * nGammaO + j;
+    offset[1] = offset[0] + 1;
+    offset[2] = offset[0] + nGammaO;
+    offset[3] = offset[2] + 1;
+    w[0] = (1 - dx) * (1 - dy);
+    w[1] = (1 - dx) * dy;
+    w[2] = dx * (1 - dy);
+    w[3] = dx * dy;
+}
+
+std::array<Spectrum, pMax + 1> HairAttenuationTable::Ap(Float cosThetaO,
+                                                        Float h) const {
+    int offset[4];
+    Float w[4];
+    Weights(cosThetaO, h, offset, w);
+    std::array<Spectrum, pMax + 1> result;
+    for (int p = 0; p <= pMax; ++p)
+        result[p] = w[0] * ap[offset[0]][p] + w[1] * ap[offset[1]][p] +
+                    w[2] * ap[offset[2]][p] + w[3] * ap[offset[3]][p];
+    return result;
+}
+
+std::array<Float, pMax + 1> HairAttenuationTable::ApPdf(Float cosThetaO,
+                                                        Float h) const {
+    int offset[4];
+    Float w[4];
+    Weights(cosThetaO, h, offset, w);
+    std::array<Float, pMax + 1> result;
+    for (int p = 0; p <= pMax; ++p)
+        result[p] = w[0] * apPdf[offset[0]][p] + w[1] * apPdf[offset[1]][p] +
+                    w[2] * apPdf[offset[2]][p] + w[3] * apPdf[offset[3]][p];
+    return result;
+}
+
+// HairDualScattering Method Definitions
+HairDualScattering::HairDualScattering(Float eta, const Spectrum &sigma_a,
+                                       Float beta_m, Float beta_n,
+                                       Float alpha) {
+    RNG rng;
+    const int nSamples = 4096;
+    // Computes the mean and variance from the moments _m_ of a distribution
+    auto meanVariance = [](const Float m[3], Float *mean, Float *var) {
+        *mean = m[0] > 0 ? m[1] / m[0] : 0;
+        *var = std::max(m[0] > 0 ? m[2] / m[0] - Sqr(*mean) : 0, Float(1e-4));
+    };
+    for (int i = 0; i < nTheta; ++i) {
+        // Estimate the albedo of both halves of _HairBSDF_ at $\theta_o$
+        Float thetaO = -PiOver2 + (i + 0.5f) * Pi / nTheta;
+        Vector3f wo(std::sin(thetaO), std::cos(thetaO), 0);
+        aF[i] = aB[i] = Spectrum(0.f);
+        Float mF[3] = {0, 0, 0}, mB[3] = {0, 0, 0};
+        for (int j = 0; j < nSamples; ++j) {
+            Float h = -1 + 2 * (j + rng.UniformFloat()) / nSamples;
+            HairBSDF bsdf(h, eta, sigma_a, beta_m, beta_n, alpha);
+            Vector3f wi;
+            Float pdf;
+            Point2f u(rng.UniformFloat(), rng.UniformFloat());
+            Spectrum f = bsdf.Sample_f(wo, &wi, u, &pdf, nullptr);
+            if (pdf == 0) continue;
+            Spectrum w = f * AbsCosTheta(wi) / (pdf * nSamples);
+
+            // Light arriving from the far side of the fiber is scattered
+            // forward; $\phi_o = 0$, so that is the case for $y < 0$
+            bool forward = wi.y < 0;
+            (forward ? aF[i] : aB[i]) += w;
+            Float *m = forward ? mF : mB;
+            Float offset = SafeASin(wi.x) + thetaO;
+            m[0] += w.y();
+            m[1] += w.y() * offset;
+            m[2] += w.y() * Sqr(offset);
+        }
+        Float mS[3] = {mF[0] + mB[0], mF[1] + mB[1], mF[2] + mB[2]};
+        meanVariance(mF, &shiftF[i], &varF[i]);
+        meanVariance(mB, &shiftB[i], &varB[i]);
+        meanVariance(mS, &shiftS[i], &varS[i]);
+    }
+}
+
+Spectrum HairDualScattering::f(const Vector3f &wo, const Vector3f &wi,
+                               int nCrossings, Float df, Float db) const {
+    Float thetaO = SafeASin(wo.x), thetaI = SafeASin(wi.x);
+    Float cosThetaI = SafeSqrt(1 - Sqr(wi.x));
+    if (cosThetaI == 0 || AbsCosTheta(wi) == 0) return Spectrum(0.f);
+
+    // Interpolate the fiber terms at $\theta_d$
+    Float x = Clamp(((thetaO - thetaI) / 2 + PiOver2) * nTheta / Pi - 0.5f, 0,
+                    nTheta - 1);
+    int i = std::min((int)x, nTheta - 2);
+    Float dx = x - i;
+    Spectrum af = ((1 - dx) * aF[i] + dx * aF[i + 1]).Clamp(0, .99f);
+    Spectrum ab = (1 - dx) * aB[i] + dx * aB[i + 1];
+    Float sF = Lerp(dx, shiftF[i], shiftF[i + 1]);
+    Float sB = Lerp(dx, shiftB[i], shiftB[i + 1]);
+    Float sS = Lerp(dx, shiftS[i], shiftS[i + 1]);
+    Float vF = Lerp(dx, varF[i], varF[i + 1]);
+    Float vB = Lerp(dx, varB[i], varB[i + 1]);
+    Float vS = Lerp(dx, varS[i], varS[i + 1]);
+
+    // Compute average back-scattering attenuation from paths that are
+    // scattered backward once or three times
+    Spectrum af2 = af * af, rf = Spectrum(1.f) - af2;
+    Spectrum A1 = ab * af2 / rf;
+    Spectrum A3 = ab * ab * ab * af2 / (rf * rf * rf);
+    Spectrum Ab = A1 + A3;
+
+    // Compute mean offset and variance of back scattering; the variance
+    // weights the spread of both kinds of paths by their attenuation
+    Float afy = af.y(), aby = ab.y(), rfy = 1 - Sqr(afy);
+    Float shiftBack =
+        sB * (1 - 2 * Sqr(aby) / Sqr(rfy)) +
+        sF * (2 * Sqr(rfy) + 4 * Sqr(afy) * Sqr(aby)) / (rfy * rfy * rfy);
+    Float a1 = A1.y(), a3 = A3.y();
+    Float varBack = 0;
+    if (a1 + a3 > 0)
+        varBack = Sqr(1 + db * Sqr(afy)) *
+                  (a1 * (2 * vF + vB) + a3 * (2 * vF + 3 * vB)) / (a1 + a3);
+
+    // Compute forward scattering transmittance and spread of _nCrossings_
+    Spectrum Tf(1.f);
+    Float varGlobal = 0;
+    if (nCrossings > 0) {
+        Tf = df * Pow(af, nCrossings);
+        varGlobal = nCrossings * vF;
+    }
+
+    // Evaluate back scattering, which is spread uniformly over the
+    // backward half in $\phi$, and spread out single scattering
+    Float offset = thetaI + thetaO;
+    Spectrum fs(0.f);
+    if (wo.y * wi.y + wo.z * wi.z > 0 && varBack > 0)
+        fs += db * Ab * Gaussian(offset, shiftBack, varBack + varGlobal) / Pi;
+    if (nCrossings > 0)
+        fs += (af + ab) * Gaussian(offset, sS, vS + varGlobal) / (2 * Pi);
+    return Tf * fs / (cosThetaI * AbsCosTheta(wi));
+}
+
 Spectrum HairBSDF::SigmaAFromConcentration(Float ce, Float cp) {
     Float sigma_a[3];
     Float eumelaninSigmaA[3] = {0.419f, 0.697f, 1.37f};
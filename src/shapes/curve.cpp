@@ -33,16 +33,46 @@
 
 // shapes/curve.cpp*
 #include "shapes/curve.h"
+#include "shapes/hairfile.h"
+#include "accelerators/bvh.h"
+#include "camera.h"
 #include "paramset.h"
+#include "primitive.h"
+#include "simd.h"
 #include "stats.h"
 
+#include <list>
+#include <mutex>
+#include <string.h>
+#include <unordered_map>
+#ifdef PBRT_HAVE_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
 namespace pbrt {
 
 STAT_MEMORY_COUNTER("Memory/Curves", curveBytes);
+STAT_MEMORY_COUNTER("Memory/Mapped hair files", mappedHairBytes);
 STAT_PERCENT("Intersections/Ray-curve intersection tests", nHits, nTests);
 STAT_INT_DISTRIBUTION("Intersections/Curve refinement level", refinementLevel);
 STAT_COUNTER("Scene/Curves", nCurves);
 STAT_COUNTER("Scene/Split curves", nSplitCurves);
+STAT_COUNTER("Scene/Hair LOD shapes", nHairLODShapes);
+STAT_INT_DISTRIBUTION("Scene/Hair LOD level", hairLODLevel);
+STAT_MEMORY_COUNTER("Memory/Child hair guides", childHairBytes);
+STAT_PERCENT("Scene/Child hair cluster cache hits", nChildHairHits,
+             nChildHairLookups);
+STAT_PERCENT("Scene/Curves removed by pruning", nPrunedCurves,
+             nPruneCandidates);
+STAT_PERCENT("Intersections/Shadow rays passing partially covered curves",
+             nCoveragePassed, nCoverageTests);
 
 // Curve Utility Functions
 static Point3f BlossomBezier(const Point3f p[4], Float u0, Float u1, Float u2) {
@@ -52,6 +82,13 @@ static Point3f BlossomBezier(const Point3f p[4], Float u0, Float u1, Float u2) {
     return Lerp(u2, b[0], b[1]);
 }
 
+static Float BlossomBezier(const Float w[4], Float u0, Float u1, Float u2) {
+    Float a[3] = {Lerp(u0, w[0], w[1]), Lerp(u0, w[1], w[2]),
+                  Lerp(u0, w[2], w[3])};
+    Float b[2] = {Lerp(u1, a[0], a[1]), Lerp(u1, a[1], a[2])};
+    return Lerp(u2, b[0], b[1]);
+}
+
 inline void SubdivideBezier(const Point3f cp[4], Point3f cpSplit[7]) {
     cpSplit[0] = cp[0];
     cpSplit[1] = (cp[0] + cp[1]) / 2;
@@ -83,71 +120,373 @@ static Point3f EvalBezier(const Point3f cp[4], Float u,
     return Lerp(u, cp2[0], cp2[1]);
 }
 
+static uint64_t MixBits(uint64_t v) {
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ull;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= v >> 33;
+    return v;
+}
+
+// Returns _h_ with the coordinates of the point or vector _v_ mixed in.
+template <typename T>
+static uint64_t HashCoordinates(uint64_t h, const T &v) {
+    for (int c = 0; c < 3; ++c) h = MixBits(h ^ FloatToBits(v[c]));
+    return h;
+}
+
+// Returns a uniform sample in [0,1) that is a deterministic function of
+// _seed_ and _salt_.  The stochastic decisions below hash the same
+// inputs with different salts, so that they are independent of each
+// other.
+static Float HashSample(uint64_t seed, uint64_t salt) {
+    return (MixBits(seed ^ salt) >> 40) * Float(0x1p-24);
+}
+
+// Returns a uniform sample in [0,1) that is a deterministic function of
+// the ray, so that every curve a ray is tested against makes the same
+// stochastic LOD decision.
+static Float RayLODSample(const Ray &ray) {
+    return HashSample(HashCoordinates(HashCoordinates(0, ray.o), ray.d), 1);
+}
+
+// Returns a uniform sample in [0,1) that is a deterministic function of
+// the ray and the root point of a strand, so that all pieces of a strand
+// (or of a chain of segments) agree on whether a shadow ray passes through
+// it but different strands decide independently.
+static Float RayCoverageSample(const Ray &ray, const Point3f &root) {
+    uint64_t seed = HashCoordinates(0, root);
+    return HashSample(HashCoordinates(HashCoordinates(seed, ray.o), ray.d),
+                      2);
+}
+
+// Returns a uniform sample in [0,1) that is a deterministic function of a
+// strand's root point, so that pruning keeps the same strands regardless
+// of the order in which they are created and all segments of a strand
+// make the same decision.
+static Float StrandPruneSample(const Point3f &root) {
+    return HashSample(HashCoordinates(0, root), 3);
+}
+
+// Returns true if a ray with object-space footprint _footprint_ and LOD
+// sample _lodU_ selects the level described by _lodRadius_.  Between two
+// levels the selection blends linearly in the footprint, which avoids
+// visible popping as the footprint grows.
+static bool InLODLevel(const Float lodRadius[3], Float footprint, Float lodU) {
+    return footprint >= Lerp(1 - lodU, lodRadius[0], lodRadius[1]) &&
+           footprint < Lerp(1 - lodU, lodRadius[1], lodRadius[2]);
+}
+
 // Curve Method Definitions
-CurveCommon::CurveCommon(const Point3f c[4], Float width0, Float width1,
-                         CurveType type, const Normal3f *norm)
-    : type(type) {
-    width[0] = width0;
-    width[1] = width1;
-    for (int i = 0; i < 4; ++i)
-        cpObj[i] = c[i];
+std::atomic<uint64_t> CurveCommon::nextId(0);
+
+CurveCommon::CurveCommon(const Point3f c[4], const Float w[4], CurveType type,
+                         const Normal3f *norm)
+    : type(type),
+      nStrands(1),
+      nSegments(1),
+      offsetStorage(new int[2]{0, 4}),
+      cpStorage(new Point3f[4]),
+      widthStorage(new Float[4]) {
+    for (int i = 0; i < 4; ++i) {
+        cpStorage[i] = c[i];
+        widthStorage[i] = w[i];
+    }
+    strandOffsets = offsetStorage.get();
+    cpObj = cpStorage.get();
+    width = widthStorage.get();
     if (norm) {
         n[0] = Normalize(norm[0]);
         n[1] = Normalize(norm[1]);
         normalAngle = std::acos(Clamp(Dot(n[0], n[1]), 0, 1));
         invSinNormalAngle = 1 / std::sin(normalAngle);
     }
+    lodRadius[0] = lodRadius[1] = 0;
+    lodRadius[2] = Infinity;
+    curveBytes += sizeof(CurveCommon) + 4 * (sizeof(Point3f) + sizeof(Float));
     ++nCurves;
 }
 
-std::vector<std::shared_ptr<Shape>> CreateCurve(
+CurveCommon::CurveCommon(CurveType type, int nStrands,
+                         const int *strandSegments, const Point3f *P,
+                         const Float *widths, Float w, bool generated)
+    : type(type),
+      nStrands(nStrands),
+      nSegments(0),
+      offsetStorage(new int[nStrands + 1]),
+      generated(generated) {
+    CHECK_NE(type, CurveType::Ribbon);
+    offsetStorage[0] = 0;
+    for (int i = 0; i < nStrands; ++i) {
+        nSegments += strandSegments[i];
+        offsetStorage[i + 1] = offsetStorage[i] + 3 * strandSegments[i] + 1;
+    }
+    int nCPs = offsetStorage[nStrands];
+    cpStorage.reset(new Point3f[nCPs]);
+    widthStorage.reset(new Float[nCPs]);
+    for (int i = 0; i < nCPs; ++i) {
+        cpStorage[i] = P[i];
+        widthStorage[i] = widths ? widths[i] : w;
+    }
+    strandOffsets = offsetStorage.get();
+    cpObj = cpStorage.get();
+    width = widthStorage.get();
+    lodRadius[0] = lodRadius[1] = 0;
+    lodRadius[2] = Infinity;
+    if (generated) return;
+    curveBytes += sizeof(CurveCommon) + (nStrands + 1) * sizeof(int) +
+                  nCPs * (sizeof(Point3f) + sizeof(Float));
+    nCurves += nSegments;
+}
+
+CurveCommon::CurveCommon(CurveType type, int nStrands,
+                         const int *strandOffsets, const Point3f *P,
+                         const Float *widths, std::shared_ptr<void> mapping)
+    : type(type),
+      nStrands(nStrands),
+      nSegments((strandOffsets[nStrands] - nStrands) / 3),
+      strandOffsets(strandOffsets),
+      cpObj(P),
+      width(widths),
+      mapping(std::move(mapping)) {
+    CHECK_NE(type, CurveType::Ribbon);
+    lodRadius[0] = lodRadius[1] = 0;
+    lodRadius[2] = Infinity;
+    curveBytes += sizeof(CurveCommon);
+    nCurves += nSegments;
+}
+
+// Sets the coverage of all strands, copying _c_.
+void CurveCommon::SetCoverage(const Float *c) {
+    coverageStorage.reset(new Float[nStrands]);
+    std::copy(c, c + nStrands, coverageStorage.get());
+    coverage = coverageStorage.get();
+    curveBytes += nStrands * sizeof(Float);
+}
+
+// Replaces the control points and widths by 16-bit values relative to the
+// bounds and maximum width of each strand, which halves their storage.  The
+// error of each coordinate is at most 1/131070 of the strand's extent.
+void CurveCommon::Quantize() {
+    CHECK(!quantizedCp && type != CurveType::Ribbon);
+    const int nCPs = strandOffsets[nStrands];
+    quantizedCp.reset(new QuantizedCp[nCPs]);
+    strandFrames.reset(new StrandFrame[nStrands]);
+    auto quantize = [](Float v, Float scale) -> uint16_t {
+        return scale > 0 ? uint16_t(Clamp(std::round(v / scale), 0, 65535))
+                         : 0;
+    };
+    for (int strand = 0; strand < nStrands; ++strand) {
+        // Compute the bounds and maximum width of _strand_
+        Bounds3f b;
+        Float maxWidth = 0;
+        for (int i = strandOffsets[strand]; i < strandOffsets[strand + 1];
+             ++i) {
+            b = Union(b, cpObj[i]);
+            maxWidth = std::max(maxWidth, width[i]);
+        }
+        StrandFrame &f = strandFrames[strand];
+        f.origin = b.pMin;
+        f.scale = b.Diagonal() / 65535;
+        f.widthScale = maxWidth / 65535;
+
+        // Quantize the control points of _strand_ relative to its frame
+        for (int i = strandOffsets[strand]; i < strandOffsets[strand + 1];
+             ++i) {
+            Vector3f d = cpObj[i] - f.origin;
+            for (int c = 0; c < 3; ++c)
+                quantizedCp[i].p[c] = quantize(d[c], f.scale[c]);
+            quantizedCp[i].w = quantize(width[i], f.widthScale);
+        }
+    }
+
+    // Release the full precision data; offsets and coverage of a mapped
+    // file are copied
+    if (!offsetStorage) {
+        offsetStorage.reset(new int[nStrands + 1]);
+        std::copy(strandOffsets, strandOffsets + nStrands + 1,
+                  offsetStorage.get());
+        strandOffsets = offsetStorage.get();
+        curveBytes += (nStrands + 1) * sizeof(int);
+    }
+    if (coverage && !coverageStorage) SetCoverage(coverage);
+    if (cpStorage) curveBytes -= nCPs * (sizeof(Point3f) + sizeof(Float));
+    cpStorage.reset();
+    widthStorage.reset();
+    mapping.reset();
+    cpObj = nullptr;
+    width = nullptr;
+    curveBytes +=
+        nCPs * sizeof(QuantizedCp) + nStrands * sizeof(StrandFrame);
+}
+
+// Creates _Curve_s for all segments of _common_, each split into
+// 2^_splitDepth_ pieces.
+static std::vector<std::shared_ptr<Shape>> CreateCurves(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
-    const Point3f *c, Float w0, Float w1, CurveType type,
-    const Normal3f *norm, int splitDepth) {
+    const std::shared_ptr<CurveCommon> &common, int splitDepth) {
     std::vector<std::shared_ptr<Shape>> segments;
-    std::shared_ptr<CurveCommon> common =
-        std::make_shared<CurveCommon>(c, w0, w1, type, norm);
-    const int nSegments = 1 << splitDepth;
-    segments.reserve(nSegments);
-    for (int i = 0; i < nSegments; ++i) {
-        Float uMin = i / (Float)nSegments;
-        Float uMax = (i + 1) / (Float)nSegments;
-        segments.push_back(std::make_shared<Curve>(o2w, w2o, reverseOrientation,
-                                                   common, uMin, uMax));
-        ++nSplitCurves;
-    }
-    curveBytes += sizeof(CurveCommon) + nSegments * sizeof(Curve);
+    const int nSplits = 1 << splitDepth;
+    segments.reserve(common->nSegments * nSplits);
+    for (int strand = 0; strand < common->nStrands; ++strand)
+        for (int cp = common->strandOffsets[strand];
+             cp + 3 < common->strandOffsets[strand + 1]; cp += 3)
+            for (int i = 0; i < nSplits; ++i) {
+                Float uMin = i / (Float)nSplits;
+                Float uMax = (i + 1) / (Float)nSplits;
+                segments.push_back(std::make_shared<Curve>(
+                    o2w, w2o, reverseOrientation, common, cp, uMin, uMax,
+                    strand));
+            }
+    if (!common->generated) {
+        nSplitCurves += segments.size();
+        curveBytes += segments.size() * sizeof(Curve);
+    }
     return segments;
 }
 
+std::vector<std::shared_ptr<Shape>> CreateCurve(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const Point3f *c, const Float *w, CurveType type, const Normal3f *norm,
+    int splitDepth) {
+    std::shared_ptr<CurveCommon> common =
+        std::make_shared<CurveCommon>(c, w, type, norm);
+    return CreateCurves(o2w, w2o, reverseOrientation, common, splitDepth);
+}
+
+Float Curve::widthAt(Float u) const {
+    Float w[4];
+    segmentWidth(w);
+    return BlossomBezier(w, u, u, u);
+}
+
+// Returns an upper bound of the width over [u0, u1]: the width Bezier of
+// that range lies within the convex hull of its blossomed control values.
+Float Curve::widthBound(Float u0, Float u1) const {
+    Float w[4];
+    segmentWidth(w);
+    return std::max(std::max(BlossomBezier(w, u0, u0, u0),
+                             BlossomBezier(w, u0, u0, u1)),
+                    std::max(BlossomBezier(w, u0, u1, u1),
+                             BlossomBezier(w, u1, u1, u1)));
+}
+
 Bounds3f Curve::ObjectBound() const {
     // Compute object-space control points for curve segment, _cpObj_
+    Point3f cp[4];
+    segmentCp(cp);
     Point3f cpObj[4];
-    cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
-    cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
-    cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
-    cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
+    cpObj[0] = BlossomBezier(cp, uMin, uMin, uMin);
+    cpObj[1] = BlossomBezier(cp, uMin, uMin, uMax);
+    cpObj[2] = BlossomBezier(cp, uMin, uMax, uMax);
+    cpObj[3] = BlossomBezier(cp, uMax, uMax, uMax);
     Bounds3f b =
         Union(Bounds3f(cpObj[0], cpObj[1]), Bounds3f(cpObj[2], cpObj[3]));
-    Float width[2] = {Lerp(uMin, common->width[0], common->width[1]),
-                      Lerp(uMax, common->width[0], common->width[1])};
-    return Expand(b, std::max(width[0], width[1]) * 0.5f);
+    return Expand(b, widthBound(uMin, uMax) * 0.5f);
+}
+
+Bounds3f Curve::FrameBound(const Transform &WorldToFrame) const {
+    // The curve lies within the convex hull of its control points swept by
+    // a sphere of the maximum radius.  The sphere maps to an ellipsoid
+    // whose extent along each frame axis is the radius times the length
+    // of the corresponding row of the transformation.
+    Point3f cp[4];
+    segmentCp(cp);
+    Transform objectToFrame = WorldToFrame * (*ObjectToWorld);
+    const Matrix4x4 &m = objectToFrame.GetMatrix();
+    Float radius = widthBound(uMin, uMax) * 0.5f;
+    Vector3f extent;
+    for (int i = 0; i < 3; ++i)
+        extent[i] = radius * std::sqrt(m.m[i][0] * m.m[i][0] +
+                                       m.m[i][1] * m.m[i][1] +
+                                       m.m[i][2] * m.m[i][2]);
+    Bounds3f b;
+    b = Union(b, objectToFrame(BlossomBezier(cp, uMin, uMin, uMin)));
+    b = Union(b, objectToFrame(BlossomBezier(cp, uMin, uMin, uMax)));
+    b = Union(b, objectToFrame(BlossomBezier(cp, uMin, uMax, uMax)));
+    b = Union(b, objectToFrame(BlossomBezier(cp, uMax, uMax, uMax)));
+    return Bounds3f(b.pMin - extent, b.pMax + extent);
+}
+
+Vector3f Curve::PrincipalAxis() const {
+    Point3f cp[4];
+    segmentCp(cp);
+    return (*ObjectToWorld)(BlossomBezier(cp, uMax, uMax, uMax) -
+                            BlossomBezier(cp, uMin, uMin, uMin));
+}
+
+Bounds3f Curve::ClippedWorldBound(const Bounds3f &clip) const {
+    // Bound pieces of the curve as in _FrameBound()_ and keep the parts
+    // inside _clip_
+    PBRT_CONSTEXPR int nPieces = 4;
+    Point3f cpObj[4], cp[4];
+    Float w[4];
+    segmentCp(cpObj);
+    segmentWidth(w);
+    for (int i = 0; i < 4; ++i) cp[i] = (*ObjectToWorld)(cpObj[i]);
+    const Matrix4x4 &m = ObjectToWorld->GetMatrix();
+    Vector3f scale;
+    for (int i = 0; i < 3; ++i)
+        scale[i] = std::sqrt(m.m[i][0] * m.m[i][0] + m.m[i][1] * m.m[i][1] +
+                             m.m[i][2] * m.m[i][2]);
+    Bounds3f b;
+    for (int i = 0; i < nPieces; ++i) {
+        Float u0 = Lerp(Float(i) / nPieces, uMin, uMax);
+        Float u1 = Lerp(Float(i + 1) / nPieces, uMin, uMax);
+        Bounds3f piece(BlossomBezier(cp, u0, u0, u0),
+                       BlossomBezier(cp, u1, u1, u1));
+        piece = Union(piece, BlossomBezier(cp, u0, u0, u1));
+        piece = Union(piece, BlossomBezier(cp, u0, u1, u1));
+        Float width = std::max(std::max(BlossomBezier(w, u0, u0, u0),
+                                        BlossomBezier(w, u0, u0, u1)),
+                               std::max(BlossomBezier(w, u0, u1, u1),
+                                        BlossomBezier(w, u1, u1, u1)));
+        Vector3f extent = width * 0.5f * scale;
+        piece = pbrt::Intersect(
+            Bounds3f(piece.pMin - extent, piece.pMax + extent), clip);
+        if (!piece.IsEmpty()) b = Union(b, piece);
+    }
+    return b;
+}
+
+bool Curve::StrandPosition(uint64_t *strandId, Float *position) const {
+    if (common->type == CurveType::Ribbon) return false;
+    // Consecutive segments of a strand are three control points apart, or
+    // consecutive strands of a chain
+    int head = common->ChainStart(strand);
+    int segment =
+        (cpOffset - common->strandOffsets[strand]) / 3 + (strand - head);
+    *strandId = (common->id << 32) | uint32_t(head);
+    *position = segment + uMin;
+    return true;
 }
 
 bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
                       bool testAlphaTexture) const {
     ProfilePhase p(isect ? Prof::CurveIntersect : Prof::CurveIntersectP);
+    // Shadow rays see partially covered strands as partially transmissive
+    if (!isect && common->coverage && common->coverage[strand] < 1) {
+        ++nCoverageTests;
+        if (RayCoverageSample(r, common->StrandRoot(strand)) >=
+            common->coverage[strand]) {
+            ++nCoveragePassed;
+            return false;
+        }
+    }
     ++nTests;
     // Transform _Ray_ to object space
     Vector3f oErr, dErr;
     Ray ray = (*WorldToObject)(r, &oErr, &dErr);
 
     // Compute object-space control points for curve segment, _cpObj_
+    Point3f cpSeg[4];
+    segmentCp(cpSeg);
     Point3f cpObj[4];
-    cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
-    cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
-    cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
-    cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
+    cpObj[0] = BlossomBezier(cpSeg, uMin, uMin, uMin);
+    cpObj[1] = BlossomBezier(cpSeg, uMin, uMin, uMax);
+    cpObj[2] = BlossomBezier(cpSeg, uMin, uMax, uMax);
+    cpObj[3] = BlossomBezier(cpSeg, uMax, uMax, uMax);
 
     // Project curve control points to plane perpendicular to ray
 
@@ -177,8 +516,7 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
     // the curve's bounding box. We start with the y dimension, since the y
     // extent is generally the smallest (and is often tiny) due to our
     // careful orientation of the ray coordinate ysstem above.
-    Float maxWidth = std::max(Lerp(uMin, common->width[0], common->width[1]),
-                              Lerp(uMax, common->width[0], common->width[1]));
+    Float maxWidth = widthBound(uMin, uMax);
     if (std::max(std::max(cp[0].y, cp[1].y), std::max(cp[2].y, cp[3].y)) +
             0.5f * maxWidth < 0 ||
         std::min(std::min(cp[0].y, cp[1].y), std::min(cp[2].y, cp[3].y)) -
@@ -201,6 +539,24 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
             0.5f * maxWidth > zMax)
         return false;
 
+    // Skip curves of LOD levels the ray's footprint can't select over the
+    // curve's depth range
+    Float lodU = 0;
+    if (common->lodRadius[1] > 0 || common->lodRadius[2] < Infinity) {
+        lodU = RayLODSample(ray);
+        Float zNear = std::max<Float>(
+            std::min(std::min(cp[0].z, cp[1].z), std::min(cp[2].z, cp[3].z)) -
+                0.5f * maxWidth, 0);
+        Float zFar = std::min(
+            std::max(std::max(cp[0].z, cp[1].z), std::max(cp[2].z, cp[3].z)) +
+                0.5f * maxWidth, zMax);
+        Float fNear = ray.coneWidth * rayLength + ray.coneSpread * zNear;
+        Float fFar = ray.coneWidth * rayLength + ray.coneSpread * zFar;
+        if (fFar < Lerp(1 - lodU, common->lodRadius[0], common->lodRadius[1]) ||
+            fNear >= Lerp(1 - lodU, common->lodRadius[1], common->lodRadius[2]))
+            return false;
+    }
+
     // Compute refinement depth for curve, _maxDepth_
     Float L0 = 0;
     for (int i = 0; i < 2; ++i)
@@ -210,8 +566,7 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
                              std::abs(cp[i].y - 2 * cp[i + 1].y + cp[i + 2].y)),
                     std::abs(cp[i].z - 2 * cp[i + 1].z + cp[i + 2].z)));
 
-    Float eps =
-        std::max(common->width[0], common->width[1]) * .05f;  // width / 20
+    Float eps = widthBound(0, 1) * .05f;  // width / 20
     auto Log2 = [](Float v) -> int {
         if (v < 1) return 0;
         uint32_t bits = FloatToBits(v);
@@ -226,15 +581,21 @@ bool Curve::Intersect(const Ray &r, Float *tHit, SurfaceInteraction *isect,
     ReportValue(refinementLevel, maxDepth);
 
     return recursiveIntersect(ray, tHit, isect, cp, Inverse(objectToRay), uMin,
-                              uMax, maxDepth);
+                              uMax, maxDepth, lodU);
 }
 
 bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
                                SurfaceInteraction *isect, const Point3f cp[4],
                                const Transform &rayToObject, Float u0, Float u1,
-                               int depth) const {
+                               int depth, Float lodU) const {
     Float rayLength = ray.d.Length();
 
+#ifdef PBRT_HAVE_FLOAT4
+    // Test the spans of the last few refinement levels all at once
+    if (depth > 0 && depth <= 3)
+        return intersectSpans(ray, tHit, isect, cp, rayToObject, u0, u1, depth,
+                              lodU);
+#endif
     if (depth > 0) {
         // Split curve segment into sub-segments and test for intersection
         Point3f cpSplit[7];
@@ -248,9 +609,7 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
         // Pointer to the 4 control poitns for the current segment.
         const Point3f *cps = cpSplit;
         for (int seg = 0; seg < 2; ++seg, cps += 3) {
-            Float maxWidth =
-                std::max(Lerp(u[seg], common->width[0], common->width[1]),
-                         Lerp(u[seg + 1], common->width[0], common->width[1]));
+            Float maxWidth = widthBound(u[seg], u[seg + 1]);
 
             // As above, check y first, since it most commonly lets us exit
             // out early.
@@ -280,7 +639,7 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
                 continue;
 
             hit |= recursiveIntersect(ray, tHit, isect, cps, rayToObject,
-                                      u[seg], u[seg + 1], depth - 1);
+                                      u[seg], u[seg + 1], depth - 1, lodU);
             // If we found an intersection and this is a shadow ray,
             // we can exit out immediately.
             if (hit && !tHit) return true;
@@ -308,7 +667,7 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
 
         // Compute $u$ coordinate of curve intersection point and _hitWidth_
         Float u = Clamp(Lerp(w, u0, u1), u0, u1);
-        Float hitWidth = Lerp(u, common->width[0], common->width[1]);
+        Float hitWidth = widthAt(u);
         Normal3f nHit;
         if (common->type == CurveType::Ribbon) {
             // Scale _hitWidth_ based on ribbon orientation
@@ -327,6 +686,10 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
         if (ptCurveDist2 > hitWidth * hitWidth * .25) return false;
         Float zMax = rayLength * ray.tMax;
         if (pc.z < 0 || pc.z > zMax) return false;
+        if (!InLODLevel(common->lodRadius,
+                        ray.coneWidth * rayLength + ray.coneSpread * pc.z,
+                        lodU))
+            return false;
 
         // Compute $v$ coordinate of curve intersection point
         Float ptCurveDist = std::sqrt(ptCurveDist2);
@@ -343,10 +706,12 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
 
             // Compute $\dpdu$ and $\dpdv$ for curve intersection
             Vector3f dpdu, dpdv;
-            EvalBezier(common->cpObj, u, &dpdu);
+            Point3f cpSeg[4];
+            segmentCp(cpSeg);
+            EvalBezier(cpSeg, u, &dpdu);
             CHECK_NE(Vector3f(0, 0, 0), dpdu) << "u = " << u << ", cp = " <<
-                common->cpObj[0] << ", " << common->cpObj[1] << ", " <<
-                common->cpObj[2] << ", " << common->cpObj[3];
+                cpSeg[0] << ", " << cpSeg[1] << ", " << cpSeg[2] << ", " <<
+                cpSeg[3];
 
             if (common->type == CurveType::Ribbon)
                 dpdv = Normalize(Cross(nHit, dpdu)) * hitWidth;
@@ -373,15 +738,150 @@ bool Curve::recursiveIntersect(const Ray &ray, Float *tHit,
     }
 }
 
+#ifdef PBRT_HAVE_FLOAT4
+// Control point _j_ of span _4 * v + lane_ of the 2^depth uniform spans of
+// a cubic Bezier is the sum over _k_ of _c[v][j][k]_ times control point
+// _k_, for _depth_ from one to three.
+struct SpanCoefficients {
+    SpanCoefficients(int depth) {
+        int nSpans = 1 << depth;
+        for (int v = 0; v < 2; ++v)
+            for (int j = 0; j < 4; ++j)
+                for (int k = 0; k < 4; ++k) {
+                    Float lanes[4] = {0, 0, 0, 0}, e[4] = {0, 0, 0, 0};
+                    e[k] = 1;
+                    for (int lane = 0; lane < 4; ++lane) {
+                        int span = 4 * v + lane;
+                        if (span >= nSpans) break;
+                        Float s0 = Float(span) / nSpans;
+                        Float s1 = Float(span + 1) / nSpans;
+                        lanes[lane] = BlossomBezier(e, j < 3 ? s0 : s1,
+                                                    j < 2 ? s0 : s1,
+                                                    j < 1 ? s0 : s1);
+                    }
+                    c[v][j][k] = Float4(lanes[0], lanes[1], lanes[2],
+                                        lanes[3]);
+                }
+    }
+    Float4 c[2][4][4];
+};
+
+static const SpanCoefficients spanCoefficients[3] = {
+    SpanCoefficients(1), SpanCoefficients(2), SpanCoefficients(3)};
+
+// Tests the ray against the 2^_depth_ spans that recursively subdividing
+// _cp_ would end up at, four at a time, using the bounds and leaf tests of
+// _recursiveIntersect()_ with a little slack.  Ribbons are tested against
+// their full width here.  Spans that pass are then handed to the scalar
+// leaf code, last span first, since the recursion reports the last hit
+// along the curve.
+bool Curve::intersectSpans(const Ray &ray, Float *tHit,
+                           SurfaceInteraction *isect, const Point3f cp[4],
+                           const Transform &rayToObject, Float u0, Float u1,
+                           int depth, Float lodU) const {
+    CHECK(depth >= 1 && depth <= 3);
+    const SpanCoefficients &coeffs = spanCoefficients[depth - 1];
+    const int nSpans = 1 << depth;
+    Float rayLength = ray.d.Length();
+    Float4 zMax = rayLength * ray.tMax;
+    Float4 lodMin = Lerp(1 - lodU, common->lodRadius[0], common->lodRadius[1]);
+    Float4 lodMax = Lerp(1 - lodU, common->lodRadius[1], common->lodRadius[2]);
+    // Width control values over $[u_0, u_1]$, which the coefficients split
+    // like the control points
+    Float w[4];
+    segmentWidth(w);
+    Float cpw[4] = {BlossomBezier(w, u0, u0, u0), BlossomBezier(w, u0, u0, u1),
+                    BlossomBezier(w, u0, u1, u1), BlossomBezier(w, u1, u1, u1)};
+    const Float4 zero(0), one(1), slack(1.0001f);
+
+    uint32_t spanBits = 0;
+    for (int v = 0; 4 * v < nSpans; ++v) {
+        // Compute the control points and widths of four spans
+        Float4 qx[4], qy[4], qz[4], qw[4];
+        for (int j = 0; j < 4; ++j) {
+            const Float4 *c = coeffs.c[v][j];
+            qx[j] = c[0] * cp[0].x + c[1] * cp[1].x + c[2] * cp[2].x +
+                    c[3] * cp[3].x;
+            qy[j] = c[0] * cp[0].y + c[1] * cp[1].y + c[2] * cp[2].y +
+                    c[3] * cp[3].y;
+            qz[j] = c[0] * cp[0].z + c[1] * cp[1].z + c[2] * cp[2].z +
+                    c[3] * cp[3].z;
+            qw[j] = c[0] * cpw[0] + c[1] * cpw[1] + c[2] * cpw[2] +
+                    c[3] * cpw[3];
+        }
+        Float4 halfWidth =
+            0.5f * slack * Max(Max(qw[0], qw[1]), Max(qw[2], qw[3]));
+
+        // Test the spans' bounds against the ray
+        Mask4 hit = Float4(4 * v, 4 * v + 1, 4 * v + 2, 4 * v + 3) <
+                    Float4(nSpans);
+        hit = hit & (Max(Max(qy[0], qy[1]), Max(qy[2], qy[3])) + halfWidth >=
+                     zero);
+        hit = hit & (Min(Min(qy[0], qy[1]), Min(qy[2], qy[3])) - halfWidth <=
+                     zero);
+        hit = hit & (Max(Max(qx[0], qx[1]), Max(qx[2], qx[3])) + halfWidth >=
+                     zero);
+        hit = hit & (Min(Min(qx[0], qx[1]), Min(qx[2], qx[3])) - halfWidth <=
+                     zero);
+        hit = hit & (Max(Max(qz[0], qz[1]), Max(qz[2], qz[3])) + halfWidth >=
+                     zero);
+        hit = hit & (Min(Min(qz[0], qz[1]), Min(qz[2], qz[3])) - halfWidth <=
+                     zMax);
+        if (!hit.Any()) continue;
+
+        // Test against the tangent perpendiculars at the span end points
+        hit = hit &
+              ((qy[1] - qy[0]) * -qy[0] + qx[0] * (qx[0] - qx[1]) >= zero);
+        hit = hit &
+              ((qy[2] - qy[3]) * -qy[3] + qx[3] * (qx[3] - qx[2]) >= zero);
+
+        // Test the closest point on each span against its width, using the
+        // Bernstein basis at the point's parameter _t_
+        Float4 dx = qx[3] - qx[0], dy = qy[3] - qy[0];
+        Float4 denom = dx * dx + dy * dy;
+        hit = hit & (denom != zero);
+        Float4 t = Clamp((-qx[0] * dx - qy[0] * dy) / denom, zero, one);
+        Float4 t1 = one - t;
+        Float4 b[4] = {t1 * t1 * t1, 3.f * t * t1 * t1, 3.f * t * t * t1,
+                       t * t * t};
+        Float4 pcx = b[0] * qx[0] + b[1] * qx[1] + b[2] * qx[2] + b[3] * qx[3];
+        Float4 pcy = b[0] * qy[0] + b[1] * qy[1] + b[2] * qy[2] + b[3] * qy[3];
+        Float4 pcz = b[0] * qz[0] + b[1] * qz[1] + b[2] * qz[2] + b[3] * qz[3];
+        Float4 hitWidth =
+            b[0] * qw[0] + b[1] * qw[1] + b[2] * qw[2] + b[3] * qw[3];
+        hit = hit & (pcx * pcx + pcy * pcy <=
+                     hitWidth * hitWidth * (0.25f * slack * slack));
+        hit = hit & (pcz >= zero) & (pcz <= zMax);
+        Float4 footprint = ray.coneWidth * rayLength + ray.coneSpread * pcz;
+        hit = hit & (footprint >= lodMin) & (footprint < lodMax);
+        spanBits |= hit.Bits() << (4 * v);
+    }
+
+    for (int i = nSpans - 1; i >= 0; --i) {
+        if (!(spanBits & (1u << i))) continue;
+        Float s0 = Float(i) / nSpans, s1 = Float(i + 1) / nSpans;
+        Point3f spanCp[4] = {
+            BlossomBezier(cp, s0, s0, s0), BlossomBezier(cp, s0, s0, s1),
+            BlossomBezier(cp, s0, s1, s1), BlossomBezier(cp, s1, s1, s1)};
+        if (recursiveIntersect(ray, tHit, isect, spanCp, rayToObject,
+                               Lerp(s0, u0, u1), Lerp(s1, u0, u1), 0, lodU))
+            return true;
+    }
+    return false;
+}
+#endif  // PBRT_HAVE_FLOAT4
+
 Float Curve::Area() const {
     // Compute object-space control points for curve segment, _cpObj_
+    Point3f cp[4];
+    segmentCp(cp);
     Point3f cpObj[4];
-    cpObj[0] = BlossomBezier(common->cpObj, uMin, uMin, uMin);
-    cpObj[1] = BlossomBezier(common->cpObj, uMin, uMin, uMax);
-    cpObj[2] = BlossomBezier(common->cpObj, uMin, uMax, uMax);
-    cpObj[3] = BlossomBezier(common->cpObj, uMax, uMax, uMax);
-    Float width0 = Lerp(uMin, common->width[0], common->width[1]);
-    Float width1 = Lerp(uMax, common->width[0], common->width[1]);
+    cpObj[0] = BlossomBezier(cp, uMin, uMin, uMin);
+    cpObj[1] = BlossomBezier(cp, uMin, uMin, uMax);
+    cpObj[2] = BlossomBezier(cp, uMin, uMax, uMax);
+    cpObj[3] = BlossomBezier(cp, uMax, uMax, uMax);
+    Float width0 = widthAt(uMin);
+    Float width1 = widthAt(uMax);
     Float avgWidth = (width0 + width1) * 0.5f;
     Float approxLength = 0.f;
     for (int i = 0; i < 3; ++i)
@@ -394,10 +894,167 @@ Interaction Curve::Sample(const Point2f &u, Float *pdf) const {
     return Interaction();
 }
 
+// Returns a _CurveCommon_ holding _nSegments_ independent Bezier segments
+// with four control points each, given _nSegmentWidths_ (two for the end
+// points or four for the control points) widths per segment or a single
+// _width_ for all of them.
+static std::shared_ptr<CurveCommon> CreateSegmentsCommon(
+    CurveType type, int nSegments, const Point3f *cp, const Float *widths,
+    int nSegmentWidths, Float width) {
+    CHECK(nSegmentWidths == 2 || nSegmentWidths == 4);
+    std::vector<int> strandSegments(nSegments, 1);
+    std::vector<Float> cpWidths(4 * nSegments);
+    for (int seg = 0; seg < nSegments; ++seg)
+        for (int i = 0; i < 4; ++i) {
+            const Float *w = widths + nSegmentWidths * seg;
+            if (!widths)
+                cpWidths[4 * seg + i] = width;
+            else if (nSegmentWidths == 4)
+                cpWidths[4 * seg + i] = w[i];
+            else
+                cpWidths[4 * seg + i] = Lerp(i / 3.f, w[0], w[1]);
+        }
+    std::shared_ptr<CurveCommon> common = std::make_shared<CurveCommon>(
+        type, nSegments, strandSegments.data(), cp, cpWidths.data(), width);
+
+    // A segment that starts at the end of the previous one continues its
+    // strand
+    common->chainStart.reset(new int[nSegments]);
+    for (int seg = 0; seg < nSegments; ++seg)
+        common->chainStart[seg] = (seg > 0 && cp[4 * seg] == cp[4 * seg - 1])
+                                      ? common->chainStart[seg - 1]
+                                      : seg;
+    curveBytes += nSegments * sizeof(int);
+    return common;
+}
+
+// Returns a copy of _common_ with only the strands that stochastic pruning
+// keeps with probability _keep_, widened by its inverse.  Chains of
+// segments are kept or removed as a whole.
+static std::shared_ptr<CurveCommon> PruneStrands(const CurveCommon &common,
+                                                 Float keep) {
+    CHECK(!common.quantizedCp && keep > 0);
+    std::vector<int> strandSegments, chainStart;
+    std::vector<Point3f> cp;
+    std::vector<Float> width, coverage;
+    bool kept = false;
+    for (int strand = 0; strand < common.nStrands; ++strand) {
+        if (common.ChainStart(strand) == strand) {
+            ++nPruneCandidates;
+            kept = StrandPruneSample(common.StrandRoot(strand)) < keep;
+            if (!kept) ++nPrunedCurves;
+            if (kept) chainStart.push_back(strandSegments.size());
+        } else if (kept)
+            chainStart.push_back(chainStart.back());
+        if (!kept) continue;
+        int begin = common.strandOffsets[strand];
+        int end = common.strandOffsets[strand + 1];
+        strandSegments.push_back((end - begin - 1) / 3);
+        for (int i = begin; i < end; ++i) {
+            cp.push_back(common.cpObj[i]);
+            width.push_back(common.width[i] / keep);
+        }
+        if (common.coverage) coverage.push_back(common.coverage[strand]);
+    }
+
+    std::shared_ptr<CurveCommon> pruned = std::make_shared<CurveCommon>(
+        common.type, strandSegments.size(), strandSegments.data(), cp.data(),
+        width.data(), Float(1));
+    for (int i = 0; i < 3; ++i) pruned->lodRadius[i] = common.lodRadius[i];
+    if (common.chainStart) {
+        pruned->chainStart.reset(new int[chainStart.size()]);
+        std::copy(chainStart.begin(), chainStart.end(),
+                  pruned->chainStart.get());
+        curveBytes += chainStart.size() * sizeof(int);
+    }
+    if (common.coverage) pruned->SetCoverage(coverage.data());
+    return pruned;
+}
+
+static CurveType FindCurveType(const ParamSet &params) {
+    std::string curveType = params.FindOneString("type", "flat");
+    if (curveType == "flat")
+        return CurveType::Flat;
+    else if (curveType == "ribbon")
+        return CurveType::Ribbon;
+    else if (curveType == "cylinder")
+        return CurveType::Cylinder;
+    Error("Unknown curve type \"%s\".  Using \"cylinder\".", curveType.c_str());
+    return CurveType::Cylinder;
+}
+
+// Computes the cubic Bezier control values of the curve segment starting
+// at _cpBase_ and stores them in _segCpBezier_.  Both the control points
+// and the per-control-point widths go through this conversion. (It is
+// admittedly wasteful storage-wise to turn b-splines into Bezier segments
+// and wasteful computationally to turn quadratic curves into cubics, but
+// yolo.)
+template <typename T>
+static void SegmentToBezier(const T *cpBase, int degree,
+                            const std::string &basis, T segCpBezier[4]) {
+    if (basis == "bezier") {
+        if (degree == 2) {
+            // Elevate to degree 3.
+            segCpBezier[0] = cpBase[0];
+            segCpBezier[1] = Lerp(2.f/3.f, cpBase[0], cpBase[1]);
+            segCpBezier[2] = Lerp(1.f/3.f, cpBase[1], cpBase[2]);
+            segCpBezier[3] = cpBase[2];
+        } else {
+            // Allset.
+            for (int i = 0; i < 4; ++i)
+                segCpBezier[i] = cpBase[i];
+        }
+    } else {
+        // Uniform b-spline.
+        if (degree == 2) {
+            // First compute equivalent Bezier control points via some
+            // blossiming.  We have three control points and a uniform
+            // knot vector; we'll label the points p01, p12, and p23.
+            // We want the Bezier control points of the equivalent
+            // curve, which are p11, p12, and p22.
+            T p01 = cpBase[0];
+            T p12 = cpBase[1];
+            T p23 = cpBase[2];
+
+            // We already have p12.
+            T p11 = Lerp(0.5f, p01, p12);
+            T p22 = Lerp(0.5f, p12, p23);
+
+            // Now elevate to degree 3.
+            segCpBezier[0] = p11;
+            segCpBezier[1] = Lerp(2.f/3.f, p11, p12);
+            segCpBezier[2] = Lerp(1.f/3.f, p12, p22);
+            segCpBezier[3] = p22;
+        } else {
+            // Otherwise we will blossom from p012, p123, p234, and p345
+            // to the Bezier control points p222, p223, p233, and p333.
+            // https://people.eecs.berkeley.edu/~sequin/CS284/IMGS/cubicbsplinepoints.gif
+            T p012 = cpBase[0];
+            T p123 = cpBase[1];
+            T p234 = cpBase[2];
+            T p345 = cpBase[3];
+
+            T p122 = Lerp(2.f/3.f, p012, p123);
+            T p223 = Lerp(1.f/3.f, p123, p234);
+            T p233 = Lerp(2.f/3.f, p123, p234);
+            T p334 = Lerp(1.f/3.f, p234, p345);
+
+            T p222 = Lerp(0.5f, p122, p223);
+            T p333 = Lerp(0.5f, p233, p334);
+
+            segCpBezier[0] = p222;
+            segCpBezier[1] = p223;
+            segCpBezier[2] = p233;
+            segCpBezier[3] = p333;
+        }
+    }
+}
+
 std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
                                                      const Transform *w2o,
                                                      bool reverseOrientation,
-                                                     const ParamSet &params) {
+                                                     const ParamSet &params,
+                                                     const Camera *camera) {
     Float width = params.FindOneFloat("width", 1.f);
     Float width0 = params.FindOneFloat("width0", width);
     Float width1 = params.FindOneFloat("width1", width);
@@ -440,19 +1097,18 @@ std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
     }
 
 
-    CurveType type;
-    std::string curveType = params.FindOneString("type", "flat");
-    if (curveType == "flat")
-        type = CurveType::Flat;
-    else if (curveType == "ribbon")
-        type = CurveType::Ribbon;
-    else if (curveType == "cylinder")
-        type = CurveType::Cylinder;
-    else {
-        Error("Unknown curve type \"%s\".  Using \"cylinder\".", curveType.c_str());
-        type = CurveType::Cylinder;
+    // Per-control-point widths take precedence over "width0"/"width1" and
+    // use the same basis as the control points.
+    int nWidths;
+    const Float *widths = params.FindFloat("widths", &nWidths);
+    if (widths && nWidths != ncp) {
+        Error("Must provide one \"widths\" value per control point (%d, "
+              "got %d).", ncp, nWidths);
+        return {};
     }
 
+    CurveType type = FindCurveType(params);
+
     int nnorm;
     const Normal3f *n = params.FindNormal3f("N", &nnorm);
     if (n != nullptr) {
@@ -475,84 +1131,694 @@ std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
     int sd = params.FindOneInt("splitdepth",
                                int(params.FindOneFloat("splitdepth", 3)));
 
+    // Stochastic pruning keeps a hash-selected fraction of the curves and
+    // widens the survivors by its inverse, which preserves the expected
+    // coverage of a groom.  A strand given as one curve per segment passes
+    // its root point and width to all of them, so that they all make the
+    // same decision.
+    Float keep = Clamp(params.FindOneFloat("prunefraction", 1.f), 0, 1);
+    Float prunePixelWidth = params.FindOneFloat("prunepixelwidth", 0.f);
+    int nRoots;
+    const Point3f *strandRoot = params.FindPoint3f("strandroot", &nRoots);
+    if (strandRoot && nRoots != 1) {
+        Error("Must provide a single \"strandroot\" point (got %d).",
+              nRoots);
+        return {};
+    }
+    if (prunePixelWidth > 0 && camera) {
+        // Curves that project to less than _prunePixelWidth_ pixels are
+        // kept with a probability proportional to their projected width.
+        Bounds3f bounds;
+        Float maxWidth = std::max(width0, width1);
+        for (int i = 0; i < ncp; ++i) {
+            bounds = Union(bounds, cp[i]);
+            if (widths) maxWidth = std::max(maxWidth, widths[i]);
+        }
+        if (strandRoot) {
+            maxWidth = params.FindOneFloat("strandwidth", maxWidth);
+            bounds = Bounds3f(*strandRoot);
+        }
+        bounds = Expand(bounds, maxWidth * 0.5f);
+        Float pixelWidth = ProjectedPixelWidth(*camera, (*o2w)(bounds));
+        Float diagonal = bounds.Diagonal().Length();
+        if (pixelWidth < Infinity && diagonal > 0) {
+            Float minFraction =
+                Clamp(params.FindOneFloat("pruneminfraction", .05f), 0, 1);
+            Float curvePixels = maxWidth * pixelWidth / diagonal;
+            keep *= Clamp(curvePixels / prunePixelWidth, minFraction, 1);
+        }
+    } else if (prunePixelWidth > 0) {
+        static bool warned = false;
+        if (!warned) {
+            Warning("No camera available for \"prunepixelwidth\" of "
+                    "\"curve\" shapes (inside an object instance or with "
+                    "animated transformations?). Ignoring it.");
+            warned = true;
+        }
+    }
+    Float widthScale = 1;
+    if (keep < 1) {
+        ++nPruneCandidates;
+        if (StrandPruneSample(strandRoot ? *strandRoot : cp[0]) >= keep) {
+            ++nPrunedCurves;
+            return {};
+        }
+        widthScale = 1 / keep;
+    }
+
+    // Ribbons keep one _CurveCommon_ per segment for their normals; all
+    // other segments share a single one.
     std::vector<std::shared_ptr<Shape>> curves;
-    // Pointer to the first control point for the current segment. This is
+    std::vector<Point3f> bezierCp;
+    std::vector<Float> bezierWidths;
+    // Index of the first control point for the current segment. This is
     // updated after each loop iteration depending on the current basis.
-    const Point3f *cpBase = cp;
+    int cpBase = 0;
     for (int seg = 0; seg < nSegments; ++seg) {
         Point3f segCpBezier[4];
+        Float segWidthBezier[4];
+        SegmentToBezier(&cp[cpBase], degree, basis, segCpBezier);
+        if (widths)
+            SegmentToBezier(&widths[cpBase], degree, basis, segWidthBezier);
+        else
+            for (int i = 0; i < 4; ++i)
+                segWidthBezier[i] = Lerp((seg + i / 3.f) / nSegments, width0,
+                                         width1);
+        for (int i = 0; i < 4; ++i) segWidthBezier[i] *= widthScale;
+        cpBase += (basis == "bezier") ? degree : 1;
+
+        if (type == CurveType::Ribbon) {
+            auto c = CreateCurve(o2w, w2o, reverseOrientation, segCpBezier,
+                                 segWidthBezier, type, &n[seg], sd);
+            curves.insert(curves.end(), c.begin(), c.end());
+        } else {
+            bezierCp.insert(bezierCp.end(), segCpBezier, segCpBezier + 4);
+            bezierWidths.insert(bezierWidths.end(), segWidthBezier,
+                                segWidthBezier + 4);
+        }
+    }
+    if (type != CurveType::Ribbon) {
+        std::shared_ptr<CurveCommon> common =
+            CreateSegmentsCommon(type, nSegments, bezierCp.data(),
+                                 bezierWidths.data(), 4, width);
+        std::fill(common->chainStart.get(),
+                  common->chainStart.get() + nSegments, 0);
+        curves = CreateCurves(o2w, w2o, reverseOrientation, common, sd);
+    }
+    return curves;
+}
 
-        // First, compute the cubic Bezier control points for the current
-        // segment and store them in segCpBezier. (It is admittedly
-        // wasteful storage-wise to turn b-splines into Bezier segments and
-        // wasteful computationally to turn quadratic curves into cubics,
-        // but yolo.)
-        if (basis == "bezier") {
-            if (degree == 2) {
-                // Elevate to degree 3.
-                segCpBezier[0] = cpBase[0];
-                segCpBezier[1] = Lerp(2.f/3.f, cpBase[0], cpBase[1]);
-                segCpBezier[2] = Lerp(1.f/3.f, cpBase[1], cpBase[2]);
-                segCpBezier[3] = cpBase[2];
-            } else {
-                // Allset.
-                for (int i = 0; i < 4; ++i)
-                    segCpBezier[i] = cpBase[i];
+std::vector<std::shared_ptr<Shape>> CreateHairLODShape(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params, const Camera *camera) {
+    int ncp, nLevels;
+    const Point3f *cp = params.FindPoint3f("P", &ncp);
+    const int *levelSegments = params.FindInt("levelsegments", &nLevels);
+    if (!cp || !levelSegments) {
+        Error("\"hairlod\" shape requires \"P\" and \"levelsegments\".");
+        return {};
+    }
+    int nSegments = 0;
+    for (int i = 0; i < nLevels; ++i) nSegments += levelSegments[i];
+    if (ncp != 4 * nSegments) {
+        Error("Invalid number of control points %d for \"hairlod\" shape: "
+              "%d Bezier segments need %d.", ncp, nSegments, 4 * nSegments);
+        return {};
+    }
+    int nRadii, nWidths;
+    const Float *levelRadius = params.FindFloat("levelradius", &nRadii);
+    if (levelRadius && nRadii != nLevels) {
+        Error("Must provide one \"levelradius\" per LOD level (%d, got %d).",
+              nLevels, nRadii);
+        return {};
+    }
+    const Float *widths = params.FindFloat("widths", &nWidths);
+    // Widths are given either at the segment end points or at all four
+    // control points.
+    int nSegmentWidths = 2;
+    if (widths) {
+        if (nWidths == 4 * nSegments)
+            nSegmentWidths = 4;
+        else if (nWidths != 2 * nSegments) {
+            Error("Must provide two or four \"widths\" per segment (%d or "
+                  "%d, got %d).", 2 * nSegments, 4 * nSegments, nWidths);
+            return {};
+        }
+    }
+    int nCoverage;
+    const Float *coverage = params.FindFloat("coverage", &nCoverage);
+    if (coverage && nCoverage != nSegments) {
+        Error("Must provide one \"coverage\" value per segment (%d, got "
+              "%d).", nSegments, nCoverage);
+        return {};
+    }
+    Float width = params.FindOneFloat("width", 1.f);
+    CurveType type = FindCurveType(params);
+    if (type == CurveType::Ribbon) {
+        Error("Ribbon curves aren't supported by the \"hairlod\" shape.");
+        return {};
+    }
+    int sd = params.FindOneInt("splitdepth",
+                               int(params.FindOneFloat("splitdepth", 3)));
+    Float maxPixelError = params.FindOneFloat("maxpixelerror", 1.f);
+    Float keep = Clamp(params.FindOneFloat("prunefraction", 1.f), 0, 1);
+    std::string selection = params.FindOneString("lodselection", "camera");
+    if (selection != "camera" && selection != "ray") {
+        Error("Unknown \"lodselection\" \"%s\" for \"hairlod\" shape. "
+              "Using \"camera\".", selection.c_str());
+        selection = "camera";
+    }
+    ++nHairLODShapes;
+
+    if (selection == "ray") {
+        if (!levelRadius && nLevels > 1)
+            Warning("\"hairlod\" shape with per-ray LOD selection needs "
+                    "\"levelradius\". Using the finest level.");
+        // Create the curves of all levels, each tagged with the footprint
+        // interval in which rays select it
+        int nUsedLevels = levelRadius ? nLevels : std::min(nLevels, 1);
+        std::vector<std::shared_ptr<Shape>> curves;
+        int seg = 0;
+        for (int level = 0; level < nUsedLevels; ++level) {
+            auto Radius = [&](int i) -> Float {
+                if (i < 0) return 0;
+                if (i >= nUsedLevels) return Infinity;
+                return levelRadius ? levelRadius[i] / maxPixelError : 0;
+            };
+            std::shared_ptr<CurveCommon> common = CreateSegmentsCommon(
+                type, levelSegments[level], &cp[4 * seg],
+                widths ? &widths[nSegmentWidths * seg] : nullptr,
+                nSegmentWidths, width);
+            for (int i = 0; i < 3; ++i)
+                common->lodRadius[i] = Radius(level - 1 + i);
+            if (coverage) common->SetCoverage(&coverage[seg]);
+            if (keep < 1) common = PruneStrands(*common, keep);
+            auto c = CreateCurves(o2w, w2o, reverseOrientation, common, sd);
+            curves.insert(curves.end(), c.begin(), c.end());
+            seg += levelSegments[level];
+        }
+        return curves;
+    }
+
+    // Choose the coarsest level whose merge radius stays below
+    // _maxPixelError_ pixels. The radius is scaled to pixels by the
+    // projected width of the finest level's bounds.
+    int level = 0;
+    if (camera && levelRadius && nLevels > 1 && levelSegments[0] > 0) {
+        Bounds3f bounds;
+        Float maxWidth = width;
+        for (int i = 0; i < 4 * levelSegments[0]; ++i)
+            bounds = Union(bounds, cp[i]);
+        if (widths)
+            for (int i = 0; i < nSegmentWidths * levelSegments[0]; ++i)
+                maxWidth = std::max(maxWidth, widths[i]);
+        bounds = Expand(bounds, maxWidth * 0.5f);
+        Float pixelWidth = ProjectedPixelWidth(*camera, (*o2w)(bounds));
+        Float pixelsPerUnit = pixelWidth / bounds.Diagonal().Length();
+        for (int i = nLevels - 1; i > 0; --i)
+            if (levelRadius[i] * pixelsPerUnit <= maxPixelError) {
+                level = i;
+                break;
             }
-            cpBase += degree;
-        } else {
-            // Uniform b-spline.
-            if (degree == 2) {
-                // First compute equivalent Bezier control points via some
-                // blossiming.  We have three control points and a uniform
-                // knot vector; we'll label the points p01, p12, and p23.
-                // We want the Bezier control points of the equivalent
-                // curve, which are p11, p12, and p22.
-                Point3f p01 = cpBase[0];
-                Point3f p12 = cpBase[1];
-                Point3f p23 = cpBase[2];
-
-                // We already have p12.
-                Point3f p11 = Lerp(0.5, p01, p12);
-                Point3f p22 = Lerp(0.5, p12, p23);
-
-                // Now elevate to degree 3.
-                segCpBezier[0] = p11;
-                segCpBezier[1] = Lerp(2.f/3.f, p11, p12);
-                segCpBezier[2] = Lerp(1.f/3.f, p12, p22);
-                segCpBezier[3] = p22;
-            } else {
-                // Otherwise we will blossom from p012, p123, p234, and p345
-                // to the Bezier control points p222, p223, p233, and p333.
-                // https://people.eecs.berkeley.edu/~sequin/CS284/IMGS/cubicbsplinepoints.gif
-                Point3f p012 = cpBase[0];
-                Point3f p123 = cpBase[1];
-                Point3f p234 = cpBase[2];
-                Point3f p345 = cpBase[3];
-
-                Point3f p122 = Lerp(2.f/3.f, p012, p123);
-                Point3f p223 = Lerp(1.f/3.f, p123, p234);
-                Point3f p233 = Lerp(2.f/3.f, p123, p234);
-                Point3f p334 = Lerp(1.f/3.f, p234, p345);
-
-                Point3f p222 = Lerp(0.5f, p122, p223);
-                Point3f p333 = Lerp(0.5f, p233, p334);
-
-                segCpBezier[0] = p222;
-                segCpBezier[1] = p223;
-                segCpBezier[2] = p233;
-                segCpBezier[3] = p333;
+        LOG(INFO) << StringPrintf("Hair LOD: projected width %f pixels, "
+                                  "using level %d of %d", pixelWidth, level,
+                                  nLevels);
+    } else if (!camera && nLevels > 1)
+        Warning("No camera available to select a \"hairlod\" level (inside "
+                "an object instance or with animated transformations?). "
+                "Using the finest level.");
+    ReportValue(hairLODLevel, level);
+
+    // Create curves for the selected level
+    int firstSegment = 0;
+    for (int i = 0; i < level; ++i) firstSegment += levelSegments[i];
+    std::shared_ptr<CurveCommon> common = CreateSegmentsCommon(
+        type, levelSegments[level], &cp[4 * firstSegment],
+        widths ? &widths[nSegmentWidths * firstSegment] : nullptr,
+        nSegmentWidths, width);
+    if (coverage) common->SetCoverage(&coverage[firstSegment]);
+    if (keep < 1) common = PruneStrands(*common, keep);
+    return CreateCurves(o2w, w2o, reverseOrientation, common, sd);
+}
+
+// Maps the binary hair file _filename_ (see shapes/hairfile.h) into memory
+// and returns a _CurveCommon_ that references its arrays directly.
+static std::shared_ptr<CurveCommon> LoadHairFile(const std::string &filename,
+                                                 CurveType type) {
+    std::shared_ptr<void> data;
+    size_t length;
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        Error("%s: %s", filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+    struct stat stat;
+    if (fstat(fd, &stat) != 0) {
+        Error("%s: %s", filename.c_str(), strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+    length = stat.st_size;
+    void *ptr = length > 0 ? mmap(0, length, PROT_READ, MAP_FILE | MAP_SHARED,
+                                  fd, 0)
+                           : MAP_FAILED;
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        Error("%s: unable to map hair file", filename.c_str());
+        return nullptr;
+    }
+    data = std::shared_ptr<void>(ptr, [length](void *p) { munmap(p, length); });
+#else
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in) {
+        Error("%s: unable to open hair file", filename.c_str());
+        return nullptr;
+    }
+    length = in.tellg();
+    char *buf = new char[length];
+    data = std::shared_ptr<void>(buf, [](void *p) { delete[] (char *)p; });
+    in.seekg(0);
+    if (!in.read(buf, length)) {
+        Error("%s: unable to read hair file", filename.c_str());
+        return nullptr;
+    }
+#endif
+
+    const char *bytes = (const char *)data.get();
+    HairFileHeader header;
+    if (length < sizeof(header)) {
+        Error("%s: truncated hair file", filename.c_str());
+        return nullptr;
+    }
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, HairFileMagic, sizeof(HairFileMagic)) != 0 ||
+        header.version < 1 || header.version > HairFileVersion) {
+        Error("%s: not a version 1-%d pbrt hair file", filename.c_str(),
+              int(HairFileVersion));
+        return nullptr;
+    }
+    if (header.version < 2) header.flags = 0;
+    if (header.nStrands > uint32_t(std::numeric_limits<int>::max()) ||
+        header.nControlPoints > uint32_t(std::numeric_limits<int>::max()) ||
+        HairFileSize(header) != length) {
+        Error("%s: hair file has the wrong size", filename.c_str());
+        return nullptr;
+    }
+
+    // Validate the strand offsets, which index the control point arrays
+    int nStrands = header.nStrands;
+    const int32_t *offsets =
+        (const int32_t *)(bytes + HairFileStrandOffsetsOffset(header));
+    if (offsets[0] != 0 || offsets[nStrands] != int(header.nControlPoints)) {
+        Error("%s: invalid strand offsets in hair file", filename.c_str());
+        return nullptr;
+    }
+    for (int i = 0; i < nStrands; ++i) {
+        int64_t nCPs = int64_t(offsets[i + 1]) - offsets[i];
+        if (nCPs < 4 || (nCPs - 1) % 3 != 0) {
+            Error("%s: strand %d has %d control points", filename.c_str(), i,
+                  int(nCPs));
+            return nullptr;
+        }
+    }
+
+    const float *P = (const float *)(bytes + HairFilePOffset(header));
+    const float *widths = (const float *)(bytes + HairFileWidthsOffset(header));
+    const float *coverage =
+        (header.flags & HairFileHasCoverage)
+            ? (const float *)(bytes + HairFileCoverageOffset(header))
+            : nullptr;
+    mappedHairBytes += length;
+#ifdef PBRT_FLOAT_AS_DOUBLE
+    // The file's floats can't be referenced directly; convert them.
+    std::vector<int> strandSegments(nStrands);
+    for (int i = 0; i < nStrands; ++i)
+        strandSegments[i] = (offsets[i + 1] - offsets[i] - 1) / 3;
+    std::vector<Point3f> cp(header.nControlPoints);
+    std::vector<Float> cpWidths(widths, widths + header.nControlPoints);
+    for (size_t i = 0; i < cp.size(); ++i)
+        cp[i] = Point3f(P[3 * i], P[3 * i + 1], P[3 * i + 2]);
+    std::shared_ptr<CurveCommon> common = std::make_shared<CurveCommon>(
+        type, nStrands, strandSegments.data(), cp.data(), cpWidths.data(),
+        Float(1));
+    if (coverage) {
+        std::vector<Float> c(coverage, coverage + nStrands);
+        common->SetCoverage(c.data());
+    }
+    return common;
+#else
+    static_assert(sizeof(Point3f) == 3 * sizeof(float),
+                  "Point3f must match the hair file layout");
+    static_assert(sizeof(int) == sizeof(int32_t),
+                  "int must match the hair file layout");
+    std::shared_ptr<CurveCommon> common = std::make_shared<CurveCommon>(
+        type, nStrands, offsets, (const Point3f *)P, widths, std::move(data));
+    common->coverage = coverage;
+    return common;
+#endif
+}
+
+std::vector<std::shared_ptr<Shape>> CreateHairMeshShape(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params) {
+    CurveType type = FindCurveType(params);
+    if (type == CurveType::Ribbon) {
+        Error("Ribbon curves aren't supported by the \"hairmesh\" shape.");
+        return {};
+    }
+    // Hair segments are short, so they aren't split by default.
+    int sd = params.FindOneInt("splitdepth",
+                               int(params.FindOneFloat("splitdepth", 0)));
+
+    bool quantize = params.FindOneBool("quantize", false);
+    Float keep = Clamp(params.FindOneFloat("prunefraction", 1.f), 0, 1);
+
+    std::string filename = params.FindOneFilename("filename", "");
+    if (!filename.empty()) {
+        std::shared_ptr<CurveCommon> common = LoadHairFile(filename, type);
+        if (!common) return {};
+        if (keep < 1) common = PruneStrands(*common, keep);
+        if (quantize) common->Quantize();
+        return CreateCurves(o2w, w2o, reverseOrientation, common, sd);
+    }
+
+    int ncp, nStrands;
+    const Point3f *cp = params.FindPoint3f("P", &ncp);
+    const int *strandSegments = params.FindInt("strandsegments", &nStrands);
+    if (!cp || !strandSegments) {
+        Error("\"hairmesh\" shape requires \"filename\" or \"P\" and "
+              "\"strandsegments\".");
+        return {};
+    }
+    int nExpected = 0;
+    for (int i = 0; i < nStrands; ++i) {
+        if (strandSegments[i] < 1) {
+            Error("Strand %d of \"hairmesh\" shape has %d segments.", i,
+                  strandSegments[i]);
+            return {};
+        }
+        nExpected += 3 * strandSegments[i] + 1;
+    }
+    if (ncp != nExpected) {
+        Error("Invalid number of control points %d for \"hairmesh\" shape: "
+              "%d strands need %d.", ncp, nStrands, nExpected);
+        return {};
+    }
+    int nWidths;
+    const Float *widths = params.FindFloat("widths", &nWidths);
+    if (widths && nWidths != ncp) {
+        Error("Must provide one \"widths\" value per control point (%d, "
+              "got %d).", ncp, nWidths);
+        return {};
+    }
+    Float width = params.FindOneFloat("width", 1.f);
+    int nCoverage;
+    const Float *coverage = params.FindFloat("coverage", &nCoverage);
+    if (coverage && nCoverage != nStrands) {
+        Error("Must provide one \"coverage\" value per strand (%d, got %d).",
+              nStrands, nCoverage);
+        return {};
+    }
+
+    std::shared_ptr<CurveCommon> common = std::make_shared<CurveCommon>(
+        type, nStrands, strandSegments, cp, widths, width);
+    if (coverage) common->SetCoverage(coverage);
+    if (keep < 1) common = PruneStrands(*common, keep);
+    if (quantize) common->Quantize();
+    return CreateCurves(o2w, w2o, reverseOrientation, common, sd);
+}
+
+// ChildHairCache Declarations
+// Bounded LRU cache of the generated geometry of the clusters of a
+// "childhair" shape.  Geometry is generated outside of the lock and is
+// reference counted, so evicting a cluster doesn't invalidate it for
+// threads that are still intersecting it.
+class ChildHairCache {
+  public:
+    // ChildHairCache Public Methods
+    ChildHairCache(int64_t maxSegments) : maxSegments(maxSegments) {}
+    std::shared_ptr<Primitive> Lookup(int cluster) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++nChildHairLookups;
+        auto iter = entries.find(cluster);
+        if (iter == entries.end()) return nullptr;
+        ++nChildHairHits;
+        lru.splice(lru.begin(), lru, iter->second.lruPos);
+        return iter->second.geometry;
+    }
+    std::shared_ptr<Primitive> Insert(int cluster,
+                                      std::shared_ptr<Primitive> geometry,
+                                      int64_t nSegments) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Use the geometry of another thread that generated it first
+        auto iter = entries.find(cluster);
+        if (iter != entries.end()) return iter->second.geometry;
+        lru.push_front(cluster);
+        entries[cluster] = {geometry, nSegments, lru.begin()};
+        residentSegments += nSegments;
+
+        // Evict least recently used clusters until the cache fits
+        while (residentSegments > maxSegments && lru.size() > 1) {
+            auto evict = entries.find(lru.back());
+            residentSegments -= evict->second.nSegments;
+            entries.erase(evict);
+            lru.pop_back();
+        }
+        return geometry;
+    }
+
+  private:
+    // ChildHairCache Private Data
+    struct Entry {
+        std::shared_ptr<Primitive> geometry;
+        int64_t nSegments;
+        std::list<int>::iterator lruPos;
+    };
+    const int64_t maxSegments;
+    std::mutex mutex;
+    std::list<int> lru;
+    std::unordered_map<int, Entry> entries;
+    int64_t residentSegments = 0;
+};
+
+// ChildHairGroom Declarations
+// Guide strands of a "childhair" shape, which all have _nSegments_ cubic
+// Bezier segments, and the guides and weights each child interpolates.
+struct ChildHairGroom {
+    ChildHairGroom(CurveType type, int nSegments, int clusterSize,
+                   int64_t maxCachedSegments)
+        : type(type),
+          nSegments(nSegments),
+          clusterSize(clusterSize),
+          cache(maxCachedSegments) {}
+    int NumChildren() const { return childGuides.size() / 3; }
+    void ChildCp(int child, Point3f *cp, Float *w) const {
+        const int nCps = 3 * nSegments + 1;
+        for (int i = 0; i < nCps; ++i) {
+            cp[i] = Point3f(0, 0, 0);
+            w[i] = 0;
+        }
+        for (int k = 0; k < 3; ++k) {
+            int guide = childGuides[3 * child + k];
+            Float weight = childWeights[3 * child + k];
+            for (int i = 0; i < nCps; ++i) {
+                cp[i] += weight * guideCp[guide * nCps + i];
+                w[i] += weight * guideWidth[guide * nCps + i];
             }
-            ++cpBase;
         }
+    }
+
+    const CurveType type;
+    const int nSegments, clusterSize;
+    std::vector<Point3f> guideCp;
+    std::vector<Float> guideWidth;
+    std::vector<int> childGuides;
+    std::vector<Float> childWeights;
+    ChildHairCache cache;
+};
+
+// ChildHairCluster Declarations
+// A group of consecutive child strands of a "childhair" shape.  Its
+// curves and their BVH are generated when the first ray reaches its
+// bounds.
+class ChildHairCluster : public Shape {
+  public:
+    // ChildHairCluster Public Methods
+    ChildHairCluster(const Transform *ObjectToWorld,
+                     const Transform *WorldToObject, bool reverseOrientation,
+                     const std::shared_ptr<ChildHairGroom> &groom, int cluster,
+                     const Bounds3f &bounds, Float area)
+        : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+          groom(groom),
+          cluster(cluster),
+          bounds(bounds),
+          area(area) {}
+    Bounds3f ObjectBound() const { return bounds; }
+    bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                   bool testAlphaTexture) const {
+        Ray r = ray;
+        if (!Geometry()->Intersect(r, isect)) return false;
+        *tHit = r.tMax;
+        // Don't refer to generated curves, which may be evicted
+        isect->shape = this;
+        return true;
+    }
+    bool IntersectP(const Ray &ray, bool testAlphaTexture) const {
+        return Geometry()->IntersectP(ray);
+    }
+    Float Area() const { return area; }
+    Interaction Sample(const Point2f &u, Float *pdf) const {
+        LOG(FATAL) << "ChildHairCluster::Sample not implemented.";
+        return Interaction();
+    }
 
-        auto c = CreateCurve(o2w, w2o, reverseOrientation, segCpBezier,
-                             Lerp(Float(seg) / Float(nSegments), width0, width1),
-                             Lerp(Float(seg + 1) / Float(nSegments), width0, width1),
-                             type, n ? &n[seg] : nullptr, sd);
-        curves.insert(curves.end(), c.begin(), c.end());
+  private:
+    // ChildHairCluster Private Methods
+    std::shared_ptr<Primitive> Geometry() const;
+
+    // ChildHairCluster Private Data
+    const std::shared_ptr<ChildHairGroom> groom;
+    const int cluster;
+    const Bounds3f bounds;
+    const Float area;
+};
+
+// ChildHairCluster Method Definitions
+std::shared_ptr<Primitive> ChildHairCluster::Geometry() const {
+    std::shared_ptr<Primitive> geometry = groom->cache.Lookup(cluster);
+    if (geometry) return geometry;
+
+    // Interpolate the control points of the cluster's children
+    int child0 = cluster * groom->clusterSize;
+    int nChildren =
+        std::min(groom->clusterSize, groom->NumChildren() - child0);
+    int nCps = 3 * groom->nSegments + 1;
+    std::vector<Point3f> cp(nChildren * nCps);
+    std::vector<Float> width(nChildren * nCps);
+    for (int i = 0; i < nChildren; ++i)
+        groom->ChildCp(child0 + i, &cp[i * nCps], &width[i * nCps]);
+
+    // Create the cluster's curves and their BVH
+    std::vector<int> strandSegments(nChildren, groom->nSegments);
+    std::shared_ptr<CurveCommon> common = std::make_shared<CurveCommon>(
+        groom->type, nChildren, strandSegments.data(), cp.data(),
+        width.data(), 1.f, true);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const std::shared_ptr<Shape> &curve :
+         CreateCurves(ObjectToWorld, WorldToObject, reverseOrientation,
+                      common, 0))
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            curve, nullptr, nullptr, MediumInterface()));
+    // Clusters are (re)built while rendering, so their BVHs aren't logged
+    std::shared_ptr<BVHAccel> bvh = std::make_shared<BVHAccel>(
+        std::move(prims), 4, BVHAccel::SplitMethod::SAH, false, 2, .5f, false,
+        BVHAccel::Layout::DepthFirst, "", 1 << 17, true);
+    return groom->cache.Insert(cluster, std::move(bvh),
+                               nChildren * groom->nSegments);
+}
+
+std::vector<std::shared_ptr<Shape>> CreateChildHairShape(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params) {
+    CurveType type = FindCurveType(params);
+    if (type == CurveType::Ribbon) {
+        Error("Ribbon curves aren't supported by the \"childhair\" shape.");
+        return {};
     }
-    return curves;
+    int ncp, nChildGuides, nChildWeights;
+    const Point3f *cp = params.FindPoint3f("P", &ncp);
+    int nSegments = params.FindOneInt("guidesegments", 0);
+    const int *childGuides = params.FindInt("childguides", &nChildGuides);
+    const Float *childWeights =
+        params.FindFloat("childweights", &nChildWeights);
+    if (!cp || nSegments < 1 || !childGuides || !childWeights) {
+        Error("\"childhair\" shape requires \"P\", \"guidesegments\", "
+              "\"childguides\" and \"childweights\".");
+        return {};
+    }
+    int nGuideCps = 3 * nSegments + 1;
+    if (ncp % nGuideCps != 0) {
+        Error("Invalid number of control points %d for \"childhair\" shape "
+              "with %d segments per guide.", ncp, nSegments);
+        return {};
+    }
+    int nGuides = ncp / nGuideCps;
+    if (nChildGuides % 3 != 0 || nChildWeights != nChildGuides) {
+        Error("Must provide three \"childguides\" and \"childweights\" "
+              "values per child for \"childhair\" shape.");
+        return {};
+    }
+    int nWidths;
+    const Float *widths = params.FindFloat("widths", &nWidths);
+    if (widths && nWidths != ncp) {
+        Error("Must provide one \"widths\" value per control point (%d, "
+              "got %d).", ncp, nWidths);
+        return {};
+    }
+    Float width = params.FindOneFloat("width", 1.f);
+    int clusterSize = std::max(1, params.FindOneInt("clustersize", 16));
+    int64_t maxCachedSegments = params.FindOneInt("cachesegments", 1 << 18);
+
+    std::shared_ptr<ChildHairGroom> groom = std::make_shared<ChildHairGroom>(
+        type, nSegments, clusterSize, maxCachedSegments);
+    groom->guideCp.assign(cp, cp + ncp);
+    if (widths)
+        groom->guideWidth.assign(widths, widths + ncp);
+    else
+        groom->guideWidth.assign(ncp, width);
+    groom->childGuides.assign(childGuides, childGuides + nChildGuides);
+    groom->childWeights.assign(childWeights, childWeights + nChildWeights);
+    for (int child = 0; child < groom->NumChildren(); ++child) {
+        // Validate guides and normalize weights of _child_
+        int *guides = &groom->childGuides[3 * child];
+        Float *weights = &groom->childWeights[3 * child];
+        Float sum = 0;
+        for (int k = 0; k < 3; ++k) {
+            if (guides[k] < 0 || guides[k] >= nGuides || weights[k] < 0) {
+                Error("Invalid guide %d or weight %f for child %d of "
+                      "\"childhair\" shape.", guides[k], weights[k], child);
+                return {};
+            }
+            sum += weights[k];
+        }
+        if (sum == 0) {
+            Error("Weights of child %d of \"childhair\" shape sum to zero.",
+                  child);
+            return {};
+        }
+        for (int k = 0; k < 3; ++k) weights[k] /= sum;
+    }
+    childHairBytes += sizeof(ChildHairGroom) +
+                      ncp * (sizeof(Point3f) + sizeof(Float)) +
+                      nChildGuides * (sizeof(int) + sizeof(Float));
+
+    // Create a shape for each cluster with the bounds of its children
+    std::vector<std::shared_ptr<Shape>> shapes;
+    std::vector<Point3f> childCp(nGuideCps);
+    std::vector<Float> childWidth(nGuideCps);
+    int nChildren = groom->NumChildren();
+    for (int cluster = 0; cluster * clusterSize < nChildren; ++cluster) {
+        Bounds3f bounds;
+        Float area = 0;
+        for (int child = cluster * clusterSize;
+             child < std::min(nChildren, (cluster + 1) * clusterSize);
+             ++child) {
+            groom->ChildCp(child, childCp.data(), childWidth.data());
+            for (int i = 0; i < nGuideCps; ++i) {
+                Float r = childWidth[i] * 0.5f;
+                bounds = Union(bounds, Bounds3f(childCp[i] - Vector3f(r, r, r),
+                                                childCp[i] + Vector3f(r, r, r)));
+                if (i > 0)
+                    area += Distance(childCp[i - 1], childCp[i]) *
+                            (childWidth[i - 1] + childWidth[i]) * 0.5f;
+            }
+        }
+        shapes.push_back(std::make_shared<ChildHairCluster>(
+            o2w, w2o, reverseOrientation, groom, cluster, bounds, area));
+    }
+    childHairBytes += shapes.size() * sizeof(ChildHairCluster);
+    return shapes;
 }
 
 }  // namespace pbrt
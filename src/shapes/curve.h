@@ -40,6 +40,7 @@
 
 // shapes/curve.h*
 #include "shape.h"
+#include <atomic>
 
 namespace pbrt {
 struct CurveCommon;
@@ -49,15 +50,101 @@ enum class CurveType { Flat, Cylinder, Ribbon };
 
 // CurveCommon Declarations
 struct CurveCommon {
-    CurveCommon(const Point3f c[4], Float w0, Float w1, CurveType type,
+    CurveCommon(const Point3f c[4], const Float w[4], CurveType type,
                 const Normal3f *norm);
-    const CurveType type;	
-    Point3f cpObj[4];
-    Float width[2];
+    CurveCommon(CurveType type, int nStrands, const int *strandSegments,
+                const Point3f *P, const Float *widths, Float width,
+                bool generated = false);
+    CurveCommon(CurveType type, int nStrands, const int *strandOffsets,
+                const Point3f *P, const Float *widths,
+                std::shared_ptr<void> mapping);
+    const CurveType type;
+    // Cubic Bezier control points of all strands; consecutive segments of
+    // a strand share their end points, so a strand with _n_ segments has
+    // 3n+1 control points starting at _strandOffsets[strand]_.  The width
+    // is given per control point and interpolated with the same basis.
+    int nStrands, nSegments;
+    const int *strandOffsets;
+    const Point3f *cpObj;
+    const Float *width;
+    // The arrays above either point into these or into a memory-mapped
+    // hair file that is kept alive by _mapping_.
+    std::unique_ptr<int[]> offsetStorage;
+    std::unique_ptr<Point3f[]> cpStorage;
+    std::unique_ptr<Float[]> widthStorage;
+    std::shared_ptr<void> mapping;
+    // After _Quantize()_, the control points and widths are stored with 16
+    // bits per component relative to the bounds and maximum width of their
+    // strand, and _cpObj_ and _width_ are null.
+    struct QuantizedCp {
+        uint16_t p[3], w;
+    };
+    struct StrandFrame {
+        Point3f origin;
+        Vector3f scale;
+        Float widthScale;
+    };
+    std::unique_ptr<QuantizedCp[]> quantizedCp;
+    std::unique_ptr<StrandFrame[]> strandFrames;
+    // Ribbon normals; only supported for single segment curves.
     Normal3f n[2];
     Float normalAngle, invSinNormalAngle;
+    // Object-space footprint interval of the LOD level the curve belongs
+    // to, given by the previous, own and next level's merge radius; see
+    // _Curve::Intersect()_.  Curves outside a LOD pyramid use {0, 0,
+    // Infinity} and are hit by all rays.
+    Float lodRadius[3];
+    // Sequence number in creation order, which identifies the strands of
+    // the common reproducibly; see _Curve::StrandPosition()_.
+    const uint64_t id = nextId++;
+    static std::atomic<uint64_t> nextId;
+    // Set for curves generated during rendering, such as the children of a
+    // "childhair" shape, which aren't counted in the scene statistics.
+    bool generated = false;
+    // For strands of a single segment that continue each other, as in the
+    // "curve" and "hairlod" shapes, the first strand of the chain each one
+    // belongs to; null if all strands stand alone.
+    std::unique_ptr<int[]> chainStart;
+    // Optional per strand fraction of its width that is covered, for
+    // strands merged from several others by LOD; shadow rays pass through
+    // the rest stochastically.  Null if all strands are opaque.
+    const Float *coverage = nullptr;
+    std::unique_ptr<Float[]> coverageStorage;
 
 	int primId;
+
+    void Quantize();
+    void SetCoverage(const Float *c);
+    int ChainStart(int strand) const {
+        return chainStart ? chainStart[strand] : strand;
+    }
+    // Returns the first control point of the chain _strand_ belongs to.
+    Point3f StrandRoot(int strand) const {
+        int s = ChainStart(strand);
+        Point3f cp[4];
+        SegmentCp(s, strandOffsets[s], cp);
+        return cp[0];
+    }
+    void SegmentCp(int strand, int cpOffset, Point3f cp[4]) const {
+        if (!quantizedCp) {
+            for (int i = 0; i < 4; ++i) cp[i] = cpObj[cpOffset + i];
+            return;
+        }
+        const StrandFrame &f = strandFrames[strand];
+        for (int i = 0; i < 4; ++i) {
+            const uint16_t *q = quantizedCp[cpOffset + i].p;
+            cp[i] = f.origin + Vector3f(q[0] * f.scale.x, q[1] * f.scale.y,
+                                        q[2] * f.scale.z);
+        }
+    }
+    void SegmentWidth(int strand, int cpOffset, Float w[4]) const {
+        if (!quantizedCp) {
+            for (int i = 0; i < 4; ++i) w[i] = width[cpOffset + i];
+            return;
+        }
+        for (int i = 0; i < 4; ++i)
+            w[i] = quantizedCp[cpOffset + i].w * strandFrames[strand].widthScale;
+    }
 };
 
 // Curve Declarations
@@ -66,12 +153,18 @@ class Curve : public Shape {
     // Curve Public Methods
     Curve(const Transform *ObjectToWorld, const Transform *WorldToObject,
           bool reverseOrientation, const std::shared_ptr<CurveCommon> &common,
-          Float uMin, Float uMax)
+          int cpOffset, Float uMin, Float uMax, int strand = 0)
         : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
           common(common),
+          cpOffset(cpOffset),
+          strand(strand),
           uMin(uMin),
           uMax(uMax) {}
     Bounds3f ObjectBound() const;
+    Bounds3f FrameBound(const Transform &WorldToFrame) const;
+    Vector3f PrincipalAxis() const;
+    bool StrandPosition(uint64_t *strandId, Float *position) const;
+    Bounds3f ClippedWorldBound(const Bounds3f &clip) const;
     bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    bool testAlphaTexture) const;
     Float Area() const;
@@ -84,17 +177,70 @@ class Curve : public Shape {
     bool recursiveIntersect(const Ray &r, Float *tHit,
                             SurfaceInteraction *isect, const Point3f cp[4],
                             const Transform &rayToObject, Float u0, Float u1,
-                            int depth) const;
+                            int depth, Float lodU) const;
+    // Only defined if _Float4_ is available; see core/simd.h.
+    bool intersectSpans(const Ray &r, Float *tHit, SurfaceInteraction *isect,
+                        const Point3f cp[4], const Transform &rayToObject,
+                        Float u0, Float u1, int depth, Float lodU) const;
+    void segmentCp(Point3f cp[4]) const {
+        common->SegmentCp(strand, cpOffset, cp);
+    }
+    void segmentWidth(Float w[4]) const {
+        common->SegmentWidth(strand, cpOffset, w);
+    }
+    Float widthAt(Float u) const;
+    Float widthBound(Float u0, Float u1) const;
 
     // Curve Private Data
     const std::shared_ptr<CurveCommon> common;
+    const int cpOffset, strand;
     const Float uMin, uMax;
 };
 
+// Creates the curves of a "curve" shape. With "prunefraction" below one,
+// only that fraction of "curve" shapes is kept, selected by a hash of their
+// first control point, and the kept ones are widened by its inverse.  With
+// "prunepixelwidth" and a _camera_, curves that project to fewer pixels
+// are additionally kept with a probability proportional to their projected
+// width, but at least "pruneminfraction".  Strands written as one "curve"
+// per segment pass the same "strandroot" (and "strandwidth") to each, which
+// are then used instead of the curve's own to decide.
 std::vector<std::shared_ptr<Shape>> CreateCurveShape(const Transform *o2w,
                                                      const Transform *w2o,
                                                      bool reverseOrientation,
-                                                     const ParamSet &params);
+                                                     const ParamSet &params,
+                                                     const Camera *camera =
+                                                         nullptr);
+
+// Creates the curves of a "hairlod" shape, which stores several precomputed
+// LOD levels of a groom. With "lodselection" "camera" the coarsest level
+// whose merge radius projects to at most "maxpixelerror" pixels in _camera_
+// is used; without a camera the finest level is used. With "lodselection"
+// "ray" all levels are created and each ray stochastically picks a level
+// from its footprint at the hit.  "prunefraction" prunes whole strands
+// like for "hairmesh" shapes.
+std::vector<std::shared_ptr<Shape>> CreateHairLODShape(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params, const Camera *camera);
+
+// Creates the curves of a "hairmesh" shape, which stores whole strands of
+// cubic Bezier segments in a single _CurveCommon_.  With "quantize" set,
+// the control points are stored with 16 bits per coordinate; see
+// _CurveCommon::Quantize()_.  With "prunefraction" below one, only that
+// fraction of the strands is kept, selected by a hash of their root point,
+// and the kept ones are widened by its inverse.
+std::vector<std::shared_ptr<Shape>> CreateHairMeshShape(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params);
+
+// Creates the shapes of a "childhair" shape, which stores guide strands and
+// for each child strand three guides and weights to interpolate them with.
+// Children are grouped into clusters of "clustersize" strands whose curves
+// are generated on the first ray that reaches the cluster and kept in a
+// LRU cache of at most "cachesegments" segments.
+std::vector<std::shared_ptr<Shape>> CreateChildHairShape(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params);
 
 }  // namespace pbrt
 
@@ -0,0 +1,102 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_SHAPES_HAIRFILE_H
+#define PBRT_SHAPES_HAIRFILE_H
+
+// shapes/hairfile.h*
+// Binary hair files hold the data of a "hairmesh" shape so that it can be
+// memory-mapped instead of parsed.  This header has no other pbrt
+// dependencies so that tools like cyhair2pbrt can write the format.
+//
+// All values are stored in native (little-endian) byte order:
+//
+//   HairFileHeader
+//   float P[3 * nControlPoints]       cubic Bezier control points
+//   float widths[nControlPoints]      per control point width
+//   int32 strandOffsets[nStrands + 1] first control point of each strand
+//   float coverage[nStrands]          if flags has HairFileHasCoverage
+//
+// Consecutive segments of a strand share their end points, so strand _i_
+// has (strandOffsets[i + 1] - strandOffsets[i] - 1) / 3 segments.
+#include <cstddef>
+#include <cstdint>
+
+namespace pbrt {
+
+// HairFile Declarations
+static const char HairFileMagic[8] = {'p', 'b', 'r', 't', 'h', 'a', 'i', 'r'};
+// Version 2 added _flags_, which is zero in version 1 files.
+static const uint32_t HairFileVersion = 2;
+// Flag for files that store the coverage of each strand (see the
+// "coverage" parameter of "hairmesh" shapes).
+static const uint32_t HairFileHasCoverage = 1;
+
+struct HairFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nStrands;
+    uint32_t nControlPoints;
+    uint32_t flags;
+    uint32_t pad[2];
+};
+static_assert(sizeof(HairFileHeader) == 32, "Unexpected HairFileHeader size");
+
+// Byte offsets of the arrays following the header and the total file size.
+inline size_t HairFilePOffset(const HairFileHeader &) {
+    return sizeof(HairFileHeader);
+}
+inline size_t HairFileWidthsOffset(const HairFileHeader &h) {
+    return HairFilePOffset(h) + 3 * sizeof(float) * size_t(h.nControlPoints);
+}
+inline size_t HairFileStrandOffsetsOffset(const HairFileHeader &h) {
+    return HairFileWidthsOffset(h) + sizeof(float) * size_t(h.nControlPoints);
+}
+inline size_t HairFileCoverageOffset(const HairFileHeader &h) {
+    return HairFileStrandOffsetsOffset(h) +
+           sizeof(int32_t) * (size_t(h.nStrands) + 1);
+}
+inline size_t HairFileSize(const HairFileHeader &h) {
+    return HairFileCoverageOffset(h) +
+           ((h.flags & HairFileHasCoverage)
+                ? sizeof(float) * size_t(h.nStrands)
+                : 0);
+}
+
+}  // namespace pbrt
+
+#endif  // PBRT_SHAPES_HAIRFILE_H
@@ -185,6 +185,43 @@ Bounds3f Triangle::WorldBound() const {
     return Union(Bounds3f(p0, p1), p2);
 }
 
+Bounds3f Triangle::ClippedWorldBound(const Bounds3f &clip) const {
+    // Clip the triangle against the planes of _clip_ one at a time,
+    // keeping the vertices of the remaining convex polygon in _poly_
+    Point3f poly[9], clipped[9];
+    int nVertices = 3;
+    for (int i = 0; i < 3; ++i) poly[i] = mesh->p[v[i]];
+    for (int axis = 0; axis < 3; ++axis)
+        for (int side = 0; side < 2; ++side) {
+            Float plane = clip[side][axis];
+            auto inside = [&](const Point3f &p) {
+                return side == 0 ? p[axis] >= plane : p[axis] <= plane;
+            };
+            int nClipped = 0;
+            for (int i = 0; i < nVertices; ++i) {
+                const Point3f &a = poly[i], &b = poly[(i + 1) % nVertices];
+                if (inside(a)) clipped[nClipped++] = a;
+                if (inside(a) != inside(b)) {
+                    // Add the point where edge _ab_ crosses the plane
+                    Point3f p = Lerp((plane - a[axis]) / (b[axis] - a[axis]),
+                                     a, b);
+                    p[axis] = plane;
+                    clipped[nClipped++] = p;
+                }
+            }
+            if (nClipped == 0) return Bounds3f();
+            nVertices = nClipped;
+            std::copy(clipped, clipped + nClipped, poly);
+        }
+
+    // Bound the polygon, allowing for rounding error in the points where
+    // edges were clipped
+    Bounds3f b;
+    for (int i = 0; i < nVertices; ++i) b = Union(b, poly[i]);
+    Vector3f err = gamma(3) * Max(Abs(Vector3f(b.pMin)), Abs(Vector3f(b.pMax)));
+    return pbrt::Intersect(Bounds3f(b.pMin - err, b.pMax + err), clip);
+}
+
 bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                          bool testAlphaTexture) const {
     ProfilePhase p(Prof::TriIntersect);
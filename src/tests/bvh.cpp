@@ -0,0 +1,292 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "accelerators/bvh.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "primitive.h"
+#include "rng.h"
+#include "shapes/curve.h"
+#include "tests/testutil.h"
+
+using namespace pbrt;
+
+// Returns primitives for a "hairmesh" whose strands have _nSegments_
+// segments each and the control points _P_.
+static std::vector<std::shared_ptr<Primitive>> HairPrimitives(
+    const std::vector<Point3f> &P, int nSegments, Float width) {
+    int nStrands = P.size() / (3 * nSegments + 1);
+    ParamSet params;
+    std::unique_ptr<Point3f[]> p(new Point3f[P.size()]);
+    std::copy(P.begin(), P.end(), p.get());
+    params.AddPoint3f("P", std::move(p), P.size());
+    std::unique_ptr<int[]> segs(new int[nStrands]);
+    for (int i = 0; i < nStrands; ++i) segs[i] = nSegments;
+    params.AddInt("strandsegments", std::move(segs), nStrands);
+    params.AddFloat("width", std::unique_ptr<Float[]>(new Float[1]{width}),
+                    1);
+    static Transform identity;
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &shape :
+         CreateHairMeshShape(&identity, &identity, false, params))
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            shape, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+// Returns the control points of _nStrands_ randomly oriented, straight
+// single-segment strands of up to _length_ in the unit cube.
+static std::vector<Point3f> RandomStrands(RNG &rng, int nStrands,
+                                          Float length) {
+    std::vector<Point3f> P;
+    for (int i = 0; i < nStrands; ++i) {
+        Point3f p0(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+        Vector3f d(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                   rng.UniformFloat() - .5f);
+        for (int j = 0; j < 4; ++j) P.push_back(p0 + length * j / 3.f * d);
+    }
+    return P;
+}
+
+// Traces _nRays_ random rays from the plane where coordinate _axis_ is -1
+// towards the unit cube against _expected_ and _aggregate_, expects the
+// same intersections and returns how many rays hit.
+static int CompareIntersections(const Primitive &expected,
+                                const Primitive &aggregate, RNG &rng,
+                                int nRays, int axis = 2) {
+    EXPECT_EQ(expected.WorldBound(), aggregate.WorldBound());
+    int nHits = 0;
+    for (int i = 0; i < nRays; ++i) {
+        Point3f o(2 * rng.UniformFloat() - .5f, 2 * rng.UniformFloat() - .5f,
+                  2 * rng.UniformFloat() - .5f);
+        o[axis] = -1;
+        Point3f target(rng.UniformFloat(), rng.UniformFloat(),
+                       rng.UniformFloat());
+        Ray ray(o, target - o);
+        SurfaceInteraction isectExpected, isect;
+        Ray rayExpected = ray, rayAggregate = ray;
+        bool hit = expected.Intersect(rayExpected, &isectExpected);
+        EXPECT_EQ(hit, expected.IntersectP(ray)) << i;
+        EXPECT_EQ(hit, aggregate.IntersectP(ray)) << i;
+        if (hit != aggregate.Intersect(rayAggregate, &isect)) {
+            ADD_FAILURE() << "ray " << i << " hit only one aggregate";
+            continue;
+        }
+        if (hit) {
+            EXPECT_EQ(rayExpected.tMax, rayAggregate.tMax) << i;
+            EXPECT_EQ(isectExpected.p, isect.p) << i;
+            ++nHits;
+        }
+    }
+    return nHits;
+}
+
+TEST(BVH, OrientedBounds) {
+    // Many thin diagonal strands, which have loose axis-aligned bounds.
+    RNG rng;
+    std::vector<Point3f> P;
+    for (int i = 0; i < 2000; ++i) {
+        Point3f p0(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+        Vector3f d(.2f + .05f * rng.UniformFloat(), .2f, .2f);
+        for (int j = 0; j < 4; ++j) P.push_back(p0 + j / 3.f * d);
+    }
+    std::vector<std::shared_ptr<Primitive>> prims =
+        HairPrimitives(P, 1, .005f);
+
+    // Oriented bounds must not change which curves rays hit.
+    BVHAccel aabb(prims, 4), obb(prims, 4, BVHAccel::SplitMethod::SAH, true);
+    EXPECT_GT(CompareIntersections(aabb, obb, rng, 5000), 50);
+}
+
+// Returns the number of pairs of consecutive pieces of one strand that
+// are adjacent in a leaf of _bvh_.
+static int CountStrandRuns(const BVHAccel &bvh) {
+    int nRuns = 0;
+    const auto &prim = bvh.LeafPrimitives();
+    for (int i = 0; i < bvh.NumNodes(); ++i) {
+        int offset, nPrimitives;
+        bvh.Node(i, &offset, &nPrimitives);
+        for (int j = offset + 1; j < offset + nPrimitives; ++j) {
+            uint64_t strand0, strand1;
+            Float position0, position1;
+            if (prim[j - 1]->StrandPosition(&strand0, &position0) &&
+                prim[j]->StrandPosition(&strand1, &position1) &&
+                strand0 == strand1 && position1 == position0 + 1)
+                ++nRuns;
+        }
+    }
+    return nRuns;
+}
+
+TEST(BVH, StrandLeaves) {
+    // Straight strands of several segments each along z, whose
+    // consecutive pieces share one tight oriented leaf bound.
+    RNG rng;
+    const int nStrands = 500, nSegments = 6, nCp = 3 * nSegments + 1;
+    std::vector<Point3f> P;
+    for (int i = 0; i < nStrands; ++i) {
+        Point3f root(rng.UniformFloat(), rng.UniformFloat(), 0);
+        for (int j = 0; j < nCp; ++j)
+            P.push_back(root + Vector3f(0, 0, Float(j) / (nCp - 1)));
+    }
+    std::vector<std::shared_ptr<Primitive>> prims =
+        HairPrimitives(P, nSegments, .005f);
+
+    // All pieces of a strand report the same strand and increasing
+    // positions.
+    uint64_t strand0, strand1;
+    Float position0, position1;
+    ASSERT_TRUE(prims[0]->StrandPosition(&strand0, &position0));
+    ASSERT_TRUE(prims[1]->StrandPosition(&strand1, &position1));
+    EXPECT_EQ(strand0, strand1);
+    EXPECT_LT(position0, position1);
+    ASSERT_TRUE(prims.back()->StrandPosition(&strand1, &position1));
+    EXPECT_NE(strand0, strand1);
+
+    // Grouping strands into leaves must not change which curves rays hit.
+    BVHAccel sah(prims, 4),
+        strands(prims, 4, BVHAccel::SplitMethod::Strands);
+    EXPECT_GT(CompareIntersections(sah, strands, rng, 5000, 1), 50);
+
+    // Leaves hold runs of consecutive pieces of each strand; with
+    // _maxPrimsInNode_ 4, each strand of 6 pieces gives 4 adjacent pairs.
+    EXPECT_GT(CountStrandRuns(strands), 3 * nStrands);
+
+    // Gently waving strands, as in real hair, still form runs.
+    P.clear();
+    for (int i = 0; i < nStrands; ++i) {
+        Point3f root(rng.UniformFloat(), rng.UniformFloat(), 0);
+        Float phase = 2 * Pi * rng.UniformFloat();
+        for (int j = 0; j < nCp; ++j) {
+            Float t = Float(j) / (nCp - 1);
+            P.push_back(root +
+                        Vector3f(.02f * std::sin(2 * Pi * t + phase), 0, t));
+        }
+    }
+    BVHAccel wavy(HairPrimitives(P, nSegments, .005f), 4,
+                  BVHAccel::SplitMethod::Strands);
+    EXPECT_GT(CountStrandRuns(wavy), 3 * nStrands);
+
+    // Strands bent at right angles between their segments are broken up.
+    P.clear();
+    for (int i = 0; i < nStrands; ++i) {
+        Point3f p(rng.UniformFloat(), rng.UniformFloat(), 0);
+        for (int s = 0; s < nSegments; ++s) {
+            Vector3f d = (s & 1) ? Vector3f(.05f, 0, 0) : Vector3f(0, 0, .15f);
+            for (int j = (s == 0) ? 0 : 1; j < 4; ++j)
+                P.push_back(p + j / 3.f * d);
+            p += d;
+        }
+    }
+    BVHAccel kinked(HairPrimitives(P, nSegments, .005f), 4,
+                    BVHAccel::SplitMethod::Strands);
+    EXPECT_LT(CountStrandRuns(kinked), nStrands / 10);
+}
+
+TEST(BVH, WideNodes) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        HairPrimitives(RandomStrands(rng, 3000, .3f), 1, .005f);
+
+    // Collapsing the tree into 4- and 8-wide nodes, with or without
+    // quantized bounds, must not change which curves rays hit.
+    BVHAccel binary(prims, 4);
+    for (int width : {4, 8})
+        for (bool compressed : {false, true}) {
+            BVHAccel wide(prims, 4, BVHAccel::SplitMethod::SAH, false, width,
+                          .5f, compressed);
+            EXPECT_GT(CompareIntersections(binary, wide, rng, 5000), 50);
+        }
+}
+
+TEST(BVH, Layouts) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        HairPrimitives(RandomStrands(rng, 3000, .3f), 1, .005f);
+
+    // Laying out the nodes differently must not change which curves rays
+    // hit.  The rays traced against the depth-first BVH are recorded.
+    TemporaryFile file("test.bvhrays");
+    const int nRays = 2000;
+    {
+        BVHAccel depthFirst(prims, 4, BVHAccel::SplitMethod::SAH, false, 2,
+                            .5f, false, BVHAccel::Layout::DepthFirst,
+                            file.filename);
+        for (BVHAccel::Layout layout : {BVHAccel::Layout::Probability,
+                                        BVHAccel::Layout::VanEmdeBoas}) {
+            BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, false, 2, .5f,
+                         false, layout);
+            EXPECT_GT(CompareIntersections(depthFirst, bvh, rng, nRays), 50);
+        }
+    }
+
+    // Replaying the recorded rays visits the same nodes with all layouts.
+    std::shared_ptr<BVHRayRecording> recording =
+        ReadBVHRayRecording(file.filename);
+    ASSERT_TRUE(recording != nullptr);
+    int64_t nFetched[3] = {0, 0, 0};
+    int i = 0;
+    for (BVHAccel::Layout layout :
+         {BVHAccel::Layout::DepthFirst, BVHAccel::Layout::Probability,
+          BVHAccel::Layout::VanEmdeBoas}) {
+        int64_t *n = &nFetched[i++];
+        EXPECT_EQ(2 * 2 * nRays,
+                  ReplayBVHRays(*recording, layout,
+                                [n](size_t offset) { ++*n; }));
+    }
+    EXPECT_GT(nFetched[0], 2 * 2 * nRays);
+    EXPECT_EQ(nFetched[0], nFetched[1]);
+    EXPECT_EQ(nFetched[0], nFetched[2]);
+}
+
+TEST(BVH, ParallelBuild) {
+    // Random strands, built in parallel from a low threshold so that the
+    // SAH build uses several threads.
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        HairPrimitives(RandomStrands(rng, 8000, .1f), 1, .001f);
+    const int parallelItems = 1024;
+
+    // Building with several threads must give the same tree as building
+    // with one.
+    int nThreads = PbrtOptions.nThreads;
+    PbrtOptions.nThreads = 1;
+    BVHAccel serial(prims, 4, BVHAccel::SplitMethod::SAH, false, 2, .5f,
+                    false, BVHAccel::Layout::DepthFirst, "", parallelItems);
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    BVHAccel parallel(prims, 4, BVHAccel::SplitMethod::SAH, false, 2, .5f,
+                      false, BVHAccel::Layout::DepthFirst, "", parallelItems);
+    ParallelCleanup();
+    PbrtOptions.nThreads = nThreads;
+    ASSERT_EQ(serial.NumNodes(), parallel.NumNodes());
+    for (int i = 0; i < serial.NumNodes(); ++i) {
+        int serialOffset, serialPrimitives, offset, nPrimitives;
+        EXPECT_EQ(serial.Node(i, &serialOffset, &serialPrimitives),
+                  parallel.Node(i, &offset, &nPrimitives)) << i;
+        EXPECT_EQ(serialOffset, offset) << i;
+        EXPECT_EQ(serialPrimitives, nPrimitives) << i;
+    }
+    EXPECT_TRUE(serial.LeafPrimitives() == parallel.LeafPrimitives());
+    EXPECT_GT(CompareIntersections(serial, parallel, rng, 5000), 50);
+}
+
+TEST(BVH, SpatialSplits) {
+    // Long, straight strands crossing each other, which overlap heavily
+    // with object splits alone.
+    RNG rng;
+    std::vector<Point3f> P;
+    for (int i = 0; i < 300; ++i) {
+        Point3f p0(rng.UniformFloat(), rng.UniformFloat(), 0);
+        Point3f p1(rng.UniformFloat(), rng.UniformFloat(), 1);
+        for (int j = 0; j < 4; ++j) P.push_back(Lerp(j / 3.f, p0, p1));
+    }
+    std::vector<std::shared_ptr<Primitive>> prims =
+        HairPrimitives(P, 1, .002f);
+
+    // Splitting references must not change which curves rays hit.
+    BVHAccel sah(prims, 4);
+    for (Float budget : {0.f, .5f, 4.f}) {
+        BVHAccel sbvh(prims, 4, BVHAccel::SplitMethod::SBVH, false, 2, budget);
+        EXPECT_GT(CompareIntersections(sah, sbvh, rng, 2000, 1), 50);
+    }
+}
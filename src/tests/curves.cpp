@@ -0,0 +1,700 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "accelerators/bvh.h"
+#include "cameras/perspective.h"
+#include "filters/box.h"
+#include "paramset.h"
+#include "primitive.h"
+#include "rng.h"
+#include "shapes/curve.h"
+#include "shapes/hairfile.h"
+#include "tests/testutil.h"
+
+using namespace pbrt;
+
+// Returns a perspective camera at the origin that looks down the z axis
+// with a 45 degree field of view and a 100x100 pixel film.
+static std::unique_ptr<Camera> TestCamera() {
+    Point2i resolution(100, 100);
+    AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., "test.exr", 1.);
+    return std::unique_ptr<Camera>(new PerspectiveCamera(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr));
+}
+
+// Returns parameters for a "hairlod" shape with two single-segment levels
+// along the x axis; the coarse level is twice as wide.
+static ParamSet HairLODParams() {
+    ParamSet params;
+    std::unique_ptr<Point3f[]> P(new Point3f[8]);
+    for (int level = 0; level < 2; ++level)
+        for (int i = 0; i < 4; ++i)
+            P[4 * level + i] = Point3f(i / 3.f, 0, 0);
+    params.AddPoint3f("P", std::move(P), 8);
+    std::unique_ptr<int[]> segs(new int[2]{1, 1});
+    params.AddInt("levelsegments", std::move(segs), 2);
+    std::unique_ptr<Float[]> radius(new Float[2]{0, .05f});
+    params.AddFloat("levelradius", std::move(radius), 2);
+    std::unique_ptr<Float[]> widths(new Float[4]{.01f, .01f, .1f, .1f});
+    params.AddFloat("widths", std::move(widths), 4);
+    return params;
+}
+
+TEST(HairLOD, CameraDistance) {
+    std::unique_ptr<Camera> camera = TestCamera();
+
+    ParamSet params = HairLODParams();
+    for (Float dist : {2.f, 2000.f}) {
+        Transform o2w = Translate(Vector3f(0, 0, dist));
+        Transform w2o = Inverse(o2w);
+        std::vector<std::shared_ptr<Shape>> curves =
+            CreateHairLODShape(&o2w, &w2o, false, params, camera.get());
+        ASSERT_FALSE(curves.empty());
+        // Nearby, the .05 merge radius covers several pixels and the full
+        // resolution level must be used; far away it's sub-pixel.
+        Float expectedWidth = (dist < 10) ? .01f : .1f;
+        Bounds3f b = curves[0]->ObjectBound();
+        EXPECT_FLOAT_EQ(expectedWidth, b.pMax.y - b.pMin.y);
+    }
+
+    // Without a camera, the finest level is used.
+    Transform o2w;
+    std::vector<std::shared_ptr<Shape>> curves =
+        CreateHairLODShape(&o2w, &o2w, false, params, nullptr);
+    ASSERT_FALSE(curves.empty());
+    Bounds3f b = curves[0]->ObjectBound();
+    EXPECT_FLOAT_EQ(.01f, b.pMax.y - b.pMin.y);
+}
+
+TEST(HairLOD, RayFootprint) {
+    ParamSet params = HairLODParams();
+    params.AddString("lodselection", std::unique_ptr<std::string[]>(
+                                         new std::string[1]{"ray"}), 1);
+    params.AddInt("splitdepth", std::unique_ptr<int[]>(new int[1]{0}), 1);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> curves =
+        CreateHairLODShape(&identity, &identity, false, params, nullptr);
+    ASSERT_EQ(2u, curves.size());
+
+    // Rays 5 units in front of the groom with footprints of 0, half the
+    // coarse level's merge radius and far beyond it there.
+    for (Float spread : {0.f, .005f, 1.f}) {
+        int levelHits[2] = {0, 0};
+        const int nRays = 1000;
+        for (int i = 0; i < nRays; ++i) {
+            Ray ray(Point3f(.2f + .6f * i / nRays, 0, -5), Vector3f(0, 0, 1));
+            ray.coneSpread = spread;
+            int nHits = 0;
+            for (int level = 0; level < 2; ++level) {
+                Float tHit;
+                SurfaceInteraction isect;
+                if (curves[level]->Intersect(ray, &tHit, &isect)) {
+                    ++levelHits[level];
+                    ++nHits;
+                }
+                EXPECT_EQ(curves[level]->IntersectP(ray),
+                          curves[level]->Intersect(ray, &tHit, &isect));
+            }
+            // Each ray must see exactly one level of the groom.
+            EXPECT_EQ(1, nHits);
+        }
+        if (spread == 0)
+            EXPECT_EQ(nRays, levelHits[0]);
+        else if (spread == 1)
+            EXPECT_EQ(nRays, levelHits[1]);
+        else {
+            EXPECT_GT(levelHits[0], nRays / 4);
+            EXPECT_GT(levelHits[1], nRays / 4);
+        }
+    }
+}
+
+TEST(HairLOD, SpawnedRayCone) {
+    // Shadow and continuation rays start with the footprint and spread of
+    // the ray that found the interaction.
+    Interaction it(Point3f(0, 0, 0), Normal3f(0, 0, 1), Vector3f(0, 0, 0),
+                   Vector3f(0, 0, 1), 0, MediumInterface());
+    it.coneFootprint = .1f;
+    it.coneSpread = .01f;
+    for (const Ray &ray : {it.SpawnRay(Vector3f(0, 0, 2)),
+                           it.SpawnRayTo(Point3f(1, 0, 5)),
+                           it.SpawnRayTo(Interaction(
+                               Point3f(0, 3, 3), 0, MediumInterface()))}) {
+        EXPECT_FLOAT_EQ(.1f, ray.Footprint(0));
+        EXPECT_EQ(.01f, ray.coneSpread);
+    }
+}
+
+TEST(HairMesh, SharedEndpoints) {
+    // Two strands along x: one with two segments sharing the control point
+    // at x=1 and one with a single segment at y=1.
+    ParamSet params;
+    std::unique_ptr<Point3f[]> P(new Point3f[11]);
+    for (int i = 0; i < 7; ++i) P[i] = Point3f(i / 3.f, 0, 0);
+    for (int i = 0; i < 4; ++i) P[7 + i] = Point3f(i / 3.f, 1, 0);
+    params.AddPoint3f("P", std::move(P), 11);
+    params.AddInt("strandsegments", std::unique_ptr<int[]>(new int[2]{2, 1}),
+                  2);
+    std::unique_ptr<Float[]> widths(new Float[11]);
+    for (int i = 0; i < 7; ++i) widths[i] = .1f * (1 + i / 3);
+    for (int i = 0; i < 4; ++i) widths[7 + i] = .05f;
+    params.AddFloat("widths", std::move(widths), 11);
+
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> curves =
+        CreateHairMeshShape(&identity, &identity, false, params);
+    ASSERT_EQ(3u, curves.size());
+
+    Bounds3f b = curves[1]->ObjectBound();
+    EXPECT_FLOAT_EQ(1 - .15f, b.pMin.x);
+    EXPECT_FLOAT_EQ(2 + .15f, b.pMax.x);
+    b = curves[2]->ObjectBound();
+    EXPECT_NEAR(.05f, b.pMax.y - b.pMin.y, 1e-6);
+
+    // The second segment's control point widths are .2, .2, .2 and .3,
+    // which gives a width of .2125 at u=.5.
+    Ray ray(Point3f(1.5, 0, -1), Vector3f(0, 0, 1));
+    Float tHit;
+    SurfaceInteraction isect;
+    EXPECT_FALSE(curves[0]->Intersect(ray, &tHit, &isect));
+    ASSERT_TRUE(curves[1]->Intersect(ray, &tHit, &isect));
+    EXPECT_NEAR(1, tHit, 1e-3);
+    EXPECT_TRUE(curves[1]->IntersectP(Ray(Point3f(1.5, .1, -1),
+                                          Vector3f(0, 0, 1))));
+    EXPECT_FALSE(curves[1]->IntersectP(Ray(Point3f(1.5, .11, -1),
+                                           Vector3f(0, 0, 1))));
+}
+
+TEST(HairMesh, ChildHair) {
+    // Four bent guides rooted at the corners of the unit square in xz,
+    // with two segments each.
+    const int nGuides = 4, nGuideCps = 7, nChildren = 200;
+    std::unique_ptr<Point3f[]> P(new Point3f[nGuides * nGuideCps]);
+    for (int g = 0; g < nGuides; ++g)
+        for (int i = 0; i < nGuideCps; ++i)
+            P[g * nGuideCps + i] =
+                Point3f(g % 2 + .1f * i * (g + 1), i / 3.f, g / 2 + .05f * i * i);
+
+    // Children interpolate the guides of one of the square's two triangles.
+    RNG rng;
+    std::unique_ptr<int[]> guides(new int[3 * nChildren]);
+    std::unique_ptr<Float[]> weights(new Float[3 * nChildren]);
+    std::vector<Point3f> childCps;
+    for (int c = 0; c < nChildren; ++c) {
+        Float u = rng.UniformFloat(), v = rng.UniformFloat() * (1 - u);
+        Float w[3] = {u, v, 1 - u - v};
+        for (int k = 0; k < 3; ++k) {
+            guides[3 * c + k] = (c % 2) + k;
+            weights[3 * c + k] = w[k];
+        }
+        for (int i = 0; i < nGuideCps; ++i) {
+            Point3f p(0, 0, 0);
+            for (int k = 0; k < 3; ++k)
+                p += w[k] * P[(c % 2 + k) * nGuideCps + i];
+            childCps.push_back(p);
+        }
+    }
+
+    ParamSet childParams;
+    childParams.AddPoint3f("P", std::move(P), nGuides * nGuideCps);
+    childParams.AddInt("guidesegments", std::unique_ptr<int[]>(new int[1]{2}),
+                       1);
+    childParams.AddInt("childguides", std::move(guides), 3 * nChildren);
+    childParams.AddFloat("childweights", std::move(weights), 3 * nChildren);
+    childParams.AddFloat("width", std::unique_ptr<Float[]>(new Float[1]{.01f}),
+                         1);
+    // Cache fewer segments than there are to exercise eviction.
+    childParams.AddInt("clustersize", std::unique_ptr<int[]>(new int[1]{8}), 1);
+    childParams.AddInt("cachesegments",
+                       std::unique_ptr<int[]>(new int[1]{160}), 1);
+
+    ParamSet bakedParams;
+    std::unique_ptr<Point3f[]> bakedP(new Point3f[childCps.size()]);
+    std::copy(childCps.begin(), childCps.end(), bakedP.get());
+    bakedParams.AddPoint3f("P", std::move(bakedP), childCps.size());
+    std::unique_ptr<int[]> strandSegments(new int[nChildren]);
+    for (int c = 0; c < nChildren; ++c) strandSegments[c] = 2;
+    bakedParams.AddInt("strandsegments", std::move(strandSegments),
+                       nChildren);
+    bakedParams.AddFloat("width", std::unique_ptr<Float[]>(new Float[1]{.01f}),
+                         1);
+
+    Transform identity;
+    auto makeBVH = [](std::vector<std::shared_ptr<Shape>> shapes) {
+        std::vector<std::shared_ptr<Primitive>> prims;
+        for (const auto &s : shapes)
+            prims.push_back(std::make_shared<GeometricPrimitive>(
+                s, nullptr, nullptr, MediumInterface()));
+        return std::make_shared<BVHAccel>(std::move(prims), 4);
+    };
+    std::vector<std::shared_ptr<Shape>> clusters =
+        CreateChildHairShape(&identity, &identity, false, childParams);
+    ASSERT_EQ(size_t(nChildren / 8), clusters.size());
+    std::shared_ptr<BVHAccel> child = makeBVH(clusters);
+    std::shared_ptr<BVHAccel> baked = makeBVH(
+        CreateHairMeshShape(&identity, &identity, false, bakedParams));
+    Bounds3f bounds = baked->WorldBound();
+    EXPECT_TRUE(Inside(bounds.pMin, child->WorldBound()));
+    EXPECT_TRUE(Inside(bounds.pMax, child->WorldBound()));
+
+    // Generated children are hit exactly like the baked ones.
+    int nHits = 0;
+    for (int i = 0; i < 400; ++i) {
+        Point3f o = bounds.Lerp(
+            Point3f(rng.UniformFloat(), rng.UniformFloat(), -1));
+        Point3f target = bounds.Lerp(
+            Point3f(rng.UniformFloat(), rng.UniformFloat(), 2));
+        Ray rc(o, target - o), rb(o, target - o);
+        SurfaceInteraction ic, ib;
+        bool hitChild = child->Intersect(rc, &ic);
+        ASSERT_EQ(baked->Intersect(rb, &ib), hitChild);
+        EXPECT_EQ(baked->IntersectP(Ray(o, target - o)),
+                  child->IntersectP(Ray(o, target - o)));
+        if (!hitChild) continue;
+        ++nHits;
+        EXPECT_NEAR(rb.tMax, rc.tMax, 1e-4f);
+    }
+    EXPECT_GT(nHits, 20);
+}
+
+TEST(HairMesh, Quantized) {
+    // Random wavy strands of five segments each.
+    const int nStrands = 100, nCps = 16;
+    RNG rng;
+    std::vector<Point3f> P;
+    std::vector<Float> widths;
+    for (int s = 0; s < nStrands; ++s) {
+        Point3f root(rng.UniformFloat(), 0, rng.UniformFloat());
+        for (int i = 0; i < nCps; ++i) {
+            P.push_back(root + Vector3f(.05f * std::sin(i + s), i / 15.f,
+                                        .05f * std::cos(2 * i + s)));
+            widths.push_back(.01f * (1 - i / 20.f));
+        }
+    }
+    auto makeParams = [&](bool quantize) {
+        ParamSet params;
+        std::unique_ptr<Point3f[]> p(new Point3f[P.size()]);
+        std::copy(P.begin(), P.end(), p.get());
+        params.AddPoint3f("P", std::move(p), P.size());
+        std::unique_ptr<int[]> segments(new int[nStrands]);
+        for (int s = 0; s < nStrands; ++s) segments[s] = 5;
+        params.AddInt("strandsegments", std::move(segments), nStrands);
+        std::unique_ptr<Float[]> w(new Float[widths.size()]);
+        std::copy(widths.begin(), widths.end(), w.get());
+        params.AddFloat("widths", std::move(w), widths.size());
+        params.AddBool("quantize",
+                       std::unique_ptr<bool[]>(new bool[1]{quantize}), 1);
+        return params;
+    };
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> full =
+        CreateHairMeshShape(&identity, &identity, false, makeParams(false));
+    std::vector<std::shared_ptr<Shape>> quantized =
+        CreateHairMeshShape(&identity, &identity, false, makeParams(true));
+    ASSERT_EQ(full.size(), quantized.size());
+
+    // Strands span about 1.1 units, so coordinates are off by less than
+    // 1e-5; bounds and hits agree up to that.
+    for (size_t i = 0; i < full.size(); ++i) {
+        Bounds3f bf = full[i]->ObjectBound(), bq = quantized[i]->ObjectBound();
+        for (int c = 0; c < 3; ++c) {
+            EXPECT_NEAR(bf.pMin[c], bq.pMin[c], 2e-5f);
+            EXPECT_NEAR(bf.pMax[c], bq.pMax[c], 2e-5f);
+        }
+    }
+    int nHits = 0, nMismatches = 0;
+    for (int i = 0; i < 20000; ++i) {
+        std::shared_ptr<Shape> f = full[i % full.size()];
+        std::shared_ptr<Shape> q = quantized[i % full.size()];
+        Point3f target = f->ObjectBound().Lerp(
+            Point3f(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat()));
+        Point3f o = target + Vector3f(0, 0, -2);
+        Ray ray(o, target - o);
+        Float tf, tq;
+        SurfaceInteraction isect;
+        bool hitF = f->Intersect(ray, &tf, &isect);
+        bool hitQ = q->Intersect(ray, &tq, &isect);
+        // Rays grazing a curve's edge may differ.
+        if (hitF != hitQ) {
+            ++nMismatches;
+            continue;
+        }
+        if (!hitF) continue;
+        ++nHits;
+        EXPECT_NEAR(tf, tq, 1e-4f);
+    }
+    EXPECT_GT(nHits, 1000);
+    EXPECT_LT(nMismatches, 20000 / 500);
+}
+
+TEST(HairMesh, BinaryFile) {
+    // One strand with two segments along x.
+    HairFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HairFileMagic, sizeof(header.magic));
+    header.version = HairFileVersion;
+    header.nStrands = 1;
+    header.nControlPoints = 7;
+    float P[21], widths[7];
+    for (int i = 0; i < 7; ++i) {
+        P[3 * i] = i / 3.f;
+        P[3 * i + 1] = P[3 * i + 2] = 0;
+        widths[i] = .1f;
+    }
+    int32_t offsets[2] = {0, 7};
+
+    TemporaryFile file("test.pbrthair");
+    FILE *f = fopen(file.filename.c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(P, sizeof(float), 21, f);
+    fwrite(widths, sizeof(float), 7, f);
+    fwrite(offsets, sizeof(int32_t), 2, f);
+    fclose(f);
+
+    ParamSet params;
+    params.AddString("filename", std::unique_ptr<std::string[]>(
+                                     new std::string[1]{file.filename}), 1);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> curves =
+        CreateHairMeshShape(&identity, &identity, false, params);
+    ASSERT_EQ(2u, curves.size());
+    Bounds3f b = curves[1]->ObjectBound();
+    EXPECT_FLOAT_EQ(1 - .05f, b.pMin.x);
+    EXPECT_FLOAT_EQ(2 + .05f, b.pMax.x);
+
+    // Strand offsets that don't describe whole segments are rejected.
+    offsets[1] = 6;
+    f = fopen(file.filename.c_str(), "r+b");
+    ASSERT_TRUE(f != nullptr);
+    fseek(f, HairFileStrandOffsetsOffset(header), SEEK_SET);
+    fwrite(offsets, sizeof(int32_t), 2, f);
+    fclose(f);
+    curves.clear();
+    EXPECT_TRUE(CreateHairMeshShape(&identity, &identity, false, params).empty());
+}
+
+TEST(HairMesh, Coverage) {
+    // Two strands along x; the second only covers a quarter of its width.
+    ParamSet params;
+    std::unique_ptr<Point3f[]> P(new Point3f[8]);
+    for (int i = 0; i < 4; ++i) {
+        P[i] = Point3f(i / 3.f, 0, 0);
+        P[4 + i] = Point3f(i / 3.f, 1, 0);
+    }
+    params.AddPoint3f("P", std::move(P), 8);
+    params.AddInt("strandsegments", std::unique_ptr<int[]>(new int[2]{1, 1}),
+                  2);
+    params.AddFloat("width", std::unique_ptr<Float[]>(new Float[1]{.1f}), 1);
+    params.AddFloat("coverage",
+                    std::unique_ptr<Float[]>(new Float[2]{1, .25f}), 2);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> curves =
+        CreateHairMeshShape(&identity, &identity, false, params);
+    ASSERT_EQ(2u, curves.size());
+
+    // Shadow rays pass the partially covered strand in proportion to its
+    // coverage; other rays always hit both.
+    auto expectCoverage = [](
+        const std::vector<std::shared_ptr<Shape>> &curves) {
+        RNG rng;
+        const int nRays = 4000;
+        int nOpaque = 0, nCovered = 0;
+        for (int i = 0; i < nRays; ++i) {
+            Float x = .2f + .6f * rng.UniformFloat();
+            for (int s = 0; s < 2; ++s) {
+                Ray ray(Point3f(x, s, -1), Vector3f(0, 0, 1));
+                Float tHit;
+                SurfaceInteraction isect;
+                EXPECT_TRUE(curves[s]->Intersect(ray, &tHit, &isect));
+                if (curves[s]->IntersectP(ray))
+                    ++(s == 0 ? nOpaque : nCovered);
+            }
+        }
+        EXPECT_EQ(nRays, nOpaque);
+        EXPECT_NEAR(.25f, Float(nCovered) / nRays, .03f);
+    };
+    expectCoverage(curves);
+
+    // The same strands in a quantized binary hair file, whose coverage
+    // must outlive the mapping of the file.
+    HairFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HairFileMagic, sizeof(header.magic));
+    header.version = HairFileVersion;
+    header.nStrands = 2;
+    header.nControlPoints = 8;
+    header.flags = HairFileHasCoverage;
+    float filePoints[24], fileWidths[8], fileCoverage[2] = {1, .25f};
+    for (int i = 0; i < 8; ++i) {
+        filePoints[3 * i] = (i % 4) / 3.f;
+        filePoints[3 * i + 1] = i / 4;
+        filePoints[3 * i + 2] = 0;
+        fileWidths[i] = .1f;
+    }
+    int32_t offsets[3] = {0, 4, 8};
+    TemporaryFile file("coverage.pbrthair");
+    FILE *f = fopen(file.filename.c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(filePoints, sizeof(float), 24, f);
+    fwrite(fileWidths, sizeof(float), 8, f);
+    fwrite(offsets, sizeof(int32_t), 3, f);
+    fwrite(fileCoverage, sizeof(float), 2, f);
+    fclose(f);
+    ParamSet fileParams;
+    fileParams.AddString("filename", std::unique_ptr<std::string[]>(
+                                         new std::string[1]{file.filename}),
+                         1);
+    fileParams.AddBool("quantize", std::unique_ptr<bool[]>(new bool[1]{true}),
+                       1);
+    std::vector<std::shared_ptr<Shape>> quantized =
+        CreateHairMeshShape(&identity, &identity, false, fileParams);
+    ASSERT_EQ(2u, quantized.size());
+    expectCoverage(quantized);
+
+    // The number of coverage values must match the number of strands.
+    params.AddFloat("coverage", std::unique_ptr<Float[]>(new Float[1]{1}), 1);
+    EXPECT_TRUE(
+        CreateHairMeshShape(&identity, &identity, false, params).empty());
+}
+
+TEST(Curve, PerControlPointWidths) {
+    // A straight curve along x that is thicker in the middle than at its
+    // ends.
+    ParamSet params;
+    std::unique_ptr<Point3f[]> P(new Point3f[4]);
+    for (int i = 0; i < 4; ++i) P[i] = Point3f(i / 3.f, 0, 0);
+    params.AddPoint3f("P", std::move(P), 4);
+    std::unique_ptr<Float[]> widths(new Float[4]{.1f, .5f, .5f, .1f});
+    params.AddFloat("widths", std::move(widths), 4);
+    std::unique_ptr<int[]> sd(new int[1]{0});
+    params.AddInt("splitdepth", std::move(sd), 1);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> curves =
+        CreateCurveShape(&identity, &identity, false, params);
+    ASSERT_EQ(1u, curves.size());
+
+    Bounds3f b = curves[0]->ObjectBound();
+    EXPECT_FLOAT_EQ(.5f, b.pMax.y - b.pMin.y);
+
+    // The width at u=.5 is (.1 + 3 * .5 + 3 * .5 + .1) / 8 = .4.
+    Ray inside(Point3f(.5f, .15f, -1), Vector3f(0, 0, 1));
+    Ray outside(Point3f(.5f, .25f, -1), Vector3f(0, 0, 1));
+    EXPECT_TRUE(curves[0]->IntersectP(inside));
+    EXPECT_FALSE(curves[0]->IntersectP(outside));
+
+    // Near the ends the curve is thin.
+    Ray nearEnd(Point3f(.02f, .1f, -1), Vector3f(0, 0, 1));
+    EXPECT_FALSE(curves[0]->IntersectP(nearEnd));
+}
+
+// Returns the shapes of "curve" shapes for _n_ short random curves along
+// x, with width .01, created with _params_ and the given _camera_.
+static std::vector<std::shared_ptr<Shape>> PrunedCurves(
+    int n, const ParamSet &base, const Transform &o2w, const Camera *camera) {
+    RNG rng;
+    Transform w2o = Inverse(o2w);
+    std::vector<std::shared_ptr<Shape>> kept;
+    for (int i = 0; i < n; ++i) {
+        ParamSet params = base;
+        std::unique_ptr<Point3f[]> P(new Point3f[4]);
+        Point3f p0(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+        for (int j = 0; j < 4; ++j) P[j] = p0 + Vector3f(j / 30.f, 0, 0);
+        params.AddPoint3f("P", std::move(P), 4);
+        params.AddFloat("width", std::unique_ptr<Float[]>(new Float[1]{.01f}),
+                        1);
+        params.AddInt("splitdepth", std::unique_ptr<int[]>(new int[1]{0}), 1);
+        auto c = CreateCurveShape(&o2w, &w2o, false, params, camera);
+        kept.insert(kept.end(), c.begin(), c.end());
+    }
+    return kept;
+}
+
+TEST(Curve, Pruning) {
+    const int n = 4000;
+    ParamSet params;
+    params.AddFloat("prunefraction",
+                    std::unique_ptr<Float[]>(new Float[1]{.25f}), 1);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> kept =
+        PrunedCurves(n, params, identity, nullptr);
+    EXPECT_NEAR(.25f * n, kept.size(), .05f * n);
+    // The kept curves are four times as wide and the selection is
+    // deterministic.
+    for (const auto &c : kept) {
+        Bounds3f b = c->ObjectBound();
+        EXPECT_NEAR(.04f, b.pMax.y - b.pMin.y, 1e-5f);
+    }
+    std::vector<std::shared_ptr<Shape>> again =
+        PrunedCurves(n, params, identity, nullptr);
+    ASSERT_EQ(kept.size(), again.size());
+    for (size_t i = 0; i < kept.size(); ++i) {
+        Bounds3f b0 = kept[i]->ObjectBound(), b1 = again[i]->ObjectBound();
+        EXPECT_EQ(b0.pMin, b1.pMin);
+    }
+
+    // With "prunepixelwidth", nearby curves that cover several pixels are
+    // all kept, while far away ones are pruned down to "pruneminfraction".
+    std::unique_ptr<Camera> camera = TestCamera();
+    ParamSet pixelParams;
+    pixelParams.AddFloat("prunepixelwidth",
+                         std::unique_ptr<Float[]>(new Float[1]{.5f}), 1);
+    pixelParams.AddFloat("pruneminfraction",
+                         std::unique_ptr<Float[]>(new Float[1]{.1f}), 1);
+    EXPECT_EQ(size_t(n),
+              PrunedCurves(n, pixelParams,
+                           Translate(Vector3f(-.5f, -.5f, .5f)), camera.get())
+                  .size());
+    kept = PrunedCurves(n, pixelParams, Translate(Vector3f(0, 0, 1000)),
+                        camera.get());
+    EXPECT_NEAR(.1f * n, kept.size(), .03f * n);
+    for (const auto &c : kept) {
+        Bounds3f b = c->ObjectBound();
+        EXPECT_NEAR(.1f, b.pMax.y - b.pMin.y, 1e-5f);
+    }
+}
+
+TEST(Curve, StrandPruning) {
+    // Strands of three segments running away from the camera, each at the
+    // x coordinate given by its index.
+    const int nStrands = 1000, nSegments = 3, nCp = 3 * nSegments + 1;
+    RNG rng;
+    std::vector<Point3f> P;
+    for (int i = 0; i < nStrands; ++i) {
+        Point3f root(i, rng.UniformFloat(), 10);
+        for (int j = 0; j < nCp; ++j)
+            P.push_back(root + Vector3f(0, 0, 1000.f * j / (nCp - 1)));
+    }
+    auto floatParam = [](ParamSet *params, const char *name, Float v) {
+        params->AddFloat(name, std::unique_ptr<Float[]>(new Float[1]{v}), 1);
+    };
+    auto intParam = [](ParamSet *params, const char *name, int v) {
+        params->AddInt(name, std::unique_ptr<int[]>(new int[1]{v}), 1);
+    };
+    // Expects that each strand kept all or none of its curves and returns
+    // the fraction of strands that were kept.
+    auto keptStrands = [&](const std::vector<std::shared_ptr<Shape>> &curves) {
+        std::vector<int> count(nStrands, 0);
+        for (const auto &c : curves) {
+            Bounds3f b = c->ObjectBound();
+            ++count[int(std::round((b.pMin.x + b.pMax.x) / 2))];
+        }
+        int nKept = 0;
+        for (int i = 0; i < nStrands; ++i) {
+            EXPECT_TRUE(count[i] == 0 || count[i] == nSegments) << i;
+            if (count[i] > 0) ++nKept;
+        }
+        return Float(nKept) / nStrands;
+    };
+    Transform identity;
+
+    // One "curve" shape per segment, which all pass the strand's root and
+    // width.  The far segments alone would be pruned more.
+    std::unique_ptr<Camera> camera = TestCamera();
+    std::vector<std::shared_ptr<Shape>> curves;
+    for (int i = 0; i < nStrands; ++i)
+        for (int seg = 0; seg < nSegments; ++seg) {
+            ParamSet params;
+            params.AddPoint3f("P", std::unique_ptr<Point3f[]>(new Point3f[4]{
+                                       P[i * nCp + 3 * seg],
+                                       P[i * nCp + 3 * seg + 1],
+                                       P[i * nCp + 3 * seg + 2],
+                                       P[i * nCp + 3 * seg + 3]}),
+                              4);
+            params.AddPoint3f("strandroot", std::unique_ptr<Point3f[]>(
+                                                new Point3f[1]{P[i * nCp]}),
+                              1);
+            floatParam(&params, "width", .01f);
+            floatParam(&params, "strandwidth", .01f);
+            floatParam(&params, "prunefraction", .5f);
+            floatParam(&params, "prunepixelwidth", .24f);
+            floatParam(&params, "pruneminfraction", .01f);
+            intParam(&params, "splitdepth", 0);
+            auto c = CreateCurveShape(&identity, &identity, false, params,
+                                      camera.get());
+            curves.insert(curves.end(), c.begin(), c.end());
+        }
+    EXPECT_NEAR(.25f, keptStrands(curves), .05f);
+
+    // A "hairmesh" shape
+    ParamSet meshParams;
+    std::unique_ptr<Point3f[]> meshP(new Point3f[P.size()]);
+    std::copy(P.begin(), P.end(), meshP.get());
+    meshParams.AddPoint3f("P", std::move(meshP), P.size());
+    std::unique_ptr<int[]> segs(new int[nStrands]);
+    for (int i = 0; i < nStrands; ++i) segs[i] = nSegments;
+    meshParams.AddInt("strandsegments", std::move(segs), nStrands);
+    floatParam(&meshParams, "width", .01f);
+    floatParam(&meshParams, "prunefraction", .5f);
+    EXPECT_NEAR(.5f, keptStrands(CreateHairMeshShape(&identity, &identity,
+                                                     false, meshParams)),
+                .05f);
+
+    // A "hairlod" shape, whose strands are chains of separate segments
+    ParamSet lodParams;
+    std::unique_ptr<Point3f[]> lodP(new Point3f[4 * nStrands * nSegments]);
+    for (int i = 0; i < nStrands; ++i)
+        for (int seg = 0; seg < nSegments; ++seg)
+            for (int j = 0; j < 4; ++j)
+                lodP[4 * (i * nSegments + seg) + j] =
+                    P[i * nCp + 3 * seg + j];
+    lodParams.AddPoint3f("P", std::move(lodP), 4 * nStrands * nSegments);
+    intParam(&lodParams, "levelsegments", nStrands * nSegments);
+    intParam(&lodParams, "splitdepth", 0);
+    floatParam(&lodParams, "width", .01f);
+    floatParam(&lodParams, "prunefraction", .5f);
+    EXPECT_NEAR(.5f, keptStrands(CreateHairLODShape(&identity, &identity,
+                                                    false, lodParams,
+                                                    nullptr)),
+                .05f);
+}
+
+TEST(Curve, RefinedIntersection) {
+    // An arch in the xy plane, thin enough to be refined several levels
+    // deep when intersected.
+    Point3f cp[4] = {Point3f(0, 0, 0), Point3f(1.f / 3.f, 1, 0),
+                     Point3f(2.f / 3.f, 1, 0), Point3f(1, 0, 0)};
+    const Float width = .05f;
+    ParamSet params;
+    params.AddPoint3f("P", std::unique_ptr<Point3f[]>(new Point3f[4]{
+                               cp[0], cp[1], cp[2], cp[3]}), 4);
+    params.AddFloat("width", std::unique_ptr<Float[]>(new Float[1]{width}), 1);
+    params.AddInt("splitdepth", std::unique_ptr<int[]>(new int[1]{0}), 1);
+    Transform identity;
+    std::vector<std::shared_ptr<Shape>> curves =
+        CreateCurveShape(&identity, &identity, false, params);
+    ASSERT_EQ(1u, curves.size());
+
+    for (Float u = .05f; u < 1; u += .1f) {
+        // Find the point and the in-plane normal of the curve at _u_
+        Float u1 = 1 - u;
+        Point3f p = u1 * u1 * u1 * cp[0] + 3 * u * u1 * u1 * cp[1] +
+                    3 * u * u * u1 * cp[2] + u * u * u * cp[3];
+        Vector3f dpdu = 3 * u1 * u1 * (cp[1] - cp[0]) +
+                        6 * u * u1 * (cp[2] - cp[1]) +
+                        3 * u * u * (cp[3] - cp[2]);
+        Vector3f n = Normalize(Vector3f(-dpdu.y, dpdu.x, 0));
+
+        for (Float offset : {-.4f, 0.f, .4f}) {
+            Ray ray(p + offset * width * n + Vector3f(0, 0, -1),
+                    Vector3f(0, 0, 1));
+            Float tHit;
+            SurfaceInteraction isect;
+            ASSERT_TRUE(curves[0]->Intersect(ray, &tHit, &isect))
+                << "u = " << u << ", offset = " << offset;
+            EXPECT_NEAR(1, tHit, 1e-3);
+            EXPECT_NEAR(u, isect.uv.x, .02f);
+        }
+        for (Float offset : {-.6f, .6f}) {
+            Ray ray(p + offset * width * n + Vector3f(0, 0, -1),
+                    Vector3f(0, 0, 1));
+            EXPECT_FALSE(curves[0]->IntersectP(ray))
+                << "u = " << u << ", offset = " << offset;
+        }
+    }
+}
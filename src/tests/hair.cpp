@@ -195,3 +195,70 @@ TEST(Hair, SamplingConsistency) {
             EXPECT_LT(err, 0.05);
         }
 }
+
+TEST(Hair, Tabulated) {
+    RNG rng;
+    for (int i = 0; i < 100; ++i) {
+        Float h = -1 + 2 * rng.UniformFloat();
+        Spectrum sigma_a = (i % 10 == 0) ? Spectrum(0.f)
+                                         : HairBSDF::SigmaAFromConcentration(
+                                               8 * rng.UniformFloat(), 0.f);
+        Float beta_m = .1 + .9 * rng.UniformFloat();
+        Float beta_n = .1 + .9 * rng.UniformFloat();
+        HairAttenuationTable apTable(1.55, sigma_a);
+        HairBSDF exact(h, 1.55, sigma_a, beta_m, beta_n, 2.f);
+        HairBSDF tabulatedMp(h, 1.55, sigma_a, beta_m, beta_n, 2.f, true);
+        HairBSDF tabulated(h, 1.55, sigma_a, beta_m, beta_n, 2.f, true,
+                           &apTable);
+        for (int j = 0; j < 1000; ++j) {
+            Vector3f wo = UniformSampleSphere(
+                {rng.UniformFloat(), rng.UniformFloat()});
+            Vector3f wi = UniformSampleSphere(
+                {rng.UniformFloat(), rng.UniformFloat()});
+            Float f = exact.f(wo, wi).y();
+            Float pdf = exact.Pdf(wo, wi);
+            if (f < 1e-3 || pdf < 1e-3) continue;
+
+            // The $\log I_0$ table only introduces float round-off
+            EXPECT_NEAR(tabulatedMp.f(wo, wi).y(), f, 1e-4 * f);
+            EXPECT_NEAR(tabulatedMp.Pdf(wo, wi), pdf, 1e-4 * pdf);
+
+            // Check the documented bound of _HairAttenuationTable_
+            EXPECT_NEAR(tabulated.f(wo, wi).y(), f, .02 * f) << wo << wi;
+            EXPECT_NEAR(tabulated.Pdf(wo, wi), pdf, .02 * pdf) << wo << wi;
+        }
+    }
+}
+
+TEST(Hair, DualScattering) {
+    RNG rng;
+    HairDualScattering dual(1.55, HairBSDF::SigmaAFromConcentration(.3, 0),
+                            .3, .3, 2);
+    Vector3f wo = Normalize(Vector3f(.3, .8, .2));
+    // Estimate the albedo of the multiple scattering terms for light that
+    // crossed increasingly many fibers
+    Float last = Infinity;
+    for (int nCrossings : {1, 2, 4, 16}) {
+        Spectrum sum(0.f);
+        const int count = 100000;
+        for (int i = 0; i < count; ++i) {
+            Vector3f wi =
+                UniformSampleSphere({rng.UniformFloat(), rng.UniformFloat()});
+            Spectrum f = dual.f(wo, wi, nCrossings, .7, .7);
+            EXPECT_FALSE(f.HasNaNs());
+            EXPECT_GE(f.y(), 0);
+            sum += f * AbsCosTheta(wi) / (count * UniformSpherePdf());
+        }
+        EXPECT_GT(sum.y(), 0);
+        EXPECT_LT(sum.y(), last) << nCrossings;
+        last = sum.y();
+    }
+    // Unoccluded light is only scattered backward by the other fibers
+    for (int i = 0; i < 1000; ++i) {
+        Vector3f wi =
+            UniformSampleSphere({rng.UniformFloat(), rng.UniformFloat()});
+        if (wo.y * wi.y + wo.z * wi.z < 0) {
+            EXPECT_TRUE(dual.f(wo, wi, 0, .7, .7).IsBlack());
+        }
+    }
+}
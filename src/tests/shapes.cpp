@@ -557,3 +557,28 @@ TEST(Triangle, BadCases) {
     SurfaceInteraction isect;
     EXPECT_FALSE(mesh[0]->Intersect(ray, &thit, &isect));
 }
+
+TEST(Triangle, ClippedWorldBound) {
+    Transform identity;
+    int indices[3] = {0, 1, 2};
+    Point3f p[3] = {Point3f(0, 0, 0), Point3f(1, 0, 0), Point3f(0, 1, 0)};
+    auto mesh = CreateTriangleMesh(&identity, &identity, false, 1, indices, 3,
+                                   p, nullptr, nullptr, nullptr, nullptr,
+                                   nullptr);
+
+    // Clipping to x >= .5 leaves the corner at (1, 0, 0), which only
+    // reaches y = .5.
+    Bounds3f b = mesh[0]->ClippedWorldBound(
+        Bounds3f(Point3f(.5, -1, -1), Point3f(2, 2, 1)));
+    EXPECT_FLOAT_EQ(.5, b.pMin.x);
+    EXPECT_FLOAT_EQ(1, b.pMax.x);
+    EXPECT_NEAR(0, b.pMin.y, 1e-6);
+    EXPECT_NEAR(.5, b.pMax.y, 1e-6);
+    EXPECT_NEAR(0, b.pMax.z, 1e-6);
+
+    // The box overlaps the triangle's bounds but not the triangle.
+    EXPECT_TRUE(mesh[0]
+                    ->ClippedWorldBound(
+                        Bounds3f(Point3f(.6, .6, -1), Point3f(1, 1, 1)))
+                    .IsEmpty());
+}
@@ -0,0 +1,75 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_TESTS_TESTUTIL_H
+#define PBRT_TESTS_TESTUTIL_H
+
+// tests/testutil.h*
+#include "pbrt.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#ifdef PBRT_IS_WINDOWS
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace pbrt {
+
+// A file in the temporary directory that is removed when it goes out of
+// scope, also when an assertion ends the test early.  Its name includes
+// the process id, so that concurrent test runs don't share it.
+struct TemporaryFile {
+    explicit TemporaryFile(const char *name) {
+#ifdef PBRT_IS_WINDOWS
+        const char *dir = getenv("TEMP");
+        int pid = _getpid();
+#else
+        const char *dir = getenv("TMPDIR");
+        int pid = static_cast<int>(getpid());
+#endif
+        filename = std::string(dir ? dir : "/tmp") + "/pbrt_test_" +
+                   std::to_string(pid) + "_" + name;
+    }
+    ~TemporaryFile() { remove(filename.c_str()); }
+    std::string filename;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_TESTS_TESTUTIL_H
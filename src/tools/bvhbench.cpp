@@ -0,0 +1,115 @@
+//
+// bvhbench.cpp
+//
+// Replays rays recorded by a BVH with the "rayfile" parameter against each
+// node layout and reports how many nodes were fetched and how many of the
+// fetches missed in a simulated two-level cache.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "pbrt.h"
+#include "accelerators/bvh.h"
+
+using namespace pbrt;
+
+// Set-associative cache with LRU replacement that counts misses
+class CacheModel {
+  public:
+    CacheModel(int sizeKB, int lineBytes, int ways)
+        : lineBytes(lineBytes),
+          ways(ways),
+          nSets(std::max(1, sizeKB * 1024 / (lineBytes * ways))),
+          tags(nSets * ways, ~uint64_t(0)) {}
+    // Returns true if the line containing _offset_ was cached.  Either way
+    // it becomes the most recently used line of its set.
+    bool Access(uint64_t offset) {
+        uint64_t line = offset / lineBytes;
+        uint64_t *set = &tags[(line % nSets) * ways];
+        int i = 0;
+        while (i < ways - 1 && set[i] != line) ++i;
+        bool hit = set[i] == line;
+        if (!hit) ++misses;
+        // Move the line to the front; a miss evicts the last one
+        for (; i > 0; --i) set[i] = set[i - 1];
+        set[0] = line;
+        return hit;
+    }
+    int64_t misses = 0;
+
+  private:
+    const int lineBytes, ways, nSets;
+    std::vector<uint64_t> tags;  // by set, most recently used first
+};
+
+static void usage() {
+    fprintf(stderr,
+            "usage: bvhbench (--l1 KB) (--l2 KB) (--line bytes) [ray file]\n"
+            "Replays rays recorded with the BVH \"rayfile\" parameter "
+            "against each node layout.\n"
+            "Cache misses are simulated for an 8-way L1 cache (default "
+            "32 KB) and a 16-way\nL2 cache (default 1024 KB) with the given "
+            "line size (default 64 bytes);\nthe replay time is measured "
+            "without the simulation.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_stderrthreshold = 1;  // Warning and above.
+
+    int l1KB = 32, l2KB = 1024, lineBytes = 64;
+    while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+        int value = atoi(argv[2]);
+        if (value <= 0) usage();
+        if (strcmp(argv[1], "--l1") == 0)
+            l1KB = value;
+        else if (strcmp(argv[1], "--l2") == 0)
+            l2KB = value;
+        else if (strcmp(argv[1], "--line") == 0)
+            lineBytes = value;
+        else
+            usage();
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 2 || argv[1][0] == '-') usage();
+
+    std::shared_ptr<BVHRayRecording> recording = ReadBVHRayRecording(argv[1]);
+    if (!recording) return 1;
+
+    const struct {
+        const char *name;
+        BVHAccel::Layout layout;
+    } layouts[] = {{"depthfirst", BVHAccel::Layout::DepthFirst},
+                   {"probability", BVHAccel::Layout::Probability},
+                   {"veb", BVHAccel::Layout::VanEmdeBoas}};
+    printf("%-12s %10s %10s %12s %12s %10s\n", "layout", "rays",
+           "nodes/ray", "L1 miss/ray", "L2 miss/ray", "ns/ray");
+    for (const auto &l : layouts) {
+        CacheModel l1(l1KB, lineBytes, 8), l2(l2KB, lineBytes, 16);
+        int64_t nFetched = 0;
+        int64_t nRays =
+            ReplayBVHRays(*recording, l.layout, [&](size_t offset) {
+                ++nFetched;
+                if (!l1.Access(offset)) l2.Access(offset);
+            });
+        if (nRays == 0) {
+            fprintf(stderr, "%s: no rays were recorded.\n", argv[1]);
+            return 1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        ReplayBVHRays(*recording, l.layout, nullptr);
+        auto end = std::chrono::steady_clock::now();
+        double ns =
+            std::chrono::duration<double, std::nano>(end - start).count();
+
+        printf("%-12s %10" PRId64 " %10.2f %12.3f %12.3f %10.1f\n", l.name,
+               nRays, double(nFetched) / nRays, double(l1.misses) / nRays,
+               double(l2.misses) / nRays, ns / nRays);
+    }
+    return 0;
+}
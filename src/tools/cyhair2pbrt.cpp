@@ -38,6 +38,7 @@ THE SOFTWARE.
 
 // Simple Cyhair loader.
 #include "hairutil.h"
+#include "parallel.h"
 #include <unordered_map> 
 
 #include <boost/random.hpp>
@@ -115,6 +116,32 @@ struct CyHairHeader {
   char infomation[88];
 };
 
+// How the LOD clustering decides which strands near a seed strand to merge
+// with it; see StrandDistance().
+enum class LODStrategy {
+  Segments,          // mean length difference of matching segments
+  RootPoint,         // distance of the roots
+  StartAndEndPoint,  // mean distance of the roots and tips
+  SamplePoint        // mean distance of a few CPs with matching indices
+};
+
+static const char *const LODStrategyNames[] = {"segments", "root", "startend",
+                                               "sample"};
+
+// One level of the LOD pyramid built by CyHair::ToCubicBezierCurves.
+struct HairLODLevel {
+  int level;
+  float cluster_radius;  // max root distance of strands merged into one
+  size_t num_strands;
+  // Mean and max distance of the source strands' CPs to the CPs of the
+  // strand they were merged into; only set if CyHair::lod_error_ is.
+  float mean_error = 0, max_error = 0;
+  std::vector<float> vertices;  // same layout as the full resolution curves
+  std::vector<float> radiuss;
+  std::vector<int> strand_segments;
+  std::vector<float> coverages;  // per strand, see Hair::coverage
+};
+
 class CyHair {
  public:
   CyHair()
@@ -123,32 +150,56 @@ class CyHair {
         total_points_(0),
         default_segments_(-1),
         default_thickness_(0.01f),
-        default_transparency_(1.0f) {
+        default_transparency_(1.0f),
+        verbose_(true),
+        lod_strategy_(LODStrategy::RootPoint),
+        lod_error_(false),
+        fp_(nullptr) {
     default_color_[0] = 0.5f;
     default_color_[1] = 0.5f;
     default_color_[2] = 0.5f;
   }
 
-  ~CyHair() {}
+  ~CyHair() { Close(); }
 
   /// Load CyHair data from a file.
   bool Load(const char *filename);
 
+  /// Open a CyHair file and read its header and strand segment counts only.
+  /// Strand data is then read on demand by ReadStrands(), so that only one
+  /// chunk of strands has to be in memory at a time.
+  bool Open(const char *filename);
+  void Close();
+
+  /// Read the points, thicknesses, transparencies and colors of `strands`
+  /// (indices into the file) from the file given to Open(). They replace
+  /// the previously read strands and are numbered in the order given.
+  /// Runs of consecutive indices are read with a single read each.
+  bool ReadStrands(const std::vector<unsigned int> &strands);
+
   /// Convert to cubic bezier curves.
   /// 4(cubic) * 3(xyz) * num_curves = vertices.size()
   /// 4(cubic) * num_curves = radiuss.size()
+  /// Only the strands read by the last ReadStrands() (all strands after
+  /// Load()) are converted.
   /// `max_strands` limits the number of strands to convert. -1 = convert all
   /// strands.
   /// `thickness` overwrites strand thickness if it have positive value.
   /// Apply `vertex_translate` after `vertex_scale`.
-  /// TODO(syoyo) return strand/segment information
+  /// `vertices` and `radiuss` always receive the full resolution curves,
+  /// four control points per segment, and `strand_segments` the number of
+  /// consecutive segments that make up each strand.
+  /// If `lod_levels` is positive, that many progressively merged levels are
+  /// appended to `lods`, finest first.
   bool ToCubicBezierCurves(std::vector<float> *vertices,
                            std::vector<float> *radiuss,
+                           std::vector<int> *strand_segments,
                            const float vertex_scale[3],
                            const float vertex_translate[3],
                            const int max_strands = -1,
                            const float thickness = -1.0f,
-													 const int lod_level = -1);
+                           const int lod_levels = 0,
+                           std::vector<HairLODLevel> *lods = nullptr);
 
   CyHairHeader header_;
 
@@ -165,31 +216,66 @@ class CyHair {
   float default_thickness_;
   float default_transparency_;
   float default_color_[3];
-  int pad0;
+  bool verbose_;  // print conversion progress to stdout
+  LODStrategy lod_strategy_;
+  bool lod_error_;  // measure HairLODLevel::mean_error and max_error
 
   // Processed CyHair values
-  std::vector<unsigned int> strand_offsets_;
+  std::vector<unsigned int> strand_offsets_;  // first point in the file
+
+  // Strands read by ReadStrands(); the per point arrays above hold their
+  // points starting at loaded_offsets_[i].
+  std::vector<unsigned int> loaded_strands_;
+  std::vector<size_t> loaded_offsets_;
+
+ private:
+  int NumSegments(unsigned int strand) const {
+    return segments_.empty() ? default_segments_ : segments_[strand];
+  }
+  bool ReadPointArray(uint64_t offset, size_t components,
+                      const std::vector<unsigned int> &strands,
+                      std::vector<float> *values);
+
+  FILE *fp_;
+  // File offsets of the per point arrays.
+  uint64_t points_offset_, thicknesses_offset_, transparencies_offset_,
+      colors_offset_;
 };
 
 
 
 bool CyHair::Load(const char *filename) {
-  FILE *fp = fopen(filename, "rb");
-  if (!fp) {
+  if (!Open(filename)) {
+    return false;
+  }
+  std::vector<unsigned int> strands(num_strands_);
+  for (size_t i = 0; i < strands.size(); i++) {
+    strands[i] = static_cast<unsigned int>(i);
+  }
+  bool ret = ReadStrands(strands);
+  Close();
+  return ret;
+}
+
+bool CyHair::Open(const char *filename) {
+  Close();
+  fp_ = fopen(filename, "rb");
+  if (!fp_) {
     return false;
   }
 
   assert(sizeof(CyHairHeader) == 128);
   CyHairHeader header;
 
-  if (1 != fread(&header, 128, 1, fp)) {
-    fclose(fp);
+  if (1 != fread(&header, 128, 1, fp_)) {
+    Close();
     return false;
   }
   if (memcmp(header.magic, "HAIR", 4) != 0) {
-    fclose(fp);
+    Close();
     return false;
   }
+  header_ = header;
 
   flags_ = header.flags;
   default_thickness_ = header.default_thickness;
@@ -203,97 +289,290 @@ bool CyHair::Load(const char *filename) {
   const bool has_points = flags_ & 0x2;
   const bool has_thickness = flags_ & 0x4;
   const bool has_transparency = flags_ & 0x8;
-  const bool has_color = flags_ & 0x10;
 
   num_strands_ = header.num_strands;
   total_points_ = header.total_points;
 
   if (!has_points) {
     std::cout << "No point data in CyHair." << std::endl;
+    Close();
     return false;
   }
 
   if ((default_segments_ < 1) && (!has_segments)) {
     std::cout << "No valid segment information in CyHair." << std::endl;
+    Close();
     return false;
   }
 
-  // First read all strand data from a file.
-  if (has_segments) {
+  // Segment counts are needed to locate strands, so they are always read;
+  // the per point arrays follow them and are only read by ReadStrands().
+  segments_.clear();
+  if (has_segments && num_strands_ > 0) {
     segments_.resize(num_strands_);
-    if (1 != fread(&segments_[0], sizeof(unsigned short) * num_strands_, 1, fp)) {
+    if (1 != fread(&segments_[0], sizeof(unsigned short) * num_strands_, 1, fp_)) {
       std::cout << "Failed to read CyHair segments data." << std::endl;
-      fclose(fp);
+      Close();
       return false;
     }
   }
 
-  if (has_points) {
-    std::cout << "[CyHair] Has points." << std::endl;
-    points_.resize(3 * total_points_);
-    size_t n = fread(&points_[0], total_points_ * sizeof(float) * 3, 1, fp);
-    if (1 != n) {
-      std::cout << "Failed to read CyHair points data." << std::endl;
-      fclose(fp);
-      return false;
-    }
+  const uint64_t total = total_points_;
+  points_offset_ = 128 + (has_segments ? sizeof(unsigned short) * uint64_t(num_strands_) : 0);
+  thicknesses_offset_ = points_offset_ + total * sizeof(float) * 3;
+  transparencies_offset_ = thicknesses_offset_ + (has_thickness ? total * sizeof(float) : 0);
+  colors_offset_ = transparencies_offset_ + (has_transparency ? total * sizeof(float) : 0);
+
+  // Build strand offset table.
+  strand_offsets_.resize(num_strands_);
+  if (num_strands_ > 0) strand_offsets_[0] = 0;
+  for (size_t i = 1; i < num_strands_; i++) {
+    int num_segments = NumSegments(static_cast<unsigned int>(i - 1));
+    strand_offsets_[i] =
+        strand_offsets_[i - 1] + static_cast<unsigned int>(num_segments + 1);
   }
 
-  if (has_thickness) {
-    std::cout << "[CyHair] Has thickness." << std::endl;
-    thicknesses_.resize(total_points_);
-    if (1 != fread(&thicknesses_[0], total_points_ * sizeof(float), 1, fp)) {
-      std::cout << "Failed to read CyHair thickness data." << std::endl;
-      fclose(fp);
-      return false;
-    }
+  return true;
+}
+
+void CyHair::Close() {
+  if (fp_) {
+    fclose(fp_);
+    fp_ = nullptr;
   }
+}
 
-  if (has_transparency) {
-    std::cout << "[CyHair] Has transparency." << std::endl;
-    transparencies_.resize(total_points_);
-    if (1 != fread(&transparencies_[0], total_points_ * sizeof(float), 1, fp)) {
-      std::cout << "Failed to read CyHair transparencies data." << std::endl;
-      fclose(fp);
+// Seeks to a byte offset that may be beyond 2GB.
+static bool SeekTo(FILE *fp, uint64_t offset) {
+#ifdef _MSC_VER
+  return _fseeki64(fp, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+  return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+bool CyHair::ReadPointArray(uint64_t offset, size_t components,
+                            const std::vector<unsigned int> &strands,
+                            std::vector<float> *values) {
+  values->resize(components * loaded_offsets_.back());
+  for (size_t i = 0; i < strands.size();) {
+    size_t end = i + 1;
+    while (end < strands.size() && strands[end] == strands[end - 1] + 1) end++;
+    size_t count = loaded_offsets_[end] - loaded_offsets_[i];
+    uint64_t first = strand_offsets_[strands[i]];
+    if (first + count > total_points_) {
+      std::cout << "CyHair strand " << strands[end - 1]
+                << " exceeds the point data." << std::endl;
+      return false;
+    }
+    if (count > 0 &&
+        (!SeekTo(fp_, offset + first * components * sizeof(float)) ||
+         fread(&(*values)[components * loaded_offsets_[i]],
+               components * sizeof(float), count, fp_) != count)) {
       return false;
     }
+    i = end;
+  }
+  return true;
+}
+
+bool CyHair::ReadStrands(const std::vector<unsigned int> &strands) {
+  if (!fp_) {
+    return false;
   }
 
-  if (has_color) {
-    std::cout << "[CyHair] Has color." << std::endl;
-    colors_.resize(3 * total_points_);
-    if (1 != fread(&colors_[0], total_points_ * sizeof(float) * 3, 1, fp)) {
-      std::cout << "Failed to read CyHair colors data." << std::endl;
-      fclose(fp);
+  loaded_strands_ = strands;
+  loaded_offsets_.resize(strands.size() + 1);
+  loaded_offsets_[0] = 0;
+  for (size_t i = 0; i < strands.size(); i++) {
+    if (strands[i] >= num_strands_) {
       return false;
     }
+    loaded_offsets_[i + 1] =
+        loaded_offsets_[i] + static_cast<size_t>(NumSegments(strands[i]) + 1);
   }
 
-  // Build strand offset table.
-  strand_offsets_.resize(num_strands_);
-  strand_offsets_[0] = 0;
-  for (size_t i = 1; i < num_strands_; i++) {
-    int num_segments = segments_.empty() ? default_segments_ : segments_[i - 1];
-    strand_offsets_[i] =
-        strand_offsets_[i - 1] + static_cast<unsigned int>(num_segments + 1);
+  if (!ReadPointArray(points_offset_, 3, strands, &points_)) {
+    std::cout << "Failed to read CyHair points data." << std::endl;
+    return false;
+  }
+
+  thicknesses_.clear();
+  if ((flags_ & 0x4) && !ReadPointArray(thicknesses_offset_, 1, strands, &thicknesses_)) {
+    std::cout << "Failed to read CyHair thickness data." << std::endl;
+    return false;
+  }
+
+  transparencies_.clear();
+  if ((flags_ & 0x8) && !ReadPointArray(transparencies_offset_, 1, strands, &transparencies_)) {
+    std::cout << "Failed to read CyHair transparencies data." << std::endl;
+    return false;
+  }
+
+  colors_.clear();
+  if ((flags_ & 0x10) && !ReadPointArray(colors_offset_, 3, strands, &colors_)) {
+    std::cout << "Failed to read CyHair colors data." << std::endl;
+    return false;
   }
 
   return true;
 }
 
+// Cluster radius of LOD level 1. Each further level scales it by
+// LOD_DISTANCE_SCALE, which roughly halves the strand count per level for
+// strands rooted on a surface.
+static const float LOD_BASE_DISTANCE = 4.0f;
+static const float LOD_DISTANCE_SCALE = 1.41421356f;
+
+// Distance of `h` from the seed strand `seed` that LODStrategy `strategy`
+// ranks and accepts cluster members by. `samples` are the CP indices used by
+// LODStrategy::SamplePoint.
+static float StrandDistance(LODStrategy strategy, const Hair &seed, const Hair &h,
+                            const std::vector<int> &samples) {
+	switch (strategy) {
+	case LODStrategy::Segments: {
+		//strands of a bucket have the same number of segments, so the
+		//segments with the same index are compared. Each segment has its
+		//own 4 CPs.
+		size_t nSegments = h.cps.size() / 4;
+		if (nSegments == 0) return 0;
+		float d = 0;
+		for (size_t k = 0; k + 3 < h.cps.size(); k += 4)
+			d += std::abs(distance(h.cps[k], h.cps[k + 3]) -
+			              distance(seed.cps[k], seed.cps[k + 3]));
+		return d / nSegments;
+	}
+	case LODStrategy::RootPoint:
+		return distance(seed.cps[0], h.cps[0]);
+	case LODStrategy::StartAndEndPoint:
+		return 0.5f * (distance(h.cps[0], seed.cps[0]) +
+		               distance(h.cps.back(), seed.cps.back()));
+	case LODStrategy::SamplePoint:
+	default: {
+		if (samples.empty()) return distance(seed.cps[0], h.cps[0]);
+		float d = 0;
+		for (int index : samples) d += distance(h.cps[index], seed.cps[index]);
+		return d / samples.size();
+	}
+	}
+}
+
+// Merge strands of `hairss` (which all have the same number of CPs) whose
+// roots lie within `max_distance` of a seed strand into one averaged strand
+// each. The candidates are ranked by their StrandDistance() to the seed and
+// merged as long as it stays below `max_distance`; the others remain
+// available to later seeds. Radii grow to cover the merged strands, up to
+// `max_radius`. If `cluster_of` is given, it receives the index in
+// `combined` that each strand of `hairss` was merged into.
+static void CombineHairs(const std::vector<Hair> &hairss, const float max_distance,
+                         const float max_radius, LODStrategy strategy,
+                         std::vector<Hair> *combined,
+                         std::vector<size_t> *cluster_of = nullptr) {
+	if (hairss.empty()) return;
+	if (cluster_of) cluster_of->assign(hairss.size(), 0);
+
+	//the same CPs are sampled for all strands, as they have the same count
+	std::vector<int> samples;
+	{
+		int m = static_cast<int>(hairss[0].cps.size());
+		int nSamples = std::min(m / 4, 2);
+
+		boost::random::mt19937 rng;
+		boost::random::uniform_int_distribution<> range(0, m - 1);
+		for (int i = 0; i < nSamples; i++) samples.push_back(range(rng));
+	}
+
+	//build bb of hairs' root points and find longest axis
+	Bounds3f rootBounds;
+	for (const Hair &h : hairss) rootBounds = Union(rootBounds, h.cps[0]);
+	const int axis = rootBounds.MaximumExtent();
+
+	//visit seeds in order of their root position along the axis,
+	//so the sweep starts at the minimum like the original search
+	std::vector<size_t> order(hairss.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&hairss, axis](size_t a, size_t b) {
+		return hairss[a].cps[0][axis] < hairss[b].cps[0][axis];
+	});
+
+	HairRootGrid grid(hairss, max_distance);
+	std::vector<bool> merged(hairss.size(), false);
+	std::vector<size_t> cluster;
+	std::vector<float> dist(hairss.size());
+
+	//start combination loop
+	for (size_t seed : order)
+	{
+		if (merged[seed]) continue;
+		const Hair &cmp_hair = hairss[seed];
+
+		//all unmerged hairs with a root within max_distance of the seed,
+		//ranked by the strategy's distance; the seed itself comes first
+		cluster.clear();
+		grid.ExtractNeighbors(cmp_hair.cps[0], &cluster);
+		for (size_t i : cluster)
+			dist[i] = i == seed ? -1.0f : StrandDistance(strategy, cmp_hair, hairss[i], samples);
+		std::sort(cluster.begin(), cluster.end(), [&dist](size_t a, size_t b) {
+			return dist[a] < dist[b] || (dist[a] == dist[b] && a < b);
+		});
+		size_t nHairs = 0;
+		while (nHairs < cluster.size() && dist[cluster[nHairs]] < max_distance) nHairs++;
+		for (size_t i = nHairs; i < cluster.size(); i++) grid.Insert(cluster[i]);
+		cluster.resize(nHairs);
+		for (size_t i : cluster) {
+			merged[i] = true;
+			if (cluster_of) (*cluster_of)[i] = combined->size();
+		}
+
+		// combine all members of the cluster
+		float inv = 1.0f / nHairs;
+		Hair accum;
+		accum.resize(cmp_hair.cps.size(), 0.0f);
+		size_t size = accum.size();
+		for (size_t i = 0; i < nHairs; i++)
+		{
+			const Hair &h = hairss[cluster[i]];
+			for (size_t k = 0; k < size; k++)
+			{
+				//average cp
+				accum.cps[k] = accum.cps[k] + h.cps[k] * inv;
+
+				//search for biggest distance radius for each cp
+				float d = std::max(distance(h.cps[k], cmp_hair.cps[k]), h.radii[k]);
+				accum.radii[k] = std::min(std::max(accum.radii[k], d), max_radius);
+			}
+		}
+
+		//coverage is the chance that a ray through the merged strand would
+		//have hit one of its members, each covering its share of the width
+		float merged_width = 0, transmit = 1;
+		for (size_t k = 0; k < size; k++) merged_width += accum.radii[k];
+		for (size_t i = 0; i < nHairs && merged_width > 0; i++)
+		{
+			const Hair &h = hairss[cluster[i]];
+			float width = 0;
+			for (size_t k = 0; k < size; k++) width += h.radii[k];
+			transmit *= 1 - h.coverage * std::min(1.0f, width / merged_width);
+		}
+		accum.coverage = merged_width > 0 ? 1 - transmit : 1.0f;
+
+		combined->push_back(std::move(accum));
+
+	} // combination loop
+}
+
 bool CyHair::ToCubicBezierCurves(std::vector<float> *vertices,
                                  std::vector<float> *radiuss,
+                                 std::vector<int> *strand_segments,
                                  const float vertex_scale[3],
                                  const float vertex_translate[3],
-                                 const int max_strands, const float user_thickness, const int lod_level) {
-  if (points_.empty() || strand_offsets_.empty()) {
-    return false;
-  }
-
+                                 const int max_strands, const float user_thickness,
+                                 const int lod_levels, std::vector<HairLODLevel> *lods) {
   vertices->clear();
   radiuss->clear();
+  strand_segments->clear();
 
-  int num_strands = static_cast<int>(num_strands_);
+  int num_strands = static_cast<int>(loaded_strands_.size());
 
   if ((max_strands > 0) && (max_strands < num_strands)) {
     num_strands = max_strands;
@@ -301,29 +580,48 @@ bool CyHair::ToCubicBezierCurves(std::vector<float> *vertices,
 
 	std::unordered_map<int, std::vector<Hair>> hairs;
 
-  std::cout << "[Hair] Convert first " << num_strands << " strands from "
-            << max_strands << " strands in the original hair data."
-            << std::endl;
+  if (verbose_)
+    std::cout << "[Hair] Convert first " << num_strands << " strands from "
+              << max_strands << " strands in the original hair data."
+              << std::endl;
+
+	// Lay out the output serially so that strands can be converted in
+	// parallel into fixed slots, which keeps the result independent of the
+	// thread count. Both endpoints are skipped, so a strand needs at least
+	// three points to produce a Bezier segment.
+	std::vector<size_t> first_segment(num_strands + 1, 0);
+	std::vector<Hair *> strand_hair(num_strands, nullptr);
+	for (int i = 0; i < num_strands; i++) {
+		int num_segments = NumSegments(loaded_strands_[i]);
+		int num_bezier = num_segments < 3 ? 0 : num_segments - 2;
+		first_segment[i + 1] = first_segment[i] + num_bezier;
+		if (num_bezier == 0) continue;
+		strand_segments->push_back(num_bezier);
+		if (lod_levels > 0) hairs[num_segments].push_back(Hair());
+	}
+	if (lod_levels > 0) {
+		std::unordered_map<int, size_t> next;
+		for (int i = 0; i < num_strands; i++) {
+			if (first_segment[i + 1] == first_segment[i]) continue;
+			int num_segments = NumSegments(loaded_strands_[i]);
+			strand_hair[i] = &hairs[num_segments][next[num_segments]++];
+		}
+	}
+	vertices->resize(12 * first_segment[num_strands]);
+	radiuss->resize(4 * first_segment[num_strands]);
+	const float thickness = user_thickness > 0 ? user_thickness : default_thickness_;
 
   // Assume input points are CatmullRom spline.
-  for (size_t i = 0; i < static_cast<size_t>(num_strands); i++) {
-    if ((i % 1000) == 0) {
-      std::cout << i << " / " << num_strands_ << std::endl;
-    }
-
-    int num_segments = segments_.empty() ? default_segments_ : segments_[i];
-    if (num_segments < 2) {
-      continue;
-    }
-
-		hairs[num_segments].push_back(Hair());
+	pbrt::ParallelFor([&](int64_t i) {
+    int num_segments = NumSegments(loaded_strands_[i]);
+    if (first_segment[i + 1] == first_segment[i]) return;
 
     std::vector<real3> segment_points;
     for (size_t k = 0; k < static_cast<size_t>(num_segments); k++) {
       // Zup -> Yup
-      real3 p(points_[3 * (strand_offsets_[i] + k) + 0],
-              points_[3 * (strand_offsets_[i] + k) + 2],
-              points_[3 * (strand_offsets_[i] + k) + 1]);
+      real3 p(points_[3 * (loaded_offsets_[i] + k) + 0],
+              points_[3 * (loaded_offsets_[i] + k) + 2],
+              points_[3 * (loaded_offsets_[i] + k) + 1]);
       segment_points.push_back(p);
     }
 
@@ -333,206 +631,118 @@ bool CyHair::ToCubicBezierCurves(std::vector<float> *vertices,
       real3 q[4];
       CamullRomToCubicBezier(q, segment_points.data(), num_segments, seg_idx);
 
-	    q[0].x = vertex_scale[0] * q[0].x + vertex_translate[0];
-	    q[0].y = vertex_scale[1] * q[0].y + vertex_translate[1];
-	    q[0].z = vertex_scale[2] * q[0].z + vertex_translate[2];
-	    q[1].x = vertex_scale[0] * q[1].x + vertex_translate[0];
-	    q[1].y = vertex_scale[1] * q[1].y + vertex_translate[1];
-	    q[1].z = vertex_scale[2] * q[1].z + vertex_translate[2];
-	    q[2].x = vertex_scale[0] * q[2].x + vertex_translate[0];
-	    q[2].y = vertex_scale[1] * q[2].y + vertex_translate[1];
-	    q[2].z = vertex_scale[2] * q[2].z + vertex_translate[2];
-	    q[3].x = vertex_scale[0] * q[3].x + vertex_translate[0];
-	    q[3].y = vertex_scale[1] * q[3].y + vertex_translate[1];
-	    q[3].z = vertex_scale[2] * q[3].z + vertex_translate[2];
-
-	    if(lod_level <= 0) {
-					vertices->push_back(q[0].x);
-					vertices->push_back(q[0].y);
-					vertices->push_back(q[0].z);
-					vertices->push_back(q[1].x);
-					vertices->push_back(q[1].y);
-					vertices->push_back(q[1].z);
-					vertices->push_back(q[2].x);
-					vertices->push_back(q[2].y);
-					vertices->push_back(q[2].z);
-					vertices->push_back(q[3].x);
-					vertices->push_back(q[3].y);
-					vertices->push_back(q[3].z);
-
-					//vertices->push_back(vertex_scale[0] * q[0].x + vertex_translate[0]);
-					//vertices->push_back(vertex_scale[1] * q[0].y + vertex_translate[1]);
-					//vertices->push_back(vertex_scale[2] * q[0].z + vertex_translate[2]);
-					//vertices->push_back(vertex_scale[0] * q[1].x + vertex_translate[0]);
-					//vertices->push_back(vertex_scale[1] * q[1].y + vertex_translate[1]);
-					//vertices->push_back(vertex_scale[2] * q[1].z + vertex_translate[2]);
-					//vertices->push_back(vertex_scale[0] * q[2].x + vertex_translate[0]);
-					//vertices->push_back(vertex_scale[1] * q[2].y + vertex_translate[1]);
-					//vertices->push_back(vertex_scale[2] * q[2].z + vertex_translate[2]);
-					//vertices->push_back(vertex_scale[0] * q[3].x + vertex_translate[0]);
-					//vertices->push_back(vertex_scale[1] * q[3].y + vertex_translate[1]);
-					//vertices->push_back(vertex_scale[2] * q[3].z + vertex_translate[2]);
-
-					if (user_thickness > 0) {
-						// Use user supplied thickness.
-						radiuss->push_back(user_thickness);
-						radiuss->push_back(user_thickness);
-						radiuss->push_back(user_thickness);
-						radiuss->push_back(user_thickness);
-					} else {
-						// TODO(syoyo) Support per point/segment thickness
-						radiuss->push_back(default_thickness_);
-						radiuss->push_back(default_thickness_);
-						radiuss->push_back(default_thickness_);
-						radiuss->push_back(default_thickness_);
-					}
-			}
-	    else {
-				hairs[num_segments].back().cps.push_back(q[0]);
-				hairs[num_segments].back().cps.push_back(q[1]);
-				hairs[num_segments].back().cps.push_back(q[2]);
-				hairs[num_segments].back().cps.push_back(q[3]);
-
-				//Union(hairs[i].bounds, q[0]);
-				//Union(hairs[i].bounds, q[1]);
-				//Union(hairs[i].bounds, q[2]);
-				//Union(hairs[i].bounds, q[3]);
-	    }
+      size_t out = first_segment[i] + seg_idx;
+      for (int j = 0; j < 4; j++) {
+        q[j].x = vertex_scale[0] * q[j].x + vertex_translate[0];
+        q[j].y = vertex_scale[1] * q[j].y + vertex_translate[1];
+        q[j].z = vertex_scale[2] * q[j].z + vertex_translate[2];
+
+        // Full resolution curves are LOD level 0 and always emitted.
+        (*vertices)[12 * out + 3 * j + 0] = q[j].x;
+        (*vertices)[12 * out + 3 * j + 1] = q[j].y;
+        (*vertices)[12 * out + 3 * j + 2] = q[j].z;
+        // TODO(syoyo) Support per point/segment thickness
+        (*radiuss)[4 * out + j] = thickness;
+      }
+
+      if (Hair *h = strand_hair[i]) {
+        for (int j = 0; j < 4; j++) {
+          h->cps.push_back(q[j]);
+          h->radii.push_back(thickness);
+        }
+      }
     }
-  }
-
-
-	//LOD hair combination
-  if (lod_level > 0) {
-	  std::cout << "begin LOD with " << hairs.size() << " hairs.\n";
-
-		const float MAX_HAIR_RADIUS = 2.0f; //TODO: user defined input for radius in lod levels
-		const float MAX_DISTANCE = MAX_HAIR_RADIUS * 2.0f;
-
-		size_t count = 0;
-		Hair cmp_hair;
-		std::vector<Hair> combined;
-
-		//Sort by number of CPs
-		auto sortBySegments = [](const Hair& h1, const Hair& h2) {
-				return h1.cps.size() < h2.cps.size();
-		};
-
-		//Sort by distance of hair root CPs
-		auto sortByRootPointDistance = [&cmp_hair](const Hair& h1, const Hair& h2) {
-				return distance(cmp_hair.cps[0], h1.cps[0]) < distance(cmp_hair.cps[0], h2.cps[0]);
-		};
+  }, num_strands, 64);
+
+
+	//LOD pyramid: every level merges the strands of the previous one, so
+	//the clustering work of a level is never repeated for coarser ones
+	if (lod_levels > 0) {
+		if (verbose_) std::cout << "begin LOD with " << hairs.size() << " hair buckets.\n";
+
+		//for the error measurement, the full resolution strands are kept
+		//together with the index of the strand they were merged into
+		std::unordered_map<int, std::vector<Hair>> source;
+		std::unordered_map<int, std::vector<size_t>> source_rep;
+		if (lod_error_) {
+			source = hairs;
+			for (auto &p : source) {
+				std::vector<size_t> &rep = source_rep[p.first];
+				for (size_t i = 0; i < p.second.size(); i++) rep.push_back(i);
+			}
+		}
 
-		//Sort by distance of hair start and end CPs
-		auto sortByStartAndEndPointDistance = [&cmp_hair] (const Hair& h1, const Hair& h2)
-		{
-		float rd1 = distance(h1.cps[0], cmp_hair.cps[0]);
-		float ed1 = distance(h1.cps.back(), cmp_hair.cps.back());
-
-		float rd2 = distance(h2.cps[0], cmp_hair.cps[0]);
-		float ed2 = distance(h2.cps.back(), cmp_hair.cps.back());
-
-		return rd1 + ed1 < rd2 + ed2;
-		};
-
-		//Sort by distance of sample CPs (matching indices) of hair
-		auto sortBySamplePointDistance = [&cmp_hair](const Hair& h1, const Hair& h2) -> bool {					
-				int nSamples = 2;
-				int m = std::min(h1.cps.size(), std::min(h2.cps.size(), cmp_hair.cps.size()));
-				nSamples = std::min(m / 4, nSamples);
-
-				boost::random::mt19937 rng;
-				boost::random::uniform_int_distribution<> range(0, m - 1);
-
-				float d1 = 0;
-				float d2 = 0;
-				for (size_t i = 0; i < nSamples; i++)
-				{
-						size_t index = range(rng);
-						d1 += distance(h1.cps[index], cmp_hair.cps[index]);
-						d2 += distance(h2.cps[index], cmp_hair.cps[index]);
+		float max_distance = LOD_BASE_DISTANCE;
+		for (int level = 1; level <= lod_levels; level++) {
+				std::unordered_map<int, std::vector<Hair>> merged;
+				HairLODLevel lod;
+				lod.level = level;
+				lod.cluster_radius = max_distance;
+				lod.num_strands = 0;
+
+				// Buckets are merged independently in parallel and then
+				// appended in the map's iteration order, as before.
+				std::vector<std::pair<const std::vector<Hair> *, std::vector<Hair> *>> buckets;
+				std::vector<int> bucket_keys;
+				for (auto &p : hairs) {
+						buckets.push_back(std::make_pair(&p.second, &merged[p.first]));
+						bucket_keys.push_back(p.first);
+				}
+				std::vector<std::vector<size_t>> cluster_of(buckets.size());
+				pbrt::ParallelFor([&](int64_t b) {
+						CombineHairs(*buckets[b].first, max_distance, max_distance,
+						             lod_strategy_, buckets[b].second,
+						             lod_error_ ? &cluster_of[b] : nullptr);
+				}, static_cast<int64_t>(buckets.size()));
+
+				if (lod_error_) {
+						double sum = 0;
+						size_t count = 0;
+						for (size_t b = 0; b < buckets.size(); b++) {
+								const std::vector<Hair> &src = source[bucket_keys[b]];
+								std::vector<size_t> &rep = source_rep[bucket_keys[b]];
+								for (size_t i = 0; i < src.size(); i++) {
+										rep[i] = cluster_of[b][rep[i]];
+										const Hair &h = (*buckets[b].second)[rep[i]];
+										for (size_t j = 0; j < src[i].cps.size(); j++) {
+												float d = distance(src[i].cps[j], h.cps[j]);
+												sum += d;
+												lod.max_error = std::max(lod.max_error, d);
+										}
+										count += src[i].cps.size();
+								}
+						}
+						lod.mean_error = count > 0 ? static_cast<float>(sum / count) : 0;
 				}
 
-				return d1 < d2;
-		};
-
-		for(auto p : hairs) {
-				std::cout << "combine hairs with " << p.first << " segments.\n";
-				auto hairss = p.second;
-				//start combination loop
-				while (count < hairss.size())
-				{
-					Bounds3f rootBounds;
-					int axis = 0;
-					size_t min_ind = count;
-
-					//build bb of hairs' root points and find longest axis
-					size_t c = count;
-					std::for_each(hairss.begin() + count, hairss.end(), [&c, &hairss, &rootBounds](const Hair& h) { rootBounds = Union(rootBounds, hairss[c].cps[0]); c++; });
-					axis = rootBounds.MaximumExtent();
-
-					//find point with minimum value along axis
-					c = count;
-					std::for_each(hairss.begin() + count, hairss.end(), [&c, &hairss, &axis, &min_ind](const Hair& h) { if (h.cps[0][axis] < hairss[min_ind].cps[0][axis]) min_ind = c;  c++; });
-					cmp_hair = hairss[min_ind];
-
-					//sortByRootPointDistance, sortByStartAndEndPointDistance, sortBySamplePointDistance
-					std::sort(hairss.begin() + count, hairss.end(), sortBySamplePointDistance);
-
-					//count how many hairs to combine
-					int nHairs = 1;
-					float rootDist = 0;
-					while (true) {
-						int i = count + nHairs;
-						if (i == hairss.size() - 1) break;
-				
-						rootDist = distance(cmp_hair.cps[0], hairss[i].cps[0]);
-						if (rootDist >= MAX_DISTANCE) break;
-
-						nHairs++;
-					}
-
-					// combine from count to cmp_ind + nHairs			
-					float inv = 1.0f / nHairs;
-					Hair accum;
-					accum.resize(cmp_hair.size(), user_thickness);
-					size_t size = accum.size();
-					for (size_t i = count; i < count + nHairs; i++)
-					{
-						for (size_t k = 0; k < size; k++)
+				for (auto &bucket : buckets) {
+						std::vector<Hair> &combined = *bucket.second;
+						lod.num_strands += combined.size();
+						for (Hair &h : combined)
 						{
-								//average cp
-								accum.cps[k] = accum.cps[k] + hairss[i].cps[k] * inv;
-
-								//search for biggest distance radius for each cp
-								float d = distance(hairss[i].cps[k], hairss[count].cps[k]);
-								accum.radii[k] = std::min(std::max(accum.radii[k], d), MAX_HAIR_RADIUS * 2);
+							lod.strand_segments.push_back(static_cast<int>(h.size() / 4));
+							lod.coverages.push_back(h.coverage);
+							for (size_t j = 0; j < h.size(); j++)
+							{
+								lod.vertices.push_back(h.cps[j].x);
+								lod.vertices.push_back(h.cps[j].y);
+								lod.vertices.push_back(h.cps[j].z);
+
+								lod.radiuss.push_back(h.radii[j]);
+							}
 						}
-					}
-		
-					combined.push_back(std::move(accum));
-					count += nHairs;
-			
-				} // combination loop
-		}
-
-		std::cout << "end LOD, combined hair to " << combined.size() << " hairs.\n";
-		std::cout << "move combined hair to vertices array \n";
+				}
 
-		for (size_t i = 0; i < combined.size(); i++)
-		{
-			for (size_t j = 0; j < combined[i].size(); j++)
-			{
-				vertices->push_back(combined[i].cps[j].x);
-				vertices->push_back(combined[i].cps[j].y);
-				vertices->push_back(combined[i].cps[j].z);
+				if (verbose_)
+						std::cout << "LOD level " << level << ": " << lod.num_strands
+								<< " strands, cluster radius " << max_distance << "\n";
+				if (lods) lods->push_back(std::move(lod));
 
-				radiuss->push_back(combined[i].radii[j]);
-			}
+				hairs.swap(merged);
+				max_distance *= LOD_DISTANCE_SCALE;
 		}
-
-		std::cout << "move complete \n";
-  } // lod
+		if (verbose_) std::cout << "end LOD\n";
+	} // lod
 
   return true;
 }
@@ -549,27 +759,722 @@ bool CyHair::ToCubicBezierCurves(std::vector<float> *vertices,
 #include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "shapes/hairfile.h"
+
+#ifdef _MSC_VER
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#include <stdlib.h>
+#else
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Converts curves with four control points per segment to the "hairmesh"
+// layout, where consecutive segments of a strand share their end points
+// and strand_offsets holds the first control point of each strand.
+static void CompactStrands(const std::vector<float> &points,
+                           const std::vector<float> &radiuss,
+                           const std::vector<int> &strand_segments,
+                           std::vector<float> *P, std::vector<float> *widths,
+                           std::vector<int32_t> *strand_offsets) {
+    size_t cp = 0;
+    strand_offsets->push_back(0);
+    for (int num_segments : strand_segments) {
+        for (int s = 0; s < num_segments; s++, cp += 4)
+            for (size_t j = (s == 0) ? 0 : 1; j < 4; j++) {
+                P->insert(P->end(), &points[3 * (cp + j)],
+                          &points[3 * (cp + j)] + 3);
+                widths->push_back(radiuss[cp + j]);
+            }
+        strand_offsets->push_back(static_cast<int32_t>(widths->size()));
+    }
+}
+
+// Appends the contents of the temporary file _src_ to _dst_.
+static bool AppendFile(FILE *dst, FILE *src) {
+    char buf[1 << 16];
+    rewind(src);
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), src)) > 0)
+        if (fwrite(buf, 1, n, dst) != n) return false;
+    return !ferror(src);
+}
+
+// Opens a temporary file for one section of the output; it is deleted when
+// closed.
+static FILE *OpenSection(FILE **f) {
+    if (!*f && !(*f = tmpfile())) perror("tmpfile");
+    return *f;
+}
+
+// Writes curves as a single "hairmesh" shape. Strands are added chunk by
+// chunk and their sections are kept in temporary files, so memory use only
+// depends on the chunk size. If binary_filename is given, the strands are
+// streamed to that file in the binary format of shapes/hairfile.h and the
+// shape refers to it by its name relative to the pbrt file.
+class HairMeshWriter {
+  public:
+    explicit HairMeshWriter(const std::string &binary_filename)
+        : binaryFilename(binary_filename) {
+        bounds[0][0] = bounds[0][1] = bounds[0][2] = 1e30;
+        bounds[1][0] = bounds[1][1] = bounds[1][2] = -1e30;
+    }
+    ~HairMeshWriter() {
+        for (FILE *f : {binaryFile, segmentsFile, pointsFile, widthsFile,
+                        offsetsFile, coverageFile})
+            if (f) fclose(f);
+    }
+    // The optional _coverages_ give the coverage of each strand; they must
+    // be given either for all or for none of the added strands.
+    bool Add(const std::vector<float> &points,
+             const std::vector<float> &radiuss,
+             const std::vector<int> &strand_segments,
+             const std::vector<float> *coverages = nullptr);
+    // Writes the shape to _f_, preceded by comments with the source file
+    // name and the bounds of all strands.
+    bool Finish(FILE *f, const char *source, float user_thickness);
+    size_t NumStrands() const { return nStrands; }
+    size_t NumSegments() const { return nSegments; }
+
+  private:
+    bool Begin();
+
+    const std::string binaryFilename;
+    double bounds[2][3];
+    size_t nStrands = 0, nSegments = 0, nControlPoints = 0;
+    // Binary output streams P to the hair file and widths and offsets to
+    // temporary files; text output uses temporary files for all sections.
+    FILE *binaryFile = nullptr, *segmentsFile = nullptr, *pointsFile = nullptr,
+         *widthsFile = nullptr, *offsetsFile = nullptr, *coverageFile = nullptr;
+};
+
+bool HairMeshWriter::Begin() {
+    if (binaryFilename.empty())
+        return OpenSection(&segmentsFile) && OpenSection(&pointsFile) &&
+               OpenSection(&widthsFile);
+    if (binaryFile) return true;
+    binaryFile = fopen(binaryFilename.c_str(), "wb");
+    if (!binaryFile) {
+        perror(binaryFilename.c_str());
+        return false;
+    }
+    // The header is rewritten with the final counts by Finish().
+    pbrt::HairFileHeader header;
+    memset(&header, 0, sizeof(header));
+    int32_t first = 0;
+    return fwrite(&header, sizeof(header), 1, binaryFile) == 1 &&
+           OpenSection(&widthsFile) && OpenSection(&offsetsFile) &&
+           fwrite(&first, sizeof(first), 1, offsetsFile) == 1;
+}
+
+bool HairMeshWriter::Add(const std::vector<float> &points,
+                         const std::vector<float> &radiuss,
+                         const std::vector<int> &strand_segments,
+                         const std::vector<float> *coverages) {
+    if (!Begin()) return false;
+    if (coverages) {
+        if (!OpenSection(&coverageFile)) return false;
+        if (binaryFile)
+            fwrite(coverages->data(), sizeof(float), coverages->size(),
+                   coverageFile);
+        else
+            for (size_t i = 0; i < coverages->size(); i++)
+                fprintf(coverageFile, "%f%c",
+                        static_cast<double>((*coverages)[i]),
+                        ((nStrands + i) % 16 == 15) ? '\n' : ' ');
+        if (ferror(coverageFile)) {
+            perror("tmpfile");
+            return false;
+        }
+    }
+    for (size_t i = 0; i < points.size() / 3; ++i) {
+        const double thickness = static_cast<double>(radiuss[i]);
+        for (size_t c = 0; c < 3; ++c) {
+            bounds[0][c] =
+                std::min(bounds[0][c],
+                         static_cast<double>(points[3 * i + c]) - thickness);
+            bounds[1][c] =
+                std::max(bounds[1][c],
+                         static_cast<double>(points[3 * i + c]) + thickness);
+        }
+    }
+
+    std::vector<float> P, widths;
+    std::vector<int32_t> strand_offsets;
+    CompactStrands(points, radiuss, strand_segments, &P, &widths,
+                   &strand_offsets);
+
+    bool ok = true;
+    if (binaryFile) {
+        for (int32_t &offset : strand_offsets)
+            offset += static_cast<int32_t>(nControlPoints);
+        ok = fwrite(P.data(), sizeof(float), P.size(), binaryFile) ==
+                 P.size() &&
+             fwrite(widths.data(), sizeof(float), widths.size(),
+                    widthsFile) == widths.size() &&
+             fwrite(strand_offsets.data() + 1, sizeof(int32_t),
+                    strand_offsets.size() - 1,
+                    offsetsFile) == strand_offsets.size() - 1;
+    } else {
+        for (size_t i = 0; i < strand_segments.size(); i++)
+            fprintf(segmentsFile, "%d%c", strand_segments[i],
+                    ((nStrands + i) % 32 == 31) ? '\n' : ' ');
+        for (size_t i = 0; i + 1 < strand_offsets.size(); i++) {
+            for (int32_t j = strand_offsets[i]; j < strand_offsets[i + 1]; j++)
+                fprintf(pointsFile, "%f %f %f ", static_cast<double>(P[3 * j]),
+                        static_cast<double>(P[3 * j + 1]),
+                        static_cast<double>(P[3 * j + 2]));
+            fprintf(pointsFile, "\n");
+        }
+        for (size_t i = 0; i + 1 < strand_offsets.size(); i++) {
+            for (int32_t j = strand_offsets[i]; j < strand_offsets[i + 1]; j++)
+                fprintf(widthsFile, "%f ", static_cast<double>(widths[j]));
+            fprintf(widthsFile, "\n");
+        }
+        ok = !ferror(segmentsFile) && !ferror(pointsFile) && !ferror(widthsFile);
+    }
+    if (!ok) perror(binaryFile ? binaryFilename.c_str() : "tmpfile");
+
+    nStrands += strand_segments.size();
+    nSegments += radiuss.size() / 4;
+    nControlPoints += widths.size();
+    return ok;
+}
+
+bool HairMeshWriter::Finish(FILE *f, const char *source,
+                            float user_thickness) {
+    if (!Begin()) return false;
+    fprintf(f, "# Converted from \"%s\" by cyhair2pbrt\n", source);
+    fprintf(f, "# The number of strands = %d. user_thickness = %f\n",
+            static_cast<int>(nStrands), static_cast<double>(user_thickness));
+    fprintf(f, "# Scene bounds: (%f, %f, %f) - (%f, %f, %f)\n\n\n",
+            bounds[0][0], bounds[0][1], bounds[0][2], bounds[1][0],
+            bounds[1][1], bounds[1][2]);
+    fprintf(f, "Shape \"hairmesh\" \"string type\" [ \"cylinder\" ]\n");
+
+    if (binaryFile) {
+        pbrt::HairFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, pbrt::HairFileMagic, sizeof(header.magic));
+        header.version = pbrt::HairFileVersion;
+        header.nStrands = static_cast<uint32_t>(nStrands);
+        header.nControlPoints = static_cast<uint32_t>(nControlPoints);
+        if (coverageFile) header.flags |= pbrt::HairFileHasCoverage;
+        bool ok = AppendFile(binaryFile, widthsFile) &&
+                  AppendFile(binaryFile, offsetsFile) &&
+                  (!coverageFile || AppendFile(binaryFile, coverageFile)) &&
+                  fseek(binaryFile, 0, SEEK_SET) == 0 &&
+                  fwrite(&header, sizeof(header), 1, binaryFile) == 1;
+        if (fclose(binaryFile) != 0) ok = false;
+        binaryFile = nullptr;
+        if (!ok) {
+            perror(binaryFilename.c_str());
+            return false;
+        }
+        size_t slash = binaryFilename.find_last_of("/\\");
+        fprintf(f, "  \"string filename\" [ \"%s\" ]\n",
+                binaryFilename.substr(slash == std::string::npos ? 0 : slash + 1)
+                    .c_str());
+        return true;
+    }
+
+    fprintf(f, "  \"integer strandsegments\" [\n");
+    bool ok = AppendFile(f, segmentsFile);
+    fprintf(f, "\n  ]\n  \"point P\" [\n");
+    ok = ok && AppendFile(f, pointsFile);
+    fprintf(f, "  ]\n  \"float widths\" [\n");
+    ok = ok && AppendFile(f, widthsFile);
+    fprintf(f, "  ]\n");
+    if (coverageFile) {
+        fprintf(f, "  \"float coverage\" [\n");
+        ok = ok && AppendFile(f, coverageFile);
+        fprintf(f, "\n  ]\n");
+    }
+    if (!ok) perror("tmpfile");
+    return ok;
+}
+
+// Writes all levels (full resolution first) as a single "hairlod" shape,
+// which lets pbrt pick a level from the camera distance at load time. Like
+// _HairMeshWriter_, levels are added in chunks and buffered in temporary
+// files.
+class HairLODWriter {
+  public:
+    explicit HairLODWriter(int lod_levels)
+        : levels(lod_levels + 1) {}
+    ~HairLODWriter() {
+        for (Level &l : levels) {
+            if (l.pointsFile) fclose(l.pointsFile);
+            if (l.widthsFile) fclose(l.widthsFile);
+            if (l.coverageFile) fclose(l.coverageFile);
+        }
+    }
+    // _coverages_ and _strand_segments_ give the coverage of each strand
+    // and its number of segments; without them, strands are opaque.
+    bool Add(int level, float cluster_radius, const std::vector<float> &points,
+             const std::vector<float> &radiuss,
+             const std::vector<float> *coverages = nullptr,
+             const std::vector<int> *strand_segments = nullptr);
+    bool Finish(FILE *f, const char *source);
+
+  private:
+    struct Level {
+        float radius = 0;
+        size_t nSegments = 0;
+        FILE *pointsFile = nullptr, *widthsFile = nullptr,
+             *coverageFile = nullptr;
+    };
+    std::vector<Level> levels;
+};
+
+bool HairLODWriter::Add(int level, float cluster_radius,
+                        const std::vector<float> &points,
+                        const std::vector<float> &radiuss,
+                        const std::vector<float> *coverages,
+                        const std::vector<int> *strand_segments) {
+    Level &l = levels[level];
+    if (!OpenSection(&l.pointsFile) || !OpenSection(&l.widthsFile) ||
+        !OpenSection(&l.coverageFile))
+        return false;
+    // The segments of "hairlod" shapes are independent, so each one
+    // repeats the coverage of its strand
+    if (coverages && strand_segments) {
+        for (size_t i = 0; i < coverages->size(); i++)
+            for (int s = 0; s < (*strand_segments)[i]; s++)
+                fprintf(l.coverageFile, "%f ",
+                        static_cast<double>((*coverages)[i]));
+    } else {
+        for (size_t i = 0; i < radiuss.size() / 4; i++)
+            fprintf(l.coverageFile, "1 ");
+    }
+    l.radius = cluster_radius;
+    l.nSegments += radiuss.size() / 4;
+    for (size_t i = 0; i < points.size(); i += 12) {
+        for (size_t j = 0; j < 12; j++)
+            fprintf(l.pointsFile, "%f ", static_cast<double>(points[i + j]));
+        fprintf(l.pointsFile, "\n");
+    }
+    for (float radius : radiuss)
+        fprintf(l.widthsFile, "%f ", static_cast<double>(radius));
+    return !ferror(l.pointsFile) && !ferror(l.widthsFile) &&
+           !ferror(l.coverageFile);
+}
+
+bool HairLODWriter::Finish(FILE *f, const char *source) {
+    fprintf(f, "# Converted from \"%s\" by cyhair2pbrt\n", source);
+    fprintf(f, "Shape \"hairlod\" \"string type\" [ \"cylinder\" ]\n");
+    fprintf(f, "  \"integer levelsegments\" [ ");
+    for (const Level &l : levels)
+        fprintf(f, "%d ", static_cast<int>(l.nSegments));
+    fprintf(f, "]\n  \"float levelradius\" [ ");
+    for (const Level &l : levels)
+        fprintf(f, "%f ", static_cast<double>(l.radius));
+    fprintf(f, "]\n  \"point P\" [\n");
+    bool ok = true;
+    for (const Level &l : levels)
+        if (l.pointsFile) ok = ok && AppendFile(f, l.pointsFile);
+    fprintf(f, "  ]\n  \"float widths\" [\n");
+    for (const Level &l : levels) {
+        if (l.widthsFile) ok = ok && AppendFile(f, l.widthsFile);
+        fprintf(f, "\n");
+    }
+    fprintf(f, "  ]\n  \"float coverage\" [\n");
+    for (const Level &l : levels) {
+        if (l.coverageFile) ok = ok && AppendFile(f, l.coverageFile);
+        fprintf(f, "\n");
+    }
+    fprintf(f, "  ]\n");
+    if (!ok) perror("tmpfile");
+    return ok;
+}
+
+// Returns the strands 0..roots.size()/3-1 sorted by the Morton code of
+// their root position, so that consecutive chunks of the result are
+// spatially coherent.
+static std::vector<unsigned int> SpatialStrandOrder(
+    const std::vector<float> &roots) {
+    auto leftShift3 = [](uint32_t x) {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    };
+    size_t n = roots.size() / 3;
+    float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+    for (size_t i = 0; i < n; i++)
+        for (int c = 0; c < 3; c++) {
+            lo[c] = std::min(lo[c], roots[3 * i + c]);
+            hi[c] = std::max(hi[c], roots[3 * i + c]);
+        }
+    std::vector<std::pair<uint32_t, unsigned int>> codes(n);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t q[3];
+        for (int c = 0; c < 3; c++) {
+            float extent = hi[c] - lo[c];
+            float t = extent > 0 ? (roots[3 * i + c] - lo[c]) / extent : 0;
+            q[c] = std::min(1023u, static_cast<uint32_t>(t * 1024));
+        }
+        codes[i] = std::make_pair((leftShift3(q[2]) << 2) |
+                                      (leftShift3(q[1]) << 1) |
+                                      leftShift3(q[0]),
+                                  static_cast<unsigned int>(i));
+    }
+    std::sort(codes.begin(), codes.end());
+    std::vector<unsigned int> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = codes[i].second;
+    return order;
+}
+
+// Returns the index of the cyhair::LODStrategy called `name`, or -1.
+static int ParseLODStrategy(const char *name) {
+    for (int i = 0; i < 4; i++)
+        if (strcmp(name, cyhair::LODStrategyNames[i]) == 0) return i;
+    return -1;
+}
+
+// Builds the LOD levels of the strands read by _hair_ with each strategy
+// (or only _strategy_ if it is not negative) and prints the conversion
+// time, the strand counts and the error of each level.
+static void BenchmarkLODStrategies(cyhair::CyHair *hair, int lod_levels,
+                                   float user_thickness, int strategy) {
+    const float vertex_scale[3] = {1.0f, 1.0f, 1.0f};
+    const float vertex_translate[3] = {0.0f, 0.0f, 0.0f};
+    std::vector<float> points, radiuss;
+    std::vector<int> strand_segments;
+    hair->verbose_ = false;
+    hair->lod_error_ = true;
+
+    printf("%-9s %5s %9s %9s %10s %10s %10s\n", "strategy", "level",
+           "strands", "segments", "time (s)", "mean err", "max err");
+    for (int s = 0; s < 4; s++) {
+        if (strategy >= 0 && s != strategy) continue;
+        hair->lod_strategy_ = static_cast<cyhair::LODStrategy>(s);
+        std::vector<cyhair::HairLODLevel> lods;
+        auto start = std::chrono::steady_clock::now();
+        hair->ToCubicBezierCurves(&points, &radiuss, &strand_segments,
+                                  vertex_scale, vertex_translate, -1,
+                                  user_thickness, lod_levels, &lods);
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        printf("%-9s %5d %9d %9d %10.3f %10s %10s\n",
+               cyhair::LODStrategyNames[s], 0,
+               static_cast<int>(strand_segments.size()),
+               static_cast<int>(radiuss.size() / 4), seconds, "-", "-");
+        for (const cyhair::HairLODLevel &lod : lods)
+            printf("%-9s %5d %9d %9d %10s %10f %10f\n",
+                   cyhair::LODStrategyNames[s], lod.level,
+                   static_cast<int>(lod.num_strands),
+                   static_cast<int>(lod.radiuss.size() / 4), "",
+                   static_cast<double>(lod.mean_error),
+                   static_cast<double>(lod.max_error));
+    }
+}
+
+// Returns the position of the extension's '.' in filename, or its length
+// if it has no extension.
+static size_t ExtensionStart(const std::string &filename) {
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of("/\\");
+    if (dot == std::string::npos ||
+        (slash != std::string::npos && dot < slash))
+        return filename.size();
+    return dot;
+}
+
+// Returns "<stem><suffix><extension>" for the given output filename.
+static std::string SiblingFilename(const std::string &filename,
+                                   const std::string &suffix) {
+    size_t dot = ExtensionStart(filename);
+    return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+// Returns the name of the binary hair file written next to a pbrt file.
+static std::string BinaryFilename(const std::string &filename) {
+    return filename.substr(0, ExtensionStart(filename)) + ".pbrthair";
+}
+
+// Conversion cache. An entry is a directory named after a hash of the
+// CyHair file's contents and all options that affect the output; it holds
+// the files written for the output name "hair.pbrt". Entries are written
+// to a temporary directory that is renamed once complete, so concurrent
+// conversions of the same groom never see partial entries.
+
+// Bump when the output format changes, which invalidates all entries.
+static const char *const CacheVersion = "cyhair2pbrt-cache-2";
+
+static uint64_t HashBytes(uint64_t h, const void *data, size_t n) {
+    // 64-bit FNV-1a
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// Returns the hash of the file's contents combined with _options_, or
+// false if it can't be read.
+static bool HashFile(const char *filename, const std::string &options,
+                     uint64_t *hash) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+    uint64_t h = HashBytes(0xcbf29ce484222325ull, CacheVersion,
+                           strlen(CacheVersion) + 1);
+    h = HashBytes(h, options.data(), options.size() + 1);
+    std::unique_ptr<char[]> buf(new char[1 << 20]);
+    size_t n;
+    while ((n = fread(buf.get(), 1, 1 << 20, f)) > 0)
+        h = HashBytes(h, buf.get(), n);
+    bool ok = !ferror(f);
+    if (!ok) perror(filename);
+    fclose(f);
+    *hash = h;
+    return ok;
+}
+
+static bool IsDirectory(const std::string &path) {
+#ifdef _MSC_VER
+    struct _stat64 s;
+    return _stat64(path.c_str(), &s) == 0 && (s.st_mode & _S_IFDIR);
+#else
+    struct stat s;
+    return stat(path.c_str(), &s) == 0 && S_ISDIR(s.st_mode);
+#endif
+}
+
+// Creates the directory unless it exists.
+static bool MakeDirectory(const std::string &path) {
+#ifdef _MSC_VER
+    bool ok = _mkdir(path.c_str()) == 0;
+#else
+    bool ok = mkdir(path.c_str(), 0777) == 0;
+#endif
+    if (ok || IsDirectory(path)) return true;
+    perror(path.c_str());
+    return false;
+}
+
+// Removes the directory with everything in it; symbolic links are removed
+// but not followed.
+static void RemoveDirectory(const std::string &path) {
+#ifdef _MSC_VER
+    struct _finddata_t entry;
+    intptr_t handle = _findfirst((path + "/*").c_str(), &entry);
+    if (handle != -1) {
+        do {
+            std::string name = entry.name;
+            if (name == "." || name == "..") continue;
+            std::string child = path + "/" + name;
+            if (entry.attrib & _A_SUBDIR)
+                RemoveDirectory(child);
+            else
+                remove(child.c_str());
+        } while (_findnext(handle, &entry) == 0);
+        _findclose(handle);
+    }
+    _rmdir(path.c_str());
+#else
+    if (DIR *dir = opendir(path.c_str())) {
+        while (struct dirent *entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name == "." || name == "..") continue;
+            std::string child = path + "/" + name;
+            struct stat s;
+            if (lstat(child.c_str(), &s) == 0 && S_ISDIR(s.st_mode))
+                RemoveDirectory(child);
+            else
+                remove(child.c_str());
+        }
+        closedir(dir);
+    }
+    rmdir(path.c_str());
+#endif
+}
+
+// Removes a temporary cache entry when it goes out of scope, unless it
+// has been renamed into place; see main().
+struct TemporaryDirectory {
+    ~TemporaryDirectory() {
+        if (!path.empty() && IsDirectory(path)) RemoveDirectory(path);
+    }
+    std::string path;
+};
+
+static std::string AbsolutePath(const std::string &path) {
+#ifdef _MSC_VER
+    char buf[_MAX_PATH];
+    return _fullpath(buf, path.c_str(), sizeof(buf)) ? buf : path;
+#else
+    char buf[PATH_MAX];
+    return realpath(path.c_str(), buf) ? buf : path;
+#endif
+}
+
+static int ProcessId() {
+#ifdef _MSC_VER
+    return _getpid();
+#else
+    return static_cast<int>(getpid());
+#endif
+}
+
+// Copies a pbrt file of a cache entry to _dst_. Binary hair files stay in
+// the entry, so references to them are made absolute and pbrt maps them
+// straight from the cache.
+static bool CopyFromCache(const std::string &entry, const std::string &name,
+                          const std::string &dst, bool binary) {
+    std::string src = entry + "/" + name;
+    FILE *in = fopen(src.c_str(), "rb");
+    if (!in) {
+        perror(src.c_str());
+        return false;
+    }
+    FILE *out = fopen(dst.c_str(), "wb");
+    if (!out) {
+        perror(dst.c_str());
+        fclose(in);
+        return false;
+    }
+    bool ok;
+    if (!binary) {
+        ok = AppendFile(out, in);
+    } else {
+        // Pbrt files of binary output are just a few lines long
+        std::string text;
+        char buf[1 << 16];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) text.append(buf, n);
+        const std::string key = "\"string filename\" [ \"";
+        size_t start = text.find(key);
+        if (start != std::string::npos)
+            text.insert(start + key.size(), AbsolutePath(entry) + "/");
+        ok = !ferror(in) &&
+             fwrite(text.data(), 1, text.size(), out) == text.size();
+    }
+    if (fclose(out) != 0) ok = false;
+    fclose(in);
+    if (!ok) perror(dst.c_str());
+    return ok;
+}
+
+// Writes the outputs for _output_ from a complete cache entry.
+static bool CopyCacheEntry(const std::string &entry, const std::string &output,
+                           int lod_levels, bool binary) {
+    bool ok = CopyFromCache(entry, "hair.pbrt", output, binary);
+    for (int level = 1; level <= lod_levels && ok; level++) {
+        std::string suffix = "_lod" + std::to_string(level);
+        ok = CopyFromCache(entry, "hair" + suffix + ".pbrt",
+                           SiblingFilename(output, suffix), binary);
+    }
+    if (lod_levels > 0 && ok)
+        ok = CopyFromCache(entry, "hair_hairlod.pbrt",
+                           SiblingFilename(output, "_hairlod"), false);
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
+    bool binary = false, benchmark = false;
+    int chunk_strands = 0;  // 0 = convert all strands at once
+    int lod_strategy = -1;  // -1 = default, or all with --benchmark
+    std::string cache_dir;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0 &&
+           strcmp(argv[1], "--help") != 0) {
+        if (strcmp(argv[1], "--binary") == 0) {
+            binary = true;
+        } else if (strcmp(argv[1], "--nthreads") == 0 && argc > 2) {
+            pbrt::PbrtOptions.nThreads = std::max(0, atoi(argv[2]));
+            --argc;
+            ++argv;
+        } else if (strcmp(argv[1], "--chunk-strands") == 0 && argc > 2) {
+            chunk_strands = std::max(0, atoi(argv[2]));
+            --argc;
+            ++argv;
+        } else if (strcmp(argv[1], "--lod-strategy") == 0 && argc > 2) {
+            lod_strategy = ParseLODStrategy(argv[2]);
+            if (lod_strategy < 0) {
+                fprintf(stderr, "Unknown LOD strategy \"%s\".\n", argv[2]);
+                return EXIT_FAILURE;
+            }
+            --argc;
+            ++argv;
+        } else if (strcmp(argv[1], "--benchmark") == 0) {
+            benchmark = true;
+        } else if (strcmp(argv[1], "--cache") == 0 && argc > 2) {
+            cache_dir = argv[2];
+            --argc;
+            ++argv;
+        } else {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        --argc;
+        ++argv;
+    }
+
     if (argc <= 2 || strcmp(argv[1], "--help") == 0 ||
         strcmp(argv[1], "-h") == 0) {
         fprintf(stderr,
-                "usage: cyhair2pbrt [CyHair filename] [pbrt output filename] "
-                "(lod level) (max strands) (thickness)\n");
+                "usage: cyhair2pbrt (--binary) (--nthreads n) "
+                "(--chunk-strands n) (--lod-strategy s) (--benchmark) "
+                "(--cache dir) "
+                "[CyHair filename] [pbrt output filename] (lod levels) "
+                "(max strands) (thickness)\n"
+                "With --binary, strands are stored in <output>.pbrthair "
+                "files that pbrt memory-maps.\n"
+                "--nthreads sets the number of conversion threads (default: "
+                "all cores); the output doesn't depend on it.\n"
+                "--chunk-strands reads and converts n strands at a time, so "
+                "that memory use doesn't grow with\n"
+                "the size of the groom; LOD levels then only merge strands "
+                "within spatially coherent chunks.\n"
+                "--lod-strategy selects how LOD levels pick the strands to "
+                "merge with a seed strand:\n"
+                "  segments: mean length difference of matching segments "
+                "below the cluster radius\n"
+                "  root: root distance below the cluster radius (default)\n"
+                "  startend: mean root and tip distance below the cluster "
+                "radius\n"
+                "  sample: mean distance of sampled CPs below the cluster "
+                "radius\n"
+                "--benchmark writes no files but reports time, strand counts "
+                "and the CP distance of merged\n"
+                "strands to their source strands for each strategy (or the "
+                "one given) on the first chunk.\n"
+                "--cache keeps converted output in dir, keyed by a hash of "
+                "the CyHair file and the options,\n"
+                "and copies it from there if it is converted again; binary "
+                "hair files are used in place.\n"
+                "With lod levels = n > 0, the full resolution hair is "
+                "written to the output file and\n"
+                "merged levels 1..n to <output>_lod1.pbrt ... "
+                "<output>_lodn.pbrt.\n"
+                "All levels are also written as a single \"hairlod\" shape "
+                "to <output>_hairlod.pbrt.\n");
         return EXIT_FAILURE;
     }
 
-    FILE *f = (strcmp(argv[2], "-") == 0) ? stdout : fopen(argv[2], "w");
-    if (!f) {
-        perror(argv[2]);
+    int lod_levels = 0;
+    if (argc > 3)
+        lod_levels = std::max(0, atoi(argv[3]));
+
+    if ((lod_levels > 0 || binary || !cache_dir.empty()) && !benchmark &&
+        strcmp(argv[2], "-") == 0) {
+        fprintf(stderr, "An output filename is required with lod levels, "
+                "--binary or --cache.\n");
         return EXIT_FAILURE;
     }
 
-	int lod_level = -1;
-	if (argc > 3)
-		lod_level = atoi(argv[3]);
-
     int max_strands = -1;         // -1 = Convert all strands
     float user_thickness = 1.0f;  // -1 = Use thickness in CyHair file.
     if (argc > 4) {
@@ -580,61 +1485,201 @@ int main(int argc, char *argv[]) {
         user_thickness = atof(argv[5]);
     }
 
+    // With a cache, output is written to a new entry unless one exists
+    std::string output = argv[2], cache_entry, cache_tmp;
+    TemporaryDirectory cache_tmp_dir;
+    if (!cache_dir.empty() && !benchmark) {
+        char options[256];
+        snprintf(options, sizeof(options),
+                 "binary %d chunk %d strategy %d levels %d strands %d "
+                 "thickness %a",
+                 binary, chunk_strands, lod_strategy, lod_levels, max_strands,
+                 static_cast<double>(user_thickness));
+        uint64_t hash;
+        if (!HashFile(argv[1], options, &hash) || !MakeDirectory(cache_dir))
+            return EXIT_FAILURE;
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx",
+                 static_cast<unsigned long long>(hash));
+        cache_entry = cache_dir + "/" + name;
+        if (IsDirectory(cache_entry)) {
+            fprintf(stderr, "Using cached conversion %s.\n",
+                    cache_entry.c_str());
+            return CopyCacheEntry(cache_entry, argv[2], lod_levels, binary)
+                       ? EXIT_SUCCESS
+                       : EXIT_FAILURE;
+        }
+        cache_tmp = cache_entry + ".tmp" + std::to_string(ProcessId());
+        if (!MakeDirectory(cache_tmp)) return EXIT_FAILURE;
+        cache_tmp_dir.path = cache_tmp;
+        output = cache_tmp + "/hair.pbrt";
+    }
+
     cyhair::CyHair hair;
-    bool ret = hair.Load(argv[1]);
-    if (!ret) {
+    if (!hair.Open(argv[1])) {
         fprintf(stderr, "Failed to load CyHair file [ %s ]\n", argv[1]);
         return EXIT_FAILURE;
     }
 
+    size_t num_strands = hair.num_strands_;
+    if (max_strands > 0)
+        num_strands = std::min(num_strands, static_cast<size_t>(max_strands));
+    size_t chunk = num_strands;
+    if (chunk_strands > 0)
+        chunk = std::min(chunk, static_cast<size_t>(chunk_strands));
+    const size_t num_chunks = chunk > 0 ? (num_strands + chunk - 1) / chunk : 0;
+    if (lod_strategy >= 0)
+        hair.lod_strategy_ = static_cast<cyhair::LODStrategy>(lod_strategy);
+
+    if (benchmark) {
+        std::vector<unsigned int> strands;
+        for (size_t i = 0; i < chunk; i++)
+            strands.push_back(static_cast<unsigned int>(i));
+        if (!hair.ReadStrands(strands)) {
+            fprintf(stderr, "Failed to read CyHair data\n");
+            return EXIT_FAILURE;
+        }
+        pbrt::ParallelInit();
+        BenchmarkLODStrategies(&hair, std::max(1, lod_levels), user_thickness,
+                               lod_strategy);
+        pbrt::ParallelCleanup();
+        return EXIT_SUCCESS;
+    }
+    hair.verbose_ = num_chunks <= 1;
+
+    // With several chunks, the full resolution strands are converted in file
+    // order and their roots recorded; LOD levels are then built from chunks
+    // of strands sorted by root position, so that clusters are mostly found
+    // within a chunk.
+    const bool spatial_lod = lod_levels > 0 && num_chunks > 1;
+    std::vector<float> roots;
+
+    HairMeshWriter mesh(binary ? BinaryFilename(output) : std::string());
+    std::vector<std::string> lodFilenames;
+    std::vector<std::unique_ptr<HairMeshWriter>> lodMeshes;
+    for (int level = 1; level <= lod_levels; level++) {
+        lodFilenames.push_back(
+            SiblingFilename(output, "_lod" + std::to_string(level)));
+        lodMeshes.emplace_back(new HairMeshWriter(
+            binary ? BinaryFilename(lodFilenames.back()) : std::string()));
+    }
+    HairLODWriter hairlod(lod_levels);
+    std::vector<float> lodRadius(lod_levels + 1, 0.0f);
+
     std::vector<float> points;
     std::vector<float> radiuss;
+    std::vector<int> strand_segments;
+    std::vector<cyhair::HairLODLevel> lods;
     const float vertex_scale[3] = {1.0f, 1.0f, 1.0f};
     const float vertex_translate[3] = {0.0f, 0.0f, 0.0f};
-    ret = hair.ToCubicBezierCurves(&points, &radiuss, vertex_scale,
-                                 vertex_translate, max_strands, user_thickness, lod_level);
+    std::vector<unsigned int> strands;
+    pbrt::ParallelInit();
+    bool ret = true;
+    for (int pass = 0; pass < (spatial_lod ? 2 : 1) && ret; pass++) {
+        std::vector<unsigned int> order;
+        if (pass == 1) order = SpatialStrandOrder(roots);
+        for (size_t first = 0; first < num_strands && ret; first += chunk) {
+            size_t end = std::min(num_strands, first + chunk);
+            strands.clear();
+            for (size_t i = first; i < end; i++)
+                strands.push_back(pass == 1 ? order[i]
+                                            : static_cast<unsigned int>(i));
+            ret = hair.ReadStrands(strands) &&
+                  hair.ToCubicBezierCurves(
+                      &points, &radiuss, &strand_segments, vertex_scale,
+                      vertex_translate, -1, user_thickness,
+                      spatial_lod && pass == 0 ? 0 : lod_levels, &lods);
+            if (!ret) break;
+            if (spatial_lod && pass == 0)
+                for (size_t i = 0; i < strands.size(); i++)
+                    roots.insert(roots.end(),
+                                 &hair.points_[3 * hair.loaded_offsets_[i]],
+                                 &hair.points_[3 * hair.loaded_offsets_[i]] + 3);
+            if (pass == 0) {
+                ret = mesh.Add(points, radiuss, strand_segments) &&
+                      (lod_levels == 0 || hairlod.Add(0, 0, points, radiuss));
+            }
+            for (const cyhair::HairLODLevel &lod : lods) {
+                lodRadius[lod.level] = lod.cluster_radius;
+                ret = ret &&
+                      lodMeshes[lod.level - 1]->Add(lod.vertices, lod.radiuss,
+                                                    lod.strand_segments,
+                                                    &lod.coverages) &&
+                      hairlod.Add(lod.level, lod.cluster_radius, lod.vertices,
+                                  lod.radiuss, &lod.coverages,
+                                  &lod.strand_segments);
+            }
+            lods.clear();
+            if (num_chunks > 1)
+                fprintf(stderr, "\rConverted chunk %d/%d (pass %d)",
+                        static_cast<int>(first / chunk + 1),
+                        static_cast<int>(num_chunks), pass + 1);
+        }
+        if (num_chunks > 1) fprintf(stderr, "\n");
+    }
+    pbrt::ParallelCleanup();
+    hair.Close();
     if (!ret) {
         fprintf(stderr, "Failed to convert CyHair data\n");
         return EXIT_FAILURE;
     }
 
-    double bounds[2][3] = {{1e30, 1e30, 1e30}, {-1e30, -1e30, -1e30}};
-    for (size_t i = 0; i < points.size() / 3; ++i) {
-        const double thickness = static_cast<double>(radiuss[i]);
-        for (size_t c = 0; c < 3; ++c) {
-            bounds[0][c] =
-                std::min(bounds[0][c],
-                         static_cast<double>(points[3 * i + c]) - thickness);
-            bounds[1][c] =
-                std::max(bounds[1][c],
-                         static_cast<double>(points[3 * i + c]) + thickness);
-        }
+    FILE *f = (output == "-") ? stdout : fopen(output.c_str(), "w");
+    if (!f) {
+        perror(output.c_str());
+        return EXIT_FAILURE;
     }
-    fprintf(f, "# Converted from \"%s\" by cyhair2pbrt\n", argv[1]);
-    fprintf(f, "# The number of strands = %d. user_thickness = %f\n",
-            static_cast<int>(radiuss.size() / 4),
-            static_cast<double>(user_thickness));
-    fprintf(f, "# Scene bounds: (%f, %f, %f) - (%f, %f, %f)\n\n\n",
-            bounds[0][0], bounds[0][1], bounds[0][2], bounds[1][0],
-            bounds[1][1], bounds[1][2]);
-
-    const size_t num_curves = radiuss.size() / 4;
-    for (size_t i = 0; i < num_curves; i++) {
-        fprintf(f, "Shape \"curve\" \"string type\" [ \"cylinder\" ] \"point P\" [ ");
+    if (!mesh.Finish(f, argv[1], user_thickness)) return EXIT_FAILURE;
+    if (f != stdout) fclose(f);
 
-        for (size_t j = 0; j < 12; j++) {
-            fprintf(f, "%f ", static_cast<double>(points[12 * i + j]));
+    fprintf(stderr, "Converted %d strands (%d segments).\n",
+            static_cast<int>(mesh.NumStrands()),
+            static_cast<int>(mesh.NumSegments()));
+
+    for (int level = 1; level <= lod_levels; level++) {
+        const std::string &filename = lodFilenames[level - 1];
+        HairMeshWriter &lodMesh = *lodMeshes[level - 1];
+        FILE *lf = fopen(filename.c_str(), "w");
+        if (!lf) {
+            perror(filename.c_str());
+            return EXIT_FAILURE;
         }
-
-        fprintf(f, " ] \"float width0\" [ %f ] \"float width1\" [ %f ]\n",
-                static_cast<double>(radiuss[4 * i + 0]),
-                static_cast<double>(radiuss[4 * i + 3]));		
+        fprintf(lf, "# LOD level %d: %d strands, cluster radius %f\n", level,
+                static_cast<int>(lodMesh.NumStrands()),
+                static_cast<double>(lodRadius[level]));
+        bool ok = lodMesh.Finish(lf, argv[1], user_thickness);
+        fclose(lf);
+        if (!ok) return EXIT_FAILURE;
+        fprintf(stderr, "Wrote LOD level %d (%d strands) to %s.\n", level,
+                static_cast<int>(lodMesh.NumStrands()), filename.c_str());
     }
 
-    if (f != stdout) fclose(f);
+    if (lod_levels > 0) {
+        std::string filename = SiblingFilename(output, "_hairlod");
+        FILE *lf = fopen(filename.c_str(), "w");
+        if (!lf) {
+            perror(filename.c_str());
+            return EXIT_FAILURE;
+        }
+        bool ok = hairlod.Finish(lf, argv[1]);
+        fclose(lf);
+        if (!ok) return EXIT_FAILURE;
+        fprintf(stderr, "Wrote all levels as \"hairlod\" shape to %s.\n",
+                filename.c_str());
+    }
 
-    fprintf(stderr, "Converted %d strands.\n",
-            static_cast<int>(radiuss.size() / 4));
+    if (!cache_tmp.empty()) {
+        // Another conversion may have completed the same entry meanwhile;
+        // then ours is removed with _cache_tmp_dir_
+        if (rename(cache_tmp.c_str(), cache_entry.c_str()) != 0 &&
+            !IsDirectory(cache_entry)) {
+            perror(cache_entry.c_str());
+            return EXIT_FAILURE;
+        }
+        if (!CopyCacheEntry(cache_entry, argv[2], lod_levels, binary))
+            return EXIT_FAILURE;
+        fprintf(stderr, "Cached conversion in %s.\n", cache_entry.c_str());
+    }
 
     return EXIT_SUCCESS;
 }
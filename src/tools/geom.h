@@ -2,6 +2,8 @@
 #define GEOM_HPP_
 
 #include <iostream>
+#include <limits>
+#include <algorithm>
 
 namespace cyhair {
 
@@ -10,6 +10,9 @@
 #include <iostream>
 #include <algorithm>
 #include <memory>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
 
 #include "geom.h"
 
@@ -35,6 +38,9 @@ namespace cyhair {
 			std::vector<real3> cps;
 			std::vector<float> radii;
 			std::vector<std::array<unsigned, 4>> cpInfo;
+			// Fraction of the width covered by the strands merged into this
+			// one; 1 for source strands.
+			float coverage = 1.0f;
 	};
 
 	inline float ManhattanDistance(real3 p0, real3 p1)
@@ -66,6 +72,71 @@ namespace cyhair {
 		return sqrt(dx * dx + dy * dy + dz * dz);
 	}
 
+	// Uniform grid over strand root points used by the LOD clustering.
+	// The cell size equals the clustering radius, so all roots within
+	// `radius` of a query point lie in the 3x3x3 block of cells around it.
+	// Strands are removed from the grid once they have been merged.
+	class HairRootGrid {
+	public:
+		HairRootGrid(const std::vector<Hair> &hairs, float radius)
+			: hairs_(hairs), radius_(radius), invCellSize_(1.0f / radius) {
+			for (size_t i = 0; i < hairs_.size(); i++)
+				cells_[CellKey(hairs_[i].cps[0])].push_back(i);
+		}
+
+		// Collects all strands whose root lies strictly within `radius` of
+		// `p` and removes them from the grid.
+		void ExtractNeighbors(const real3 &p, std::vector<size_t> *result) {
+			int c[3];
+			CellCoords(p, c);
+			for (int dz = -1; dz <= 1; dz++)
+				for (int dy = -1; dy <= 1; dy++)
+					for (int dx = -1; dx <= 1; dx++) {
+						auto it = cells_.find(PackKey(c[0] + dx, c[1] + dy, c[2] + dz));
+						if (it == cells_.end()) continue;
+						std::vector<size_t> &cell = it->second;
+						for (size_t i = 0; i < cell.size();) {
+							if (distance(p, hairs_[cell[i]].cps[0]) < radius_) {
+								result->push_back(cell[i]);
+								cell[i] = cell.back();
+								cell.pop_back();
+							} else
+								i++;
+						}
+						if (cell.empty()) cells_.erase(it);
+					}
+		}
+
+		// Returns an extracted strand to the grid, e.g. one that was found
+		// as a neighbor but not merged.
+		void Insert(size_t i) {
+			cells_[CellKey(hairs_[i].cps[0])].push_back(i);
+		}
+
+	private:
+		void CellCoords(const real3 &p, int c[3]) const {
+			for (int i = 0; i < 3; i++)
+				c[i] = static_cast<int>(std::floor(p[i] * invCellSize_));
+		}
+
+		static uint64_t PackKey(int x, int y, int z) {
+			// 21 bits per axis is plenty for any sensible radius.
+			return (uint64_t(uint32_t(x) & 0x1fffff) << 42) |
+				(uint64_t(uint32_t(y) & 0x1fffff) << 21) |
+				uint64_t(uint32_t(z) & 0x1fffff);
+		}
+
+		uint64_t CellKey(const real3 &p) const {
+			int c[3];
+			CellCoords(p, c);
+			return PackKey(c[0], c[1], c[2]);
+		}
+
+		const std::vector<Hair> &hairs_;
+		const float radius_, invCellSize_;
+		std::unordered_map<uint64_t, std::vector<size_t>> cells_;
+	};
+
 	//class DirectionSorter
 	//{
 	//	real3 dir;